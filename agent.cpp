@@ -1,11 +1,26 @@
 #include "agent.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
-
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compressedtree.hpp"
+#include "hashtree.hpp"
+#include "overlay.hpp"
 #include "predict.hpp"
 #include "search.hpp"
+#include "symboltree.hpp"
 #include "util.hpp"
 
+// odd multiplier of the rolling hash of a frozen search's context window
+static const uint64_t FrozenHashBase = 0x100000001B3ULL;
+
 // construct a learning agent from the command line arguments
 
 void Agent::setOptions(options_t & options) {
@@ -26,6 +41,14 @@ void Agent::setOptions(options_t & options) {
     m_total_reward = 0.0;
     obsrew_t o_r = std::make_pair(NULL, NULL);
     m_st = new DecisionNode(o_r);
+
+    m_max_tree_depth = m_ct.back()->contextSpan();
+
+    // the new horizon and percept widths may need a longer history
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->reserveLookahead(lookahead());
+    if (m_rollout != NULL)
+        m_rollout->reserveLookahead(lookahead());
 }
 
 Agent::Agent(options_t & options) {
@@ -44,7 +67,103 @@ Agent::Agent(options_t & options) {
         m_actions_bits = c;
     }
 
-    m_ct = new ContextTree(strExtract<unsigned int>(options["ct-depth"]));
+    // one context tree per percept bit when the model is factored; the
+    // symbol context tree predicts whole percepts
+    m_factored = strExtract<int>(options["ct-factored"]) != 0;
+    if (m_factored && options["ct-backend"] == "symbol") {
+        std::cerr << "ERROR: the symbol context tree cannot be factored, "
+                "using one tree" << std::endl;
+        m_factored = false;
+    }
+    size_t n_trees = m_factored ? m_obs_bits + m_rew_bits : 1;
+
+    // node budgets, lazy extension and arena files are the exact tree's
+    std::string backend = options["ct-backend"];
+    if (backend == "hashed" || backend == "compressed"
+            || backend == "symbol") {
+        const char *exact_only[] = { "max-ct-nodes", "ct-lazy-depth",
+                "ct-lazy-visits", "ct-arena-dir" };
+        for (size_t i = 0; i < 4; i++) {
+            std::string value = options[exact_only[i]];
+            if (!value.empty() && value != "0")
+                std::cerr << "ERROR: " << exact_only[i] << " needs the "
+                        "exact context tree backend, ignoring it"
+                        << std::endl;
+        }
+    }
+
+    // Contexts read through a mask of history ages instead of the last
+    // ct-depth symbols. The ages are those seen from the first percept bit.
+    // Tree i of a factored model comes i bits later: it reads the percept
+    // bits before its own first, then the mask with its ages shifted by i.
+    std::vector<size_t> mask;
+    if (!options["ct-context"].empty()) {
+        if (!parseContextMask(options["ct-context"], mask)) {
+            std::cerr << "ERROR: malformed context mask '"
+                    << options["ct-context"] << "', ignoring it" << std::endl;
+            mask.clear();
+        } else if (!m_factored || options["ct-backend"] != "exact") {
+            std::cerr << "ERROR: context masks need a factored model and "
+                    "the exact context tree backend, ignoring it" << std::endl;
+            mask.clear();
+        }
+    }
+
+    for (size_t i = 0; i < n_trees; i++) {
+        m_ct.push_back(newContextModel(options, n_trees,
+                mask.empty() ? m_max_tree_depth : i + mask.size()));
+        if (!mask.empty()) {
+            std::vector<size_t> ages;
+            for (size_t d = 0; d < i; d++)
+                ages.push_back(d);
+            for (size_t d = 0; d < mask.size(); d++)
+                ages.push_back(mask[d] + i);
+            m_ct.back()->setContextMask(ages);
+        }
+    }
+
+    // the history needed before the trees can be updated
+    m_max_tree_depth = m_ct.back()->contextSpan();
+
+    // a shallower tree for the playouts to sample from, if one is asked for
+    m_rollout = NULL;
+    m_rollout_cycles = 0;
+    size_t rollout_depth = strExtract<size_t>(options["rollout-ct-depth"]);
+    if (rollout_depth >= m_max_tree_depth && rollout_depth > 0) {
+        std::cerr << "ERROR: the rollout context tree must be shallower "
+                "than the model, playing out with the model" << std::endl;
+    } else if (rollout_depth > 0) {
+        m_rollout = newContextTree(rollout_depth, lookahead());
+    }
+
+    // simulations write to overlays of the exact trees rather than to the
+    // trees themselves
+    if (strExtract<int>(options["ct-overlay"]) != 0) {
+        for (size_t i = 0; i < m_ct.size(); i++) {
+            ContextTree *ct = dynamic_cast<ContextTree*>(m_ct[i]);
+            if (ct == NULL) {
+                std::cerr << "ERROR: overlays need the exact context tree "
+                        "backend, simulating in place" << std::endl;
+                break;
+            }
+            m_overlays.push_back(new ContextTreeOverlay(*ct, lookahead()));
+        }
+        if (m_overlays.size() != m_ct.size()) {
+            for (size_t i = 0; i < m_overlays.size(); i++)
+                delete m_overlays[i];
+            m_overlays.clear();
+        }
+    }
+
+    // otherwise simulations journal their updates, where the backend can
+    m_journal = strExtract<int>(options["ct-journal"]) != 0;
+    m_journaling = false;
+    m_last_update_percept = false;
+
+    // or against the trees as they are, with their predictions cached
+    m_frozen = strExtract<int>(options["search-frozen"]) != 0;
+    m_freezing = false;
+    m_frozen_shift = 1;
 
     // build a new uct
     obsrew_t o_r = std::make_pair(NULL, NULL);
@@ -54,10 +173,67 @@ Agent::Agent(options_t & options) {
 
 }
 
+// Construct the context tree backend required by the options, with contexts
+// of the given depth, sharing the memory budget of a hashed tree and the
+// node budget of an exact tree between the given number of trees
+ContextModel *Agent::newContextModel(options_t &options, size_t n_trees,
+        size_t depth) {
+    std::string backend = options["ct-backend"];
+    size_t memory = strExtract<size_t>(options["ct-hash-memory"]) << 20;
+    size_t max_nodes = strExtract<size_t>(options["max-ct-nodes"]);
+    count_t lazy_visits = strExtract<count_t>(options["ct-lazy-visits"]);
+
+    if (backend == "hashed") {
+        return new HashedContextTree(depth, memory / n_trees,
+                lookahead());
+    }
+    if (backend == "compressed") {
+        return new CompressedContextTree(depth, lookahead());
+    }
+    if (backend == "symbol") {
+        return new SymbolContextTree(depth, m_obs_bits + m_rew_bits,
+                m_actions_bits, lookahead());
+    }
+    if (backend != "exact" && backend != "compare") {
+        std::cerr << "ERROR: unknown context tree backend '" << backend
+                << "', using exact" << std::endl;
+        backend = "exact";
+    }
+
+    ContextTree *ct = newContextTree(depth, lookahead(), m_obs_bits,
+            m_rew_bits);
+    std::string arena_dir = options["ct-arena-dir"];
+    if (!arena_dir.empty() && !ct->setArenaFile(arena_dir))
+        std::cerr << "ERROR: could not map the context tree's nodes to a "
+                "file in '" << arena_dir << "', keeping them in memory"
+                << std::endl;
+    if (max_nodes > 0)
+        ct->setMaxNodes(std::max<size_t>(max_nodes / n_trees, 2));
+    if (lazy_visits > 0)
+        ct->setLazyExtension(strExtract<size_t>(options["ct-lazy-depth"]),
+                lazy_visits);
+    if (backend == "exact")
+        return ct;
+
+    // the exact tree drives the agent, the hashed or compressed tree
+    // shadows it
+    ContextModel *shadow;
+    if (options["ct-shadow"] == "compressed")
+        shadow = new CompressedContextTree(depth, lookahead());
+    else
+        shadow = new HashedContextTree(depth, memory / n_trees,
+                lookahead());
+    return new ContextModelPair(ct, shadow, lookahead());
+}
+
 // destruct the agent and the corresponding context tree
 Agent::~Agent(void) {
-    if (m_ct)
-        delete m_ct;
+    endSimulation();
+    for (size_t i = 0; i < m_ct.size(); i++)
+        delete m_ct[i];
+    for (size_t i = 0; i < m_overlays.size(); i++)
+        delete m_overlays[i];
+    delete m_rollout;
 }
 
 // current lifetime of the agent in cycles
@@ -101,12 +277,12 @@ size_t Agent::maxTreeDepth(void) {
 
 // Calculate the probability of next symbol
 double Agent::getProbNextSymbol(void) {
-    return pow(2, m_ct->getLogProbNextSymbolGivenH(1));
+    return pow(2, m_ct[0]->getLogProbNextSymbolGivenH(1));
 }
 
 // the length of the stored history for an agent
 size_t Agent::historySize(void) const {
-    return m_ct->historySize();
+    return m_ct[0]->historySize();
 }
 
 // length of the search horizon used by the agent
@@ -114,6 +290,11 @@ size_t Agent::horizon(void) const {
     return m_horizon;
 }
 
+// number of symbols a search can append to the history before reverting
+size_t Agent::lookahead(void) const {
+    return m_horizon * (m_actions_bits + m_obs_bits + m_rew_bits);
+}
+
 // generate an action uniformly at random
 action_t Agent::genRandomAction(void) {
 
@@ -124,19 +305,27 @@ action_t Agent::genRandomAction(void) {
 // to our history statistics
 percept_t* Agent::genPercept(void) const {
     percept_t *percept = new percept_t[2];
-    symbol_list_t symbol_list;
-
-    // Generate the observation and reward block
-    m_ct->genRandomSymbols(symbol_list, m_obs_bits + m_rew_bits);
-    m_ct->revertHistory(m_obs_bits + m_rew_bits);
-
-    // Decode the (observation, reward) percept from symbol list
-    percept[0] = decode(symbol_list, m_obs_bits);
-    for (int i = 0; i < m_rew_bits; i++) {
-        symbol_list[i] = symbol_list[i + m_obs_bits];
+    size_t percept_bits = m_obs_bits + m_rew_bits;
+
+    // Generate the observation and reward block, and restore the context
+    // trees to their original state
+    uint64_t block = 0;
+    if (singleTree()) {
+        block = m_ct[0]->genRandomBlockAndUpdate(percept_bits);
+        m_ct[0]->revertBlock(percept_bits);
+    } else {
+        for (size_t i = 0; i < percept_bits; i++)
+            block |= uint64_t(genPerceptBitAndUpdate(i)) << i;
+        for (size_t i = percept_bits; i-- > 0;) {
+            perceptTree(i)->revert();
+            revertTreesHistory(1);
+        }
+        if (m_rollout != NULL)
+            m_rollout->revertHistory(m_rollout->historySize()
+                    - percept_bits);
     }
-    percept[1] = decode(symbol_list, m_rew_bits);
 
+    decodePercept(block, percept);
     return percept;
 }
 
@@ -144,36 +333,76 @@ percept_t* Agent::genPercept(void) const {
 // update our mixture environment model with it
 percept_t* Agent::genPerceptAndUpdate(void) {
     percept_t* percept = new percept_t[2];
-    symbol_list_t symbol_list(m_obs_bits + m_rew_bits);
+    size_t percept_bits = m_obs_bits + m_rew_bits;
 
     // Generate the observation and reward block and update the Context tree
-    m_ct->genRandomSymbolsAndUpdate(symbol_list, m_obs_bits + m_rew_bits);
+    uint64_t block = 0;
+    if (singleTree()) {
+        block = m_ct[0]->genRandomBlockAndUpdate(percept_bits);
+    } else {
+        for (size_t i = 0; i < percept_bits; i++)
+            block |= uint64_t(genPerceptBitAndUpdate(i)) << i;
+    }
+    decodePercept(block, percept);
+
+    // Update other properties
+    m_total_reward += percept[1];
+    m_last_update_percept = true;
+    return percept;
+}
 
-    // Decode the (observation, reward) percept from symbol list
-    percept[0] = decode(symbol_list, m_obs_bits);
-    for (int i = 0; i < m_rew_bits; i++) {
-        symbol_list[i] = symbol_list[i + m_obs_bits];
+// Generate a percept for a playout from the rollout tree. No tree learns
+// it: the playout is the end of the simulation, and reverting it only cuts
+// the history back.
+percept_t* Agent::genRolloutPerceptAndUpdate(void) {
+    if (!rolloutReady())
+        return genPerceptAndUpdate();
+
+    percept_t* percept = new percept_t[2];
+    size_t percept_bits = m_obs_bits + m_rew_bits;
+
+    // Generate the observation and reward block bit by bit, each bit read
+    // by the rollout tree's context of the ones before
+    uint64_t block = 0;
+    for (size_t i = 0; i < percept_bits; i++) {
+        symbol_t sym = rand01() < m_rollout->predict(true);
+        if (m_freezing) {
+            appendFrozen(sym);
+        } else {
+            for (size_t j = 0; j < m_ct.size(); j++)
+                m_ct[j]->updateHistory(sym);
+            m_rollout->updateHistory(sym);
+        }
+        block |= uint64_t(sym) << i;
     }
-    percept[1] = decode(symbol_list, m_rew_bits);
+    decodePercept(block, percept);
 
     // Update other properties
     m_total_reward += percept[1];
     m_last_update_percept = true;
+    m_rollout_cycles++;
     return percept;
 }
 
 // Update the agent's internal model of the world after receiving a percept
 void Agent::modelUpdate(percept_t observation, percept_t reward) {
     // Update internal model
-    symbol_list_t percept;
-    encodePercept(percept, observation, reward);
-
-    if (m_ct->historySize() >= m_ct->depth()) {
-        // Update the context tree with the percept
-        m_ct->update(percept);
+    size_t percept_bits = m_obs_bits + m_rew_bits;
+    uint64_t block = perceptBlock(observation, reward);
+
+    if (m_ct[0]->historySize() >= m_ct[0]->contextSpan()) {
+        // Update the context tree(s) with the percept
+        if (m_ct.size() == 1 && m_rollout == NULL) {
+            m_ct[0]->updateBlock(block, percept_bits);
+        } else {
+            for (size_t i = 0; i < percept_bits; i++)
+                updateTrees(perceptTree(i), symbol_t((block >> i) & 1));
+        }
     } else {
         // Populate the history for initial context
-        m_ct->updateHistory(percept);
+        symbol_list_t percept;
+        encodePercept(percept, observation, reward);
+        updateTreesHistory(percept);
     }
 
     // Update other properties
@@ -189,7 +418,7 @@ void Agent::modelUpdate(action_t action) {
     // Update internal model
     symbol_list_t action_syms;
     encodeAction(action_syms, action);
-    m_ct->updateHistory(action_syms);
+    updateTreesHistory(action_syms);
 
     m_time_cycle++;
     m_last_update_percept = false;
@@ -201,14 +430,60 @@ bool Agent::modelRevert(const ModelUndo &mu) {
 
     int n_cycles = m_time_cycle - mu.lifetime();
 
+    // The rollout tree learnt nothing simulated, and the last cycles may
+    // have taken their percept from it without updating any other tree
+    if (m_rollout != NULL) {
+        size_t bits = m_ct[0]->historySize() - mu.historySize();
+        m_rollout->revertHistory(m_rollout->historySize() - bits);
+    }
+    size_t rollout_cycles = std::min(m_rollout_cycles,
+            size_t(std::max(n_cycles, 0)));
+    m_rollout_cycles -= rollout_cycles;
+
+    // A simulation on overlays started from the committed trees, so
+    // dropping its changes restores them in one step
+    if (!m_committed.empty()) {
+        assert(mu.historySize() == m_committed[0]->historySize());
+        for (size_t i = 0; i < m_overlays.size(); i++)
+            m_overlays[i]->discard();
+        n_cycles = 0;
+    }
+
+    // A frozen simulation only appended to the history
+    if (m_freezing) {
+        size_t bits = m_ct[0]->historySize() - mu.historySize();
+        m_frozen_hashes.resize(m_frozen_hashes.size() - bits);
+        revertTreesHistory(bits);
+        n_cycles = 0;
+    }
+
+    // A journaled simulation is undone by copying back the nodes it
+    // changed, and the history is cut back in one step
+    if (m_journaling) {
+        for (size_t i = 0; i < m_ct.size(); i++) {
+            m_ct[i]->rollback(mu.journalMark(i));
+            m_ct[i]->revertHistory(mu.historySize());
+        }
+        n_cycles = 0;
+    }
+
     // Revert the context tree to the restoration point
     for (int i = 0; i < n_cycles; i++) {
-        for (int j = 0; j < m_obs_bits + m_rew_bits; j++) {
-            // Revert the perpcept for each cycle
-            m_ct->revert();
-            m_ct->revertHistory(m_ct->historySize() - 1);
+        // the cycles played out with the rollout tree updated no tree
+        if (size_t(i) < rollout_cycles) {
+            revertTreesHistory(m_obs_bits + m_rew_bits + m_actions_bits);
+            continue;
+        }
+        if (singleTree()) {
+            m_ct[0]->revertBlock(m_obs_bits + m_rew_bits);
+        } else {
+            for (int j = m_obs_bits + m_rew_bits - 1; j >= 0; j--) {
+                // Revert the perpcept for each cycle, most recent bit first
+                perceptTree(j)->revert();
+                revertTreesHistory(1);
+            }
         }
-        m_ct->revertHistory(m_ct->historySize() - m_actions_bits);
+        revertTreesHistory(m_actions_bits);
 
     }
 
@@ -218,9 +493,71 @@ bool Agent::modelRevert(const ModelUndo &mu) {
     return true;
 }
 
+// Swap the overlays in for the committed trees, each showing its tree as it
+// is now. Without overlays the trees journal the simulated updates instead,
+// provided every one of them can. A frozen search only hashes the context
+// window it starts from.
+void Agent::beginSimulation(void) {
+    if (!m_committed.empty() || m_journaling || m_freezing)
+        return;
+    if (m_frozen) {
+        const ContextModel *tree = m_ct.back();
+        size_t size = tree->historySize();
+        uint64_t hash = 0;
+        symbol_t sym;
+        for (size_t n = size - std::min(size, m_max_tree_depth); n < size; n++)
+            hash = hash * FrozenHashBase
+                    + (tree->nthHistorySymbol(n, sym) ? sym + 1 : 0);
+        m_frozen_shift = 1;
+        for (size_t d = 0; d < m_max_tree_depth; d++)
+            m_frozen_shift *= FrozenHashBase;
+        m_frozen_hashes.assign(1, hash);
+        m_freezing = true;
+        return;
+    }
+    if (m_overlays.empty()) {
+        if (!m_journal)
+            return;
+        m_journaling = true;
+        for (size_t i = 0; i < m_ct.size(); i++)
+            m_journaling = m_ct[i]->setJournaling(true) && m_journaling;
+        if (!m_journaling)
+            for (size_t i = 0; i < m_ct.size(); i++)
+                m_ct[i]->setJournaling(false);
+        return;
+    }
+    m_committed = m_ct;
+    for (size_t i = 0; i < m_overlays.size(); i++) {
+        m_overlays[i]->discard();
+        m_ct[i] = m_overlays[i];
+    }
+}
+
+// Swap the committed trees back in; any change left on the overlays is
+// dropped the next time they are used
+void Agent::endSimulation(void) {
+    if (m_freezing) {
+        m_frozen_hashes.clear();
+        m_frozen_cache.clear();
+        m_freezing = false;
+    }
+    if (m_journaling) {
+        for (size_t i = 0; i < m_ct.size(); i++)
+            m_ct[i]->setJournaling(false);
+        m_journaling = false;
+    }
+    if (m_committed.empty())
+        return;
+    m_ct = m_committed;
+    m_committed.clear();
+}
+
 // Reset the agent
 void Agent::reset(void) {
-    m_ct->clear();
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->clear();
+    if (m_rollout != NULL)
+        m_rollout->clear();
 
     m_time_cycle = 0;
     m_total_reward = 0.0;
@@ -230,7 +567,10 @@ void Agent::reset(void) {
 void Agent::newEpisode(void) {
     m_time_cycle = 0;
     m_total_reward = 0.0;
-    m_ct->resetHistory();
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->resetHistory();
+    if (m_rollout != NULL)
+        m_rollout->resetHistory();
 }
 
 // Get the time out
@@ -239,44 +579,546 @@ double Agent::timeout(void) {
 }
 
 // probability of selecting an action according to the
-// agent's internal model of it's own behaviour
-double Agent::getPredictedActionProb(action_t action) {
+// agent's internal model of it's own behaviour, without modifying it
+double Agent::getPredictedActionProb(action_t action) const {
+    return exp2(m_ct[0]->logProbBlock(action, m_actions_bits));
+}
+
+// Get the agent's probability of receiving a particular percept, without
+// modifying the model. A single tree predicts the whole percept as one
+// block; in a factored model tree i gives bit i after the bits before it.
+double Agent::perceptProbability(percept_t observation,
+        percept_t reward) const {
+    size_t percept_bits = m_obs_bits + m_rew_bits;
+    uint64_t percept = perceptBlock(observation, reward);
+
+    if (!m_factored)
+        return exp2(m_ct[0]->logProbBlock(percept, percept_bits));
+
     double log_probability = 0.0;
+    for (size_t i = 0; i < percept_bits; i++)
+        log_probability += perceptTree(i)->logProbBlock(percept, i + 1, i);
+    return exp2(log_probability);
+}
 
-    for (int i = 0; i < m_actions_bits; i++) {
-        log_probability += m_ct->getLogProbNextSymbolGivenHWithUpdate(
-                1 & action);
-        action /= 2;
+// The probability of every percept that can come next. A single tree
+// predicts the whole percept as one block. In a factored model each bit's
+// tree only predicts that bit, so the later bits need the earlier ones in
+// the history alone and no tree is updated.
+void Agent::perceptDistribution(std::vector<double> &probs) {
+    size_t percept_bits = m_obs_bits + m_rew_bits;
+    if (!m_factored) {
+        m_ct[0]->blockDistribution(percept_bits, probs);
+        return;
     }
+    probs.assign(size_t(1) << percept_bits, 1.0);
+    if (percept_bits > 0)
+        perceptDistribution(0, 0, 0.0, probs);
+}
+
+// fill in the percept probabilities of the factored model for the percepts
+// starting with the given bits
+void Agent::perceptDistribution(size_t length, size_t prefix,
+        double log_prob, std::vector<double> &probs) const {
+    ContextModel *tree = perceptTree(length);
+    for (int sym = 0; sym < 2; sym++) {
+        size_t percept = prefix | (size_t(sym) << length);
+        double sym_log_prob = log_prob + tree->getLogProbNextSymbolGivenH(sym);
+        if (length + 1 == m_obs_bits + m_rew_bits) {
+            probs[percept] = exp2(sym_log_prob);
+            continue;
+        }
 
-    return pow(2, log_probability);
+        for (size_t i = 0; i < m_ct.size(); i++)
+            m_ct[i]->updateHistory(symbol_t(sym));
+        perceptDistribution(length + 1, percept, sym_log_prob, probs);
+        revertTreesHistory(1);
+    }
 }
 
-// get the agent's probability of receiving a particular percept
-double Agent::perceptProbability(percept_t observation,
-        percept_t reward) const {
-    double log_probability = 0.0;
+// Snapshot files start with this word and a format version, followed by
+// the shape of the agent that saved them and then one record per tree
+static const uint64_t SnapshotMagic = 0x3157544349584941ULL; // "AIXICTW1"
+static const uint64_t SnapshotVersion = 3;
+
+// Save the context trees to a snapshot file, then map it back into fresh
+// trees and check they give bit for bit the same predictions
+bool Agent::saveModel(const std::string &path) const {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "ERROR: could not write the model to '" << path << "'"
+                << std::endl;
+        return false;
+    }
+
+    writeWord(out, SnapshotMagic);
+    writeWord(out, SnapshotVersion);
+    writeWord(out, m_ct.size());
+    writeWord(out, m_actions_bits);
+    writeWord(out, m_obs_bits);
+    writeWord(out, m_rew_bits);
+    for (size_t i = 0; i < m_ct.size(); i++) {
+        if (!m_ct[i]->save(out)) {
+            std::cerr << "ERROR: this context tree backend cannot be saved"
+                    << std::endl;
+            return false;
+        }
+    }
+    out.close();
+    if (out.fail()) {
+        std::cerr << "ERROR: could not write the model to '" << path << "'"
+                << std::endl;
+        return false;
+    }
+
+    std::vector<ContextModel*> copies;
+    for (size_t i = 0; i < m_ct.size(); i++) {
+        ContextTree *copy = new ContextTree(m_ct[i]->depth(), lookahead());
+        if (!m_ct[i]->contextMask().empty())
+            copy->setContextMask(m_ct[i]->contextMask());
+        // only exact trees can be saved
+        const ContextTree *ct = dynamic_cast<const ContextTree*>(m_ct[i]);
+        assert(ct != NULL);
+        copy->setLazyExtension(ct->lazyDepth(), ct->lazyVisits());
+        copies.push_back(copy);
+    }
+
+    bool ok = loadTrees(path, copies);
+    for (size_t i = 0; ok && i < m_ct.size(); i++) {
+        ok = copies[i]->size() == m_ct[i]->size()
+                && copies[i]->historySize() == m_ct[i]->historySize()
+                && copies[i]->logBlockProbability()
+                        == m_ct[i]->logBlockProbability();
+        // Predicting needs a full context
+        if (ok && m_ct[i]->historySize() >= m_max_tree_depth) {
+            for (int sym = 0; sym < 2; sym++)
+                ok = ok && copies[i]->getLogProbNextSymbolGivenH(sym)
+                        == m_ct[i]->getLogProbNextSymbolGivenH(sym);
+        }
+    }
+    for (size_t i = 0; i < copies.size(); i++)
+        delete copies[i];
+
+    if (!ok) {
+        std::cerr << "ERROR: the model saved to '" << path
+                << "' does not predict as the agent does" << std::endl;
+        return false;
+    }
+    aixi::log << "info: saved the model to '" << path << "'" << std::endl;
+    return true;
+}
+
+// Replace the context trees by those saved in a snapshot file
+bool Agent::loadModel(const std::string &path) {
+    if (!loadTrees(path, m_ct)) {
+        std::cerr << "ERROR: could not load the model from '" << path
+                << "', starting afresh" << std::endl;
+        reset();
+        return false;
+    }
+
+    // the snapshot keeps the history of the agent that saved it, which
+    // may have searched a shorter horizon
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->reserveLookahead(lookahead());
+
+    // the rollout tree is not saved, and learns again from here
+    if (m_rollout != NULL)
+        m_rollout->clear();
+    m_last_update_percept = false;
+    aixi::log << "info: loaded the model from '" << path << "'" << std::endl;
+    return true;
+}
+
+// Map a snapshot file read-only and restore the given trees from it. The
+// mapping is released once the trees have copied their records out.
+bool Agent::loadTrees(const std::string &path,
+        const std::vector<ContextModel*> &trees) const {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *data = static_cast<const char *>(map);
+    const char *end = data + st.st_size;
+    uint64_t magic, version, n_trees, actions_bits, obs_bits, rew_bits;
+    bool ok = readWord(data, end, magic) && readWord(data, end, version)
+            && readWord(data, end, n_trees)
+            && readWord(data, end, actions_bits)
+            && readWord(data, end, obs_bits) && readWord(data, end, rew_bits);
+    ok = ok && magic == SnapshotMagic && version == SnapshotVersion
+            && n_trees == trees.size() && actions_bits == m_actions_bits
+            && obs_bits == m_obs_bits && rew_bits == m_rew_bits;
+    for (size_t i = 0; ok && i < trees.size(); i++)
+        ok = trees[i]->load(data, end);
+
+    munmap(map, st.st_size);
+    return ok;
+}
+
+// symbols the exact context trees take at a time while pretraining
+static const size_t PretrainBlock = size_t(1) << 22;
+
+// Train the context trees on a recorded run. The log's header names its
+// columns; lines without a full cycle, such as the separator between the
+// games of a two-game run, are skipped. Once the history holds a whole
+// context, exact context trees take the cycles in blocks through their
+// bulk update, learning the percept bits and only appending the action
+// bits to their history; any other backend goes cycle by cycle through
+// modelUpdate. A rollout tree learns every percept bit alongside them. The
+// lifetime and reward are left as they were.
+bool Agent::pretrain(const std::string &path) {
+    assert(!m_last_update_percept);
+    std::ifstream in(path.c_str());
+    std::string line;
+    if (!in.is_open() || !std::getline(in, line)) {
+        std::cerr << "ERROR: could not read the log '" << path << "'"
+                << std::endl;
+        return false;
+    }
 
-    for (int i = 0; i < m_obs_bits; i++) {
-        // Calculate the log probability of seeing the observation bits
-        log_probability += m_ct->getLogProbNextSymbolGivenHWithUpdate(
-                1 & observation);
-        observation /= 2;
+    // the columns of the observation, reward and action
+    const char *names[3] = { "observation", "reward", "action" };
+    size_t columns[3];
+    size_t found = 0, last_column = 0;
+    std::istringstream header(line);
+    std::string field;
+    for (size_t i = 0; std::getline(header, field, ','); i++) {
+        field.erase(0, field.find_first_not_of(' '));
+        for (int c = 0; c < 3; c++) {
+            if (field == names[c]) {
+                columns[c] = i;
+                found |= 1 << c;
+                last_column = std::max(last_column, i);
+            }
+        }
+    }
+    if (found != 7) {
+        std::cerr << "ERROR: the log '" << path << "' has no observation, "
+                "reward and action columns" << std::endl;
+        return false;
     }
 
-    for (int i = 0; i < m_rew_bits; i++) {
-        // Calculate the log probability of seeing the reward bits
-        log_probability += m_ct->getLogProbNextSymbolGivenHWithUpdate(
-                1 & reward);
-        reward /= 2;
+    std::vector<ContextTree*> trees;
+    for (size_t i = 0; i < m_ct.size(); i++)
+        trees.push_back(dynamic_cast<ContextTree*>(m_ct[i]));
+    bool bulk = std::find(trees.begin(), trees.end(),
+            static_cast<ContextTree*>(NULL)) == trees.end();
+    if (m_rollout != NULL)
+        trees.push_back(m_rollout);
+
+    lifetime_t time_cycle = m_time_cycle;
+    reward_t total_reward = m_total_reward;
+    symbol_list_t percept, action_syms, block;
+    std::vector<std::vector<bool> > learn(trees.size());
+    size_t cycles = 0;
+    bool ok = true;
+    for (size_t lineno = 2; std::getline(in, line); lineno++) {
+        std::vector<long long> values;
+        std::istringstream fields(line);
+        while (std::getline(fields, field, ','))
+            values.push_back(strtoll(field.c_str(), NULL, 10));
+        if (values.size() <= last_column || line[0] == '-')
+            continue;
+
+        long long observation = values[columns[0]];
+        long long reward = values[columns[1]];
+        long long action = values[columns[2]];
+        if (observation < 0 || observation >= (1LL << m_obs_bits)
+                || !isRewardOk(reward_t(reward)) || action < 0
+                || !isActionOk(action_t(action))) {
+            std::cerr << "ERROR: line " << lineno << " of the log '" << path
+                    << "' does not fit this agent" << std::endl;
+            ok = false;
+            break;
+        }
+
+        // a masked tree may reach further back than the others
+        bool ready = bulk;
+        for (size_t i = 0; i < m_ct.size() && ready; i++)
+            ready = m_ct[i]->historySize() >= m_ct[i]->contextSpan();
+        if (!ready || (m_rollout != NULL && !rolloutReady())) {
+            modelUpdate(percept_t(observation), percept_t(reward));
+            modelUpdate(action_t(action));
+        } else {
+            encodePercept(percept, percept_t(observation), percept_t(reward));
+            encodeAction(action_syms, action_t(action));
+            // the rollout tree, last, learns every percept bit
+            for (size_t i = 0; i < trees.size(); i++) {
+                for (size_t j = 0; j < percept.size(); j++)
+                    learn[i].push_back(i == m_ct.size()
+                            || perceptTree(j) == m_ct[i]);
+                learn[i].insert(learn[i].end(), action_syms.size(), false);
+            }
+            block.insert(block.end(), percept.begin(), percept.end());
+            block.insert(block.end(), action_syms.begin(), action_syms.end());
+        }
+        cycles++;
+
+        if (block.size() >= PretrainBlock) {
+            for (size_t i = 0; i < trees.size(); i++) {
+                trees[i]->bulkUpdate(block, learn[i]);
+                learn[i].clear();
+            }
+            block.clear();
+        }
     }
+    for (size_t i = 0; i < trees.size() && !block.empty(); i++)
+        trees[i]->bulkUpdate(block, learn[i]);
+
+    m_time_cycle = time_cycle;
+    m_total_reward = total_reward;
+    m_last_update_percept = false;
+    aixi::log << "info: pretrained the model on " << cycles
+            << " cycles of the log '" << path << "'" << std::endl;
+    return ok;
+}
 
-    return pow(2, log_probability);
+// parse "first-last" or a single number into an inclusive range
+static bool parseRange(const std::string &str, size_t &first, size_t &last) {
+    std::istringstream iss(str);
+    char dash;
+    if (!(iss >> first))
+        return false;
+    last = first;
+    if (iss >> dash && (dash != '-' || !(iss >> last)))
+        return false;
+    return iss.eof() && first <= last;
+}
+
+// Parse a context mask such as "action:1,observation:1:0-3,reward:1" into
+// history ages, nearest the root first. A field is named with the cycle it
+// comes from, 1 for the last one, and optionally a range of its bits,
+// bit 0 being the least significant; its bits are read most recent first.
+// "history:first-last" names ages directly.
+bool Agent::parseContextMask(const std::string &spec,
+        std::vector<size_t> &ages) const {
+    size_t cycle_bits = m_actions_bits + m_obs_bits + m_rew_bits;
+    std::istringstream items(spec);
+    std::string item;
+
+    ages.clear();
+    while (std::getline(items, item, ',')) {
+        std::vector<std::string> parts;
+        std::istringstream fields(item);
+        std::string part;
+        while (std::getline(fields, part, ':'))
+            parts.push_back(part);
+        if (parts.size() < 2 || parts.size() > 3)
+            return false;
+
+        size_t first, last;
+        if (parts[0] == "history") {
+            if (parts.size() != 2 || !parseRange(parts[1], first, last))
+                return false;
+            for (size_t age = first; age <= last; age++)
+                ages.push_back(age);
+            continue;
+        }
+
+        // A cycle is the percept, observation then reward, followed by the
+        // action, each encoded least significant bit first; offset is the
+        // age of the field's most significant bit in the last cycle
+        size_t offset, width;
+        if (parts[0] == "action") {
+            offset = 0;
+            width = m_actions_bits;
+        } else if (parts[0] == "reward") {
+            offset = m_actions_bits;
+            width = m_rew_bits;
+        } else if (parts[0] == "observation") {
+            offset = m_actions_bits + m_rew_bits;
+            width = m_obs_bits;
+        } else {
+            return false;
+        }
+
+        size_t cycle;
+        if (!parseRange(parts[1], cycle, last) || cycle != last || cycle == 0)
+            return false;
+        first = 0;
+        last = width - 1;
+        if (parts.size() == 3
+                && (!parseRange(parts[2], first, last) || last >= width))
+            return false;
+
+        size_t base = (cycle - 1) * cycle_bits + offset;
+        for (size_t bit = last + 1; bit-- > first;)
+            ages.push_back(base + width - 1 - bit);
+    }
+    return !ages.empty();
+}
+
+// write the statistics of the context trees to a log
+void Agent::logModelStats(std::ostream &out) const {
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->logStats(out);
+    if (m_rollout != NULL)
+        m_rollout->logStats(out);
+}
+
+// context nodes evicted by all context trees
+unsigned long long Agent::modelEvictions(void) const {
+    unsigned long long total = 0;
+    for (size_t i = 0; i < m_ct.size(); i++)
+        total += m_ct[i]->evictions();
+    return total;
+}
+
+// node storage released by those evictions, in bytes
+unsigned long long Agent::modelReclaimedBytes(void) const {
+    unsigned long long total = 0;
+    for (size_t i = 0; i < m_ct.size(); i++)
+        total += m_ct[i]->reclaimedBytes();
+    return total;
+}
+
+// statistics of all context trees, summed
+void Agent::modelStats(model_stats_t &stats) const {
+    std::vector<const ContextModel*> trees(m_ct.begin(), m_ct.end());
+    if (m_rollout != NULL)
+        trees.push_back(m_rollout);
+
+    model_stats_t tree;
+    trees[0]->stats(stats);
+    for (size_t i = 1; i < trees.size(); i++) {
+        trees[i]->stats(tree);
+        stats.nodes += tree.nodes;
+        if (stats.depth_nodes.size() < tree.depth_nodes.size())
+            stats.depth_nodes.resize(tree.depth_nodes.size(), 0);
+        for (size_t d = 0; d < tree.depth_nodes.size(); d++)
+            stats.depth_nodes[d] += tree.depth_nodes[d];
+        stats.bytes += tree.bytes;
+        stats.created += tree.created;
+        stats.destroyed += tree.destroyed;
+        if (tree.max_history > stats.max_history)
+            stats.max_history = tree.max_history;
+    }
+}
+
+// the journal position of every context tree
+void Agent::journalMarks(std::vector<size_t> &marks) const {
+    marks.resize(m_ct.size());
+    for (size_t i = 0; i < m_ct.size(); i++)
+        marks[i] = m_ct[i]->journalMark();
 }
 
 // Return context tree
-ContextTree * Agent::contextTree() {
-    return m_ct;
+ContextModel * Agent::contextTree() {
+    return m_ct[0];
+}
+
+// context tree predicting the given percept bit
+ContextModel *Agent::perceptTree(size_t bit) const {
+    return m_ct[m_factored ? bit : 0];
+}
+
+// whether there is a rollout tree with the history of a whole context
+bool Agent::rolloutReady(void) const {
+    return m_rollout != NULL
+            && m_rollout->historySize() >= m_rollout->contextSpan();
+}
+
+// whether a single tree learns whole percepts and no other tree keeps a
+// history
+bool Agent::singleTree(void) const {
+    return m_ct.size() == 1 && m_rollout == NULL && !m_freezing;
+}
+
+// generate a percept bit from the tree predicting it, and append it to the
+// history of every other context tree
+symbol_t Agent::genPerceptBitAndUpdate(size_t bit) const {
+    if (m_freezing) {
+        symbol_t sym = rand01() < frozenProbability(bit);
+        appendFrozen(sym);
+        return sym;
+    }
+    ContextModel *tree = perceptTree(bit);
+    symbol_t sym = tree->genRandomSymbolAndUpdate();
+    for (size_t i = 0; i < m_ct.size(); i++) {
+        if (m_ct[i] != tree)
+            m_ct[i]->updateHistory(sym);
+    }
+    if (m_rollout != NULL)
+        m_rollout->updateHistory(sym);
+    return sym;
+}
+
+// append a symbol to the history of every context tree, updating the
+// statistics of the given tree, and of the rollout tree once it can be
+void Agent::updateTrees(ContextModel *tree, symbol_t sym) const {
+    for (size_t i = 0; i < m_ct.size(); i++) {
+        if (m_ct[i] == tree)
+            m_ct[i]->update(sym);
+        else
+            m_ct[i]->updateHistory(sym);
+    }
+    if (rolloutReady())
+        m_rollout->update(sym);
+    else if (m_rollout != NULL)
+        m_rollout->updateHistory(sym);
+}
+
+// add symbols to the history of every context tree
+void Agent::updateTreesHistory(const symbol_list_t &symbol_list) const {
+    if (m_freezing) {
+        for (size_t j = 0; j < symbol_list.size(); j++)
+            appendFrozen(symbol_list[j]);
+        return;
+    }
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->updateHistory(symbol_list);
+    if (m_rollout != NULL)
+        m_rollout->updateHistory(symbol_list);
+}
+
+// The probability a percept bit is 1, from the cache if the same bit has
+// been predicted after the same context window during this search. Keys
+// are 64-bit hashes, so distinct contexts colliding are not told apart.
+double Agent::frozenProbability(size_t bit) const {
+    uint64_t key = m_frozen_hashes.back()
+            ^ (uint64_t(bit + 1) * 0x9E3779B97F4A7C15ULL);
+    std::unordered_map<uint64_t, double>::const_iterator it =
+            m_frozen_cache.find(key);
+    if (it != m_frozen_cache.end())
+        return it->second;
+    double prob = perceptTree(bit)->predict(true);
+    m_frozen_cache.insert(std::make_pair(key, prob));
+    return prob;
+}
+
+// Append a symbol to the history of every context tree, and the hash of the
+// window of history the contexts reach over once it is in. The hash is a
+// polynomial in the symbols of the window, so the one leaving it is taken
+// out again.
+void Agent::appendFrozen(symbol_t sym) const {
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->updateHistory(sym);
+    if (m_rollout != NULL)
+        m_rollout->updateHistory(sym);
+    const ContextModel *tree = m_ct.back(); // reaching back the furthest
+    uint64_t hash = m_frozen_hashes.back() * FrozenHashBase + sym + 1;
+    size_t size = tree->historySize();
+    symbol_t out;
+    if (size > m_max_tree_depth
+            && tree->nthHistorySymbol(size - 1 - m_max_tree_depth, out))
+        hash -= (out + 1) * m_frozen_shift;
+    m_frozen_hashes.push_back(hash);
+}
+
+// shrink the history of every context tree by the given number of symbols
+void Agent::revertTreesHistory(size_t bits) const {
+    for (size_t i = 0; i < m_ct.size(); i++)
+        m_ct[i]->revertHistory(m_ct[i]->historySize() - bits);
 }
 
 // action sanity check
@@ -315,6 +1157,19 @@ percept_t Agent::decodeReward(const symbol_list_t &symlist) const {
     return decode(symlist, m_rew_bits);
 }
 
+// A percept as a block of symbols, the observation's bits first, each
+// value least significant bit first as encode() writes it
+uint64_t Agent::perceptBlock(percept_t observation, percept_t reward) const {
+    return observation | (uint64_t(reward) << m_obs_bits);
+}
+
+// Decode the (observation, reward) percept from a block of symbols
+void Agent::decodePercept(uint64_t block, percept_t *percept) const {
+    percept[0] = percept_t(block & ((uint64_t(1) << m_obs_bits) - 1));
+    percept[1] = percept_t((block >> m_obs_bits)
+            & ((uint64_t(1) << m_rew_bits) - 1));
+}
+
 // return the search tree
 DecisionNode * Agent::searchTree() {
     return m_st;
@@ -346,5 +1201,6 @@ ModelUndo::ModelUndo(const Agent &agent) {
     m_lifetime = agent.lifetime();
     m_reward = agent.reward();
     m_history_size = agent.historySize();
+    agent.journalMarks(m_journal_marks);
 }
 
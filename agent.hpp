@@ -2,13 +2,19 @@
 #define __AGENT_HPP__
 
 #include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
 
 #include "main.hpp"
 #include "predict.hpp"
 #include "search.hpp"
 #include "util.hpp"
 
-class ContextTree;
+class ContextModel;
+
+class ContextTreeOverlay;
 
 class ModelUndo;
 
@@ -51,6 +57,9 @@ public:
     // length of the search horizon used by the agent
     size_t horizon(void) const;
 
+    // number of symbols a search can append to the history before reverting
+    size_t lookahead(void) const;
+
     // generate an action uniformly at random
     action_t genRandomAction(void);
 
@@ -62,6 +71,11 @@ public:
     // update our mixture environment model with it
     percept_t* genPerceptAndUpdate(void);
 
+    // generate a percept for a playout beyond the search tree from the
+    // shallow rollout tree, only appending it to the history; the full
+    // model gives it when there is no rollout tree with a whole context
+    percept_t* genRolloutPerceptAndUpdate(void);
+
     // update the internal agent's model of the world
     // due to receiving a percept or performing an action
     void modelUpdate(percept_t observation, percept_t reward);
@@ -71,6 +85,16 @@ public:
     // to that of a previous time cycle, false on failure
     bool modelRevert(const ModelUndo &mu);
 
+    // route model updates to copy-on-write overlays of the context trees
+    // until endSimulation, leaving the committed trees untouched; without
+    // overlays, journal the updates so that modelRevert copies back what
+    // they changed. A frozen search leaves the trees as they are instead.
+    void beginSimulation(void);
+    void endSimulation(void);
+
+    // the journal position of every context tree, for a later revert
+    void journalMarks(std::vector<size_t> &marks) const;
+
     // Get the Context tree depth
     size_t maxTreeDepth(void);
 
@@ -87,14 +111,45 @@ public:
     double timeout(void);
 
     // probability of selecting an action according to the
-    // agent's internal model of it's own behaviour
-    double getPredictedActionProb(action_t action);
+    // agent's internal model of it's own behaviour; read-only, but not
+    // safe while the agent searches, since search changes the model
+    double getPredictedActionProb(action_t action) const;
 
-    // get the agent's probability of receiving a particular percept
+    // get the agent's probability of receiving a particular percept,
+    // read-only like getPredictedActionProb
     double perceptProbability(percept_t observation, percept_t reward) const;
 
-    // Return context tree
-    ContextTree * contextTree();
+    // the agent's probability of each percept it can receive next, indexed
+    // by observation + (reward << observation-bits); the model is left as
+    // it was
+    void perceptDistribution(std::vector<double> &probs);
+
+    // save the context trees to a binary snapshot file, then map it back
+    // and check that it predicts exactly as the trees do; false on failure
+    bool saveModel(const std::string &path) const;
+
+    // replace the context trees by those saved in a snapshot file, false
+    // if it cannot be read or was saved by an agent of another shape
+    bool loadModel(const std::string &path);
+
+    // train the context trees on the cycles of a run's csv log, without
+    // searching, before a live run; false if the log cannot be read or
+    // does not fit the agent
+    bool pretrain(const std::string &path);
+
+    // write the statistics of the context trees to a log
+    void logModelStats(std::ostream &out) const;
+
+    // context nodes evicted by the context trees, and the bytes released
+    unsigned long long modelEvictions(void) const;
+    unsigned long long modelReclaimedBytes(void) const;
+
+    // statistics of the context trees taken together, the rollout tree's
+    // included: nodes at each depth added up, the longest history of any
+    void modelStats(model_stats_t &stats) const;
+
+    // Return context tree (the first percept bit's tree in factored mode)
+    ContextModel * contextTree();
 
     // return the search tree
     DecisionNode * searchTree();
@@ -115,6 +170,57 @@ private:
     // reward sanity check
     bool isRewardOk(reward_t reward) const;
 
+    // construct the context tree backend required by the options, with
+    // contexts of the given depth
+    ContextModel *newContextModel(options_t &options, size_t n_trees,
+            size_t depth);
+
+    // turn a context mask spec into the history ages it reads, as seen
+    // from the first bit of a percept; false if it is malformed
+    bool parseContextMask(const std::string &spec,
+            std::vector<size_t> &ages) const;
+
+    // map a snapshot file read-only and restore the given trees from it
+    bool loadTrees(const std::string &path,
+            const std::vector<ContextModel*> &trees) const;
+
+    // context tree predicting the given percept bit
+    ContextModel *perceptTree(size_t bit) const;
+
+    // whether there is a rollout tree with the history of a whole context
+    bool rolloutReady(void) const;
+
+    // whether a single tree learns whole percepts and no other tree keeps
+    // a history, so that percepts go to it as blocks
+    bool singleTree(void) const;
+
+    // generate a percept bit from the tree predicting it, and append it to
+    // the history of every other context tree
+    symbol_t genPerceptBitAndUpdate(size_t bit) const;
+
+    // append a symbol to the history of every context tree, updating the
+    // statistics of the given tree only
+    void updateTrees(ContextModel *tree, symbol_t sym) const;
+
+    // the probability the given percept bit is 1 after the current
+    // context, cached while the trees are frozen
+    double frozenProbability(size_t bit) const;
+
+    // append a symbol to the history of every context tree during a frozen
+    // simulation, rolling the context hash along
+    void appendFrozen(symbol_t sym) const;
+
+    // add symbols to the history of every context tree
+    void updateTreesHistory(const symbol_list_t &symbol_list) const;
+
+    // shrink the history of every context tree by the given number of symbols
+    void revertTreesHistory(size_t bits) const;
+
+    // fill in the percept probabilities of the factored model for the
+    // percepts starting with the given bits
+    void perceptDistribution(size_t length, size_t prefix, double log_prob,
+            std::vector<double> &probs) const;
+
     // encoding/decoding actions and percepts to/from symbol lists
     void encodeAction(symbol_list_t &symlist, action_t action) const;
     void encodePercept(symbol_list_t &symlist, percept_t observation,
@@ -122,6 +228,10 @@ private:
     action_t decodeAction(const symbol_list_t &symlist) const;
     percept_t decodeReward(const symbol_list_t &symlist) const;
 
+    // a percept as a block of symbols, bit i the i'th, and back
+    uint64_t perceptBlock(percept_t observation, percept_t reward) const;
+    void decodePercept(uint64_t block, percept_t *percept) const;
+
     // agent properties
     unsigned int m_actions;      // number of actions
     unsigned int m_actions_bits; // number of bits to represent an action
@@ -131,11 +241,44 @@ private:
     double m_timeout;			 // timeout value for MC search
     DecisionNode *m_st;          // head node of the search tree
 
-    // the max CTW tree depth
+    // the history the contexts reach back over: the max CTW tree depth,
+    // unless a context mask or whole-symbol levels set it
     size_t m_max_tree_depth;
 
-    // Context Tree representing the agent's beliefs
-    ContextTree *m_ct;
+    // Context Trees representing the agent's beliefs. A single tree predicts
+    // every percept bit, unless the model is factored, in which case tree i
+    // predicts only percept bit i. Every tree sees the full history.
+    std::vector<ContextModel*> m_ct;
+    bool m_factored;
+
+    // Copy-on-write overlays of the context trees, one per tree, when
+    // simulations run on overlays. While one runs, m_ct holds the overlays
+    // and m_committed the trees they read from.
+    std::vector<ContextTreeOverlay*> m_overlays;
+    std::vector<ContextModel*> m_committed;
+
+    // whether simulations journal their updates, and whether one does now
+    bool m_journal;
+    bool m_journaling;
+
+    // Whether simulations run against the trees as they are, only appending
+    // what they sample and choose to the history, and whether one does now.
+    // The trees do not change meanwhile, so the probability of a percept
+    // bit is cached, keyed by a rolling hash of the context window and the
+    // bit's position in the percept.
+    bool m_frozen;
+    bool m_freezing;
+    uint64_t m_frozen_shift; // weight of the symbol leaving the window
+    mutable std::vector<uint64_t> m_frozen_hashes; // after each symbol
+    mutable std::unordered_map<uint64_t, double> m_frozen_cache;
+
+    // A shallow exact context tree predicting every percept bit in the
+    // playouts, NULL without one. It learns from real percepts only, but
+    // its history takes every symbol the others' does. The last
+    // m_rollout_cycles simulated cycles took their percept from it and
+    // were only appended to the history of the other trees.
+    ContextTree *m_rollout;
+    size_t m_rollout_cycles;
 
     // How many time cycles the agent has been alive
     lifetime_t m_time_cycle;
@@ -178,11 +321,17 @@ public:
         return m_last_update_percept;
     }
 
+    // journal position of a context tree
+    size_t journalMark(size_t tree) const {
+        return m_journal_marks[tree];
+    }
+
 private:
     lifetime_t m_lifetime;
     reward_t m_reward;
     size_t m_history_size;
     bool m_last_update_percept;
+    std::vector<size_t> m_journal_marks;
 };
 
 #endif // __AGENT_HPP__
@@ -0,0 +1,118 @@
+#include "arena.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the smallest mapping of a file, and the unit mappings grow by
+static size_t pageRound(size_t bytes) {
+    static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    return (bytes + page - 1) / page * page;
+}
+
+ArenaMemory::ArenaMemory(void) :
+        m_data(NULL), m_capacity(0), m_fd(-1), m_hot(0) {
+}
+
+ArenaMemory::~ArenaMemory(void) {
+    release();
+}
+
+// unmap the block or free it
+void ArenaMemory::release(void) {
+    if (m_fd >= 0) {
+        munmap(m_data, m_capacity);
+        close(m_fd);
+        m_fd = -1;
+    } else {
+        free(m_data);
+    }
+    m_data = NULL;
+    m_capacity = 0;
+}
+
+// Map the file at the given size, which it is first extended to. Walks
+// through the tree land anywhere in it, so reading ahead would only bring
+// in cold pages; the leading hot bytes are asked for at once.
+char *ArenaMemory::mapAt(size_t bytes) const {
+    if (ftruncate(m_fd, off_t(bytes)) != 0)
+        return NULL;
+    void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, bytes, MADV_RANDOM);
+    if (m_hot > 0)
+        madvise(map, pageRound(std::min(m_hot, bytes)), MADV_WILLNEED);
+    return static_cast<char *>(map);
+}
+
+// Create the file, unlink it at once and map the block there
+bool ArenaMemory::mapFile(const std::string &dir) {
+    if (m_fd >= 0)
+        return true;
+    std::string path = dir + "/ctw-nodes-XXXXXX";
+    m_fd = mkstemp(&path[0]);
+    if (m_fd < 0)
+        return false;
+    unlink(path.c_str());
+
+    size_t bytes = pageRound(std::max<size_t>(m_capacity, 1));
+    char *map = mapAt(bytes);
+    if (map == NULL) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    if (m_capacity > 0)
+        memcpy(map, m_data, m_capacity);
+    free(m_data);
+    m_data = map;
+    m_capacity = bytes;
+    return true;
+}
+
+// Grow the block, at least doubling a mapped one so that it is remapped
+// rarely. The file keeps the contents of a mapped block, and the new
+// mapping takes them up before the old one goes.
+void ArenaMemory::grow(size_t bytes, size_t used) {
+    if (bytes <= m_capacity)
+        return;
+
+    if (m_fd >= 0) {
+        size_t mapped_bytes = pageRound(std::max(bytes, 2 * m_capacity));
+        char *map = mapAt(mapped_bytes);
+        if (map != NULL) {
+            munmap(m_data, m_capacity);
+            m_data = map;
+            m_capacity = mapped_bytes;
+            return;
+        }
+
+        std::cerr << "ERROR: could not grow the context tree's node file, "
+                "keeping the nodes in memory" << std::endl;
+        char *heap = static_cast<char *>(malloc(bytes));
+        if (heap == NULL)
+            throw std::bad_alloc();
+        memcpy(heap, m_data, used);
+        release();
+        m_data = heap;
+        m_capacity = bytes;
+        return;
+    }
+
+    char *heap = static_cast<char *>(realloc(m_data, bytes));
+    if (heap == NULL)
+        throw std::bad_alloc();
+    m_data = heap;
+    m_capacity = bytes;
+}
+
+// remember the hot bytes, for the mappings to come too, and ask for them
+void ArenaMemory::adviseHot(size_t bytes) {
+    m_hot = bytes;
+    if (m_fd >= 0 && bytes > 0)
+        madvise(m_data, pageRound(std::min(bytes, m_capacity)), MADV_WILLNEED);
+}
@@ -0,0 +1,142 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+// A growable block of memory taken from the heap, or from a file mapped
+// into memory. The OS can write the pages of a mapped block the process has
+// not touched lately out to the file and drop them, so a block larger than
+// the physical memory is paged rather than the process running out of
+// memory. The file is unlinked as soon as it is created, so it goes away
+// with the process.
+class ArenaMemory {
+public:
+
+    ArenaMemory(void);
+
+    ~ArenaMemory(void);
+
+    // Move the block to a new file in the given directory, keeping its
+    // contents; false if the file cannot be created or mapped, in which
+    // case the block stays where it was
+    bool mapFile(const std::string &dir);
+
+    // whether the block lives in a mapped file
+    bool mapped(void) const {
+        return m_fd >= 0;
+    }
+
+    // Grow the block to at least the given number of bytes, keeping the
+    // given number of leading bytes. A mapped block that cannot grow moves
+    // to the heap.
+    void grow(size_t bytes, size_t used);
+
+    // Ask for the given number of leading bytes, which are read all the
+    // time, to be kept in memory; the rest of a mapped block is read at
+    // random and not read ahead
+    void adviseHot(size_t bytes);
+
+    char *data(void) const {
+        return m_data;
+    }
+
+    size_t capacity(void) const {
+        return m_capacity;
+    }
+
+private:
+    ArenaMemory(const ArenaMemory &);
+    ArenaMemory &operator=(const ArenaMemory &);
+
+    // map the file at the given size and pass on the advice; NULL on failure
+    char *mapAt(size_t bytes) const;
+
+    // unmap the block or free it
+    void release(void);
+
+    char *m_data;
+    size_t m_capacity;
+    int m_fd;     // the mapped file, -1 for the heap
+    size_t m_hot; // leading bytes to keep in memory
+};
+
+// A growable array of plain records, with the part of std::vector's
+// interface the context tree uses, kept in an ArenaMemory. The records are
+// moved by copying their bytes, and slots past the size are not
+// constructed.
+template<typename T>
+class NodeArena {
+public:
+
+    NodeArena(void) :
+            m_size(0) {
+    }
+
+    T &operator[](size_t index) {
+        return reinterpret_cast<T *>(m_memory.data())[index];
+    }
+
+    const T &operator[](size_t index) const {
+        return reinterpret_cast<const T *>(m_memory.data())[index];
+    }
+
+    size_t size(void) const {
+        return m_size;
+    }
+
+    size_t capacity(void) const {
+        return m_memory.capacity() / sizeof(T);
+    }
+
+    void reserve(size_t n) {
+        if (n > capacity())
+            m_memory.grow(n * sizeof(T), m_size * sizeof(T));
+    }
+
+    void push_back(const T &record) {
+        if (m_size == capacity())
+            reserve(std::max<size_t>(2 * m_size, 16));
+        (*this)[m_size++] = record;
+    }
+
+    // append n records copied from the given array
+    void append(const T *records, size_t n) {
+        reserve(m_size + n);
+        std::copy(records, records + n, &(*this)[m_size]);
+        m_size += n;
+    }
+
+    // replace the records by n copied from the given array
+    void assign(const T *records, size_t n) {
+        m_size = 0;
+        append(records, n);
+    }
+
+    // drop every record, keeping the memory
+    void clear(void) {
+        m_size = 0;
+    }
+
+    // move the records to a file mapped from the given directory
+    bool mapFile(const std::string &dir) {
+        reserve(16);
+        return m_memory.mapFile(dir);
+    }
+
+    bool mapped(void) const {
+        return m_memory.mapped();
+    }
+
+    // keep the first n records in memory
+    void adviseHot(size_t n) {
+        m_memory.adviseHot(n * sizeof(T));
+    }
+
+private:
+    size_t m_size;
+    ArenaMemory m_memory;
+};
+
+#endif // __ARENA_HPP__
@@ -0,0 +1,59 @@
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "main.hpp"
+#include "environment.hpp"
+#include "tests/check.hpp"
+
+// seconds on a monotonic clock, for timing the code between two calls
+inline double benchSeconds(void) {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// add the key = value lines of a configuration file to the options,
+// without the comments; false if it cannot be read
+inline bool readConf(const std::string &path, options_t &options) {
+    std::ifstream in(path.c_str());
+    if (!in.is_open())
+        return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        key.erase(key.find_last_not_of(" \t\r") + 1);
+        key.erase(0, key.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        options[key] = value;
+    }
+    return true;
+}
+
+// the environment a configuration names, as main.cpp creates it
+inline Environment *newEnvironment(options_t &options) {
+    std::string name = options["environment"];
+    if (name == "coin-flip")
+        return new CoinFlip(options);
+    if (name == "cheese-maze")
+        return new CheeseMaze(options);
+    if (name == "extended-tiger")
+        return new ExtTiger(options);
+    if (name == "tictactoe")
+        return new TicTacToe(options);
+    if (name == "biased-rock-paper-scissor")
+        return new BRockPaperScissors(options);
+    if (name == "pacman")
+        return new Pacman(options);
+    return NULL;
+}
+
+#endif // __BENCH_HPP__
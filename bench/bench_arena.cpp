@@ -0,0 +1,209 @@
+// Update and revert throughput of the arena-backed context tree against a
+// tree of heap-allocated nodes linked by pointer, as the tree was before
+// the arena. Each cycle updates a 6-bit percept and appends a 2-bit action,
+// then simulates 4 cycles ahead and reverts them, at depth 256.
+#include "predict.hpp"
+#include "logmath.hpp"
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <vector>
+
+// the context tree with nodes linked by pointer, with the same arithmetic
+class PointerContextTree {
+public:
+
+    PointerContextTree(size_t depth) : m_root(new node_t()), m_depth(depth),
+            m_size(1) {
+    }
+
+    ~PointerContextTree(void) {
+        destroy(m_root);
+    }
+
+    void update(symbol_t sym) {
+        walk(0);
+        for (size_t d = m_path.size(); d-- > 0;) {
+            node_t *node = m_path[d];
+            node->log_prob_est += logKTMultiplier(node->count[sym],
+                    node->count[0] + node->count[1]);
+            node->count[sym]++;
+            updateLogProbability(node, d);
+        }
+        m_history.push_back(sym);
+    }
+
+    // revert the last update, its symbol left in the history
+    void revert(void) {
+        symbol_t sym = m_history.back();
+        walk(1);
+        for (size_t d = m_path.size(); d-- > 0;) {
+            node_t *node = m_path[d];
+            node->count[sym]--;
+            if (d > 0 && node->count[0] == 0 && node->count[1] == 0) {
+                m_path[d - 1]->child[recent(d + 1)] = NULL;
+                delete node;
+                m_size--;
+                continue;
+            }
+            if (node->count[0] == 0 && node->count[1] == 0) {
+                node->log_prob_est = 0.0;
+                node->log_prob_weighted = 0.0;
+                continue;
+            }
+            node->log_prob_est -= logKTMultiplier(node->count[sym],
+                    node->count[0] + node->count[1]);
+            updateLogProbability(node, d);
+        }
+    }
+
+    void updateHistory(symbol_t sym) {
+        m_history.push_back(sym);
+    }
+
+    void revertHistory(size_t size) {
+        m_history.resize(size);
+    }
+
+    size_t historySize(void) const {
+        return m_history.size();
+    }
+
+    double logBlockProbability(void) const {
+        return m_root->log_prob_weighted;
+    }
+
+    size_t size(void) const {
+        return m_size;
+    }
+
+private:
+    struct node_t {
+        node_t(void) : log_prob_est(0.0), log_prob_weighted(0.0) {
+            count[0] = count[1] = 0;
+            child[0] = child[1] = NULL;
+        }
+        weight_t log_prob_est;
+        weight_t log_prob_weighted;
+        count_t count[2];
+        node_t *child[2];
+    };
+
+    void destroy(node_t *node) {
+        if (node == NULL)
+            return;
+        destroy(node->child[0]);
+        destroy(node->child[1]);
+        delete node;
+    }
+
+    // the history symbol of the given age, 1 the most recent
+    symbol_t recent(size_t age) const {
+        return m_history[m_history.size() - age];
+    }
+
+    // collect the nodes along the context starting one symbol back from
+    // the given age, creating missing ones
+    void walk(size_t age) {
+        m_path.clear();
+        node_t *node = m_root;
+        m_path.push_back(node);
+        for (size_t d = 0; d < m_depth; d++) {
+            node_t *&child = node->child[recent(d + 1 + age)];
+            if (child == NULL) {
+                child = new node_t();
+                m_size++;
+            }
+            node = child;
+            m_path.push_back(node);
+        }
+    }
+
+    void updateLogProbability(node_t *node, size_t d) {
+        if (d == m_depth) {
+            node->log_prob_weighted = node->log_prob_est;
+            return;
+        }
+        weight_t log_prob_children = 0.0;
+        for (int s = 0; s < 2; s++) {
+            if (node->child[s] != NULL)
+                log_prob_children += node->child[s]->log_prob_weighted;
+        }
+        node->log_prob_weighted = logWeightedMix(node->log_prob_est,
+                log_prob_children);
+    }
+
+    node_t *m_root;
+    size_t m_depth;
+    size_t m_size;
+    std::vector<symbol_t> m_history;
+    std::vector<node_t*> m_path;
+};
+
+static const size_t Depth = 256;
+static const size_t PerceptBits = 6;
+static const size_t ActionBits = 2;
+static const size_t SimulatedCycles = 4;
+static const size_t Cycles = 3000;
+
+// the next percept bit: a noisy function of the last action
+static symbol_t perceptBit(size_t bit, unsigned int action) {
+    return rand() % 8 == 0 ? symbol_t(rand() & 1) :
+            symbol_t(((action + bit) & 3) == 0);
+}
+
+// run the cycles on a tree, returning the seconds they take
+template<typename Tree>
+static double run(Tree &tree) {
+    srand(11);
+    for (size_t i = 0; i < Depth; i++)
+        tree.updateHistory(symbol_t(rand() & 1));
+
+    double start = benchSeconds();
+    unsigned int action = 0;
+    for (size_t cycle = 0; cycle < Cycles; cycle++) {
+        for (size_t bit = 0; bit < PerceptBits; bit++)
+            tree.update(perceptBit(bit, action));
+        action = rand() % (1 << ActionBits);
+        for (size_t bit = 0; bit < ActionBits; bit++)
+            tree.updateHistory(symbol_t((action >> bit) & 1));
+
+        // a simulation, then its revert
+        size_t history = tree.historySize();
+        for (size_t sim = 0; sim < SimulatedCycles; sim++) {
+            unsigned int sim_action = rand() % (1 << ActionBits);
+            for (size_t bit = 0; bit < PerceptBits; bit++)
+                tree.update(perceptBit(bit, sim_action));
+            for (size_t bit = 0; bit < ActionBits; bit++)
+                tree.updateHistory(symbol_t((sim_action >> bit) & 1));
+        }
+        for (size_t sim = SimulatedCycles; sim-- > 0;) {
+            tree.revertHistory(tree.historySize() - ActionBits);
+            for (size_t bit = 0; bit < PerceptBits; bit++) {
+                tree.revert();
+                tree.revertHistory(tree.historySize() - 1);
+            }
+        }
+        if (tree.historySize() != history)
+            abort();
+    }
+    return benchSeconds() - start;
+}
+
+int main(void) {
+    PointerContextTree pointer(Depth);
+    double pointer_time = run(pointer);
+    ContextTree *arena = newContextTree(Depth,
+            SimulatedCycles * (PerceptBits + ActionBits));
+    double arena_time = run(*arena);
+
+    printf("depth %zu, %zu cycles: pointer tree %.2fs, arena %.2fs\n",
+            Depth, Cycles, pointer_time, arena_time);
+    printf("nodes %zu and %zu, log block probability %.17g and %.17g\n",
+            pointer.size(), arena->size(), pointer.logBlockProbability(),
+            arena->logBlockProbability());
+    bool same = pointer.size() == arena->size()
+            && pointer.logBlockProbability() == arena->logBlockProbability();
+    delete arena;
+    return same ? 0 : 1;
+}
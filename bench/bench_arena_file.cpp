@@ -0,0 +1,79 @@
+// Update latency of a depth 96 tree with its nodes on the heap and in a
+// file arena, as the tree grows. The stream is a long random pattern with
+// one symbol in 16 flipped, so that most updates create nodes. Every 2^16
+// updates it prints the nodes, the mean, 99th percentile and worst update
+// time and the major page faults. Takes the arena directory, "-" for the
+// heap alone, and the number of symbols, 500k by default; with no directory
+// it runs the heap and then a file arena in /tmp. The paging only shows
+// under a memory limit, such as a cgroup's.
+#include "predict.hpp"
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+static const size_t Depth = 96;
+static const size_t Period = 1 << 20;
+static const size_t Window = 1 << 16;
+
+// false if the arena cannot be mapped in the directory
+static bool run(const std::string &dir, size_t symbols) {
+    ContextTree *tree = newContextTree(Depth);
+    if (dir != "-" && !tree->setArenaFile(dir)) {
+        delete tree;
+        return false;
+    }
+    printf("%s:\n%10s %10s %9s %9s %9s %9s %8s\n",
+            dir == "-" ? "heap arena" : ("file arena in " + dir).c_str(),
+            "symbols", "nodes", "arena MB", "mean us", "p99 us", "max ms",
+            "majflt");
+
+    srand(11);
+    std::vector<symbol_t> pattern(Period);
+    for (size_t i = 0; i < Period; i++)
+        pattern[i] = rand() & 1;
+    for (size_t i = 0; i < Depth; i++)
+        tree->updateHistory(pattern[i]);
+
+    std::vector<double> latency;
+    latency.reserve(Window);
+    long faults = 0;
+    double start = benchSeconds(), window_start = start;
+    for (size_t i = 0; i < symbols; i++) {
+        symbol_t sym = pattern[(i + Depth) % Period] ^ (rand() % 16 == 0);
+        double before = benchSeconds();
+        tree->update(sym);
+        latency.push_back(benchSeconds() - before);
+        if (latency.size() < Window)
+            continue;
+
+        double end = benchSeconds();
+        std::sort(latency.begin(), latency.end());
+        model_stats_t stats;
+        tree->stats(stats);
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("%10zu %10zu %9.0f %9.2f %9.2f %9.2f %8ld\n", i + 1,
+                tree->size(), stats.bytes / 1048576.0,
+                (end - window_start) / Window * 1e6,
+                latency[Window * 99 / 100] * 1e6, latency.back() * 1e3,
+                usage.ru_majflt - faults);
+        fflush(stdout);
+        faults = usage.ru_majflt;
+        latency.clear();
+        window_start = benchSeconds();
+    }
+    printf("total %.1f s\n", benchSeconds() - start);
+    delete tree;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t symbols = argc > 2 ? strtoul(argv[2], NULL, 10) : 500000;
+    if (argc > 1)
+        return run(argv[1], symbols) ? 0 : 1;
+    return run("-", symbols) && run("/tmp", symbols) ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// Time of the bulk update against updating symbol by symbol, building
+// depth 48 trees from the agent's symbol streams of the longest recorded
+// runs. Exits with 1 if a bulk built tree differs in block probability or
+// size. Run from the repository's top directory.
+#include "predict.hpp"
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+static const size_t Depth = 48;
+
+struct stream_t {
+    const char *name;
+    const char *logs[3];
+    size_t obs_bits, rew_bits, action_bits;
+};
+
+static const stream_t Streams[] = {
+    { "tictactoe-cheng", { "tictactoe-cheng-longtreetimeout", NULL, NULL },
+            18, 3, 4 },
+    { "pacman rao-2+rao-4+ryk-1",
+            { "pacman-rao-2", "pacman-rao-4", "pacman-ryk-1" }, 16, 8, 2 },
+};
+
+// append the percept bits then the action bits of each cycle of a log
+static bool loadStream(const std::string &path, const stream_t &stream,
+        symbol_list_t &symbols) {
+    std::ifstream in(path.c_str());
+    std::string line;
+    if (!std::getline(in, line))
+        return false;
+    std::vector<int> columns(3, -1);
+    const char *names[3] = { "observation", "reward", "action" };
+    std::stringstream header(line);
+    std::string field;
+    for (int i = 0; std::getline(header, field, ','); i++) {
+        field.erase(0, field.find_first_not_of(" "));
+        for (size_t j = 0; j < 3; j++) {
+            if (field == names[j])
+                columns[j] = i;
+        }
+    }
+
+    while (std::getline(in, line)) {
+        std::vector<unsigned long> values;
+        std::stringstream fields(line);
+        while (std::getline(fields, field, ','))
+            values.push_back(strtoul(field.c_str(), NULL, 10));
+        if (int(values.size()) <= columns[2])
+            continue;
+        uint64_t percept = values[columns[0]]
+                | (uint64_t(values[columns[1]]) << stream.obs_bits);
+        for (size_t b = 0; b < stream.obs_bits + stream.rew_bits; b++)
+            symbols.push_back((percept >> b) & 1);
+        for (size_t b = 0; b < stream.action_bits; b++)
+            symbols.push_back((values[columns[2]] >> b) & 1);
+    }
+    return true;
+}
+
+// build a tree from the stream, sequentially for threads < 0
+static double build(const symbol_list_t &symbols, int threads,
+        double &log_prob, size_t &nodes) {
+    ContextTree tree(Depth);
+    symbol_list_t head(symbols.begin(), symbols.begin() + Depth);
+    symbol_list_t rest(symbols.begin() + Depth, symbols.end());
+    tree.updateHistory(head);
+    double start = benchSeconds();
+    if (threads < 0)
+        tree.update(rest);
+    else
+        tree.bulkUpdate(rest, threads);
+    double seconds = benchSeconds() - start;
+    log_prob = tree.logBlockProbability();
+    nodes = tree.size();
+    return seconds;
+}
+
+int main(void) {
+    printf("%u hardware threads\n", std::thread::hardware_concurrency());
+    bool same = true;
+    for (size_t s = 0; s < 2; s++) {
+        const stream_t &stream = Streams[s];
+        symbol_list_t symbols;
+        for (size_t l = 0; l < 3 && stream.logs[l] != NULL; l++) {
+            if (!loadStream(std::string("logs/") + stream.logs[l] + ".csv",
+                    stream, symbols)) {
+                printf("%s: cannot read the log\n", stream.logs[l]);
+                return 1;
+            }
+        }
+
+        double log_prob, bulk_log_prob;
+        size_t nodes, bulk_nodes;
+        double sequential = build(symbols, -1, log_prob, nodes);
+        printf("%s, %zu bits, %zu nodes: sequential %.2fs", stream.name,
+                symbols.size(), nodes, sequential);
+        const int threads[] = { 1, 4 };
+        for (size_t t = 0; t < 2; t++) {
+            double seconds = build(symbols, threads[t], bulk_log_prob,
+                    bulk_nodes);
+            printf(", %d thread%s %.2fs", threads[t],
+                    threads[t] > 1 ? "s" : "", seconds);
+            same = same && bulk_log_prob == log_prob && bulk_nodes == nodes;
+        }
+        printf("\n");
+    }
+    return same ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+// Node count and update latency of the compressed tree against the exact
+// tree, over the same 20k symbol stream at depths 96 and 256
+#include "predict.hpp"
+#include "compressedtree.hpp"
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <vector>
+
+// mean seconds per symbol to update a model with the stream
+static double timeUpdates(ContextModel &model,
+        const std::vector<symbol_t> &stream) {
+    double start = benchSeconds();
+    for (size_t i = 0; i < stream.size(); i++)
+        model.update(stream[i]);
+    return (benchSeconds() - start) / stream.size();
+}
+
+int main(void) {
+    // a periodic stream with some noise
+    srand(7);
+    std::vector<symbol_t> stream;
+    for (size_t i = 0; i < 20000; i++)
+        stream.push_back(rand() % 4 == 0 ? symbol_t(rand() & 1) :
+                symbol_t(i % 5 < 2));
+
+    const size_t depths[] = { 96, 256 };
+    for (size_t i = 0; i < 2; i++) {
+        size_t depth = depths[i];
+        ContextTree *exact = newContextTree(depth);
+        CompressedContextTree compressed(depth);
+        for (size_t d = 0; d < depth; d++) {
+            exact->updateHistory(stream[d]);
+            compressed.updateHistory(stream[d]);
+        }
+        double exact_time = timeUpdates(*exact, stream);
+        double compressed_time = timeUpdates(compressed, stream);
+        printf("depth %3zu: %zu nodes -> %zu, update %.2f us -> %.2f us\n",
+                depth, exact->size(), compressed.size(), exact_time * 1e6,
+                compressed_time * 1e6);
+        delete exact;
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Time of the generic exact context tree against the tree newContextTree()
+// specialises, on the depth, percept widths and environment of each shipped
+// configuration. Each cycle learns the environment's percept and appends a
+// random action, then simulates a horizon of percepts and random actions 8
+// times over, reverting each simulation. The two trees take turns over 3
+// runs, and the fastest run of each counts. Run from the directory holding
+// the .conf files.
+#include "predict.hpp"
+#include "util.hpp"
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <string>
+
+static const size_t Cycles = 200;
+static const size_t Simulations = 8;
+static const size_t Runs = 3;
+
+// seconds to run the cycles on a tree, from the same random sequence
+static double run(ContextModel &tree, options_t &options) {
+    size_t depth = strExtract<size_t>(options["ct-depth"]);
+    size_t obs_bits = strExtract<size_t>(options["observation-bits"]);
+    size_t percept_bits = obs_bits
+            + strExtract<size_t>(options["reward-bits"]);
+    size_t actions = strExtract<size_t>(options["agent-actions"]);
+    size_t horizon = strExtract<size_t>(options["agent-horizon"]);
+    size_t action_bits = 0;
+    while ((size_t(1) << action_bits) < actions)
+        action_bits++;
+
+    srand(11);
+    Environment *env = newEnvironment(options);
+    double start = benchSeconds();
+    for (size_t cycle = 0; cycle < Cycles; cycle++) {
+        uint64_t percept = env->getObservation()
+                | (uint64_t(env->getReward()) << obs_bits);
+        if (tree.historySize() >= depth) {
+            tree.updateBlock(percept, percept_bits);
+        } else {
+            for (size_t i = 0; i < percept_bits; i++)
+                tree.updateHistory(symbol_t((percept >> i) & 1));
+        }
+        action_t action = randRange(actions);
+        for (size_t i = 0; i < action_bits; i++)
+            tree.updateHistory(symbol_t((action >> i) & 1));
+        if (tree.historySize() < depth) {
+            env->performAction(action);
+            continue;
+        }
+
+        for (size_t sim = 0; sim < Simulations; sim++) {
+            for (size_t h = 0; h < horizon; h++) {
+                tree.genRandomBlockAndUpdate(percept_bits);
+                for (size_t i = 0; i < action_bits; i++)
+                    tree.updateHistory(symbol_t(rand() & 1));
+            }
+            for (size_t h = 0; h < horizon; h++) {
+                tree.revertHistory(tree.historySize() - action_bits);
+                tree.revertBlock(percept_bits);
+            }
+        }
+
+        env->performAction(action);
+        if (env->isFinished())
+            env->envReset();
+    }
+    double seconds = benchSeconds() - start;
+    delete env;
+    return seconds;
+}
+
+int main(void) {
+    const char *confs[] = { "cheesemaze", "coinflip", "pacman", "rockpaper",
+            "tictactoe", "tiger" };
+    bool same = true;
+    for (size_t c = 0; c < 6; c++) {
+        options_t options;
+        if (!readConf(std::string(confs[c]) + ".conf", options)) {
+            printf("%s.conf not found\n", confs[c]);
+            return 1;
+        }
+        size_t depth = strExtract<size_t>(options["ct-depth"]);
+        size_t obs_bits = strExtract<size_t>(options["observation-bits"]);
+        size_t rew_bits = strExtract<size_t>(options["reward-bits"]);
+        size_t lookahead = 64 * strExtract<size_t>(options["agent-horizon"]);
+
+        double generic_time = 0.0, specialised_time = 0.0;
+        ContextTree *generic = NULL, *specialised = NULL;
+        for (size_t r = 0; r < Runs; r++) {
+            delete generic;
+            delete specialised;
+            generic = new ContextTree(depth, lookahead);
+            specialised = newContextTree(depth, lookahead, obs_bits,
+                    rew_bits);
+            double seconds = run(*generic, options);
+            if (r == 0 || seconds < generic_time)
+                generic_time = seconds;
+            seconds = run(*specialised, options);
+            if (r == 0 || seconds < specialised_time)
+                specialised_time = seconds;
+        }
+        printf("%-10s depth %3zu, %2zu+%zu bits: generic %.2fs, "
+                "specialised %.2fs (%+.1f%%), %zu nodes\n", confs[c], depth,
+                obs_bits, rew_bits, generic_time, specialised_time,
+                100.0 * (specialised_time / generic_time - 1.0),
+                specialised->size());
+        same = same && generic->size() == specialised->size()
+                && generic->logBlockProbability()
+                        == specialised->logBlockProbability();
+        delete generic;
+        delete specialised;
+    }
+    return same ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// Simulations per second and average reward of the search on the exact
+// trees against the frozen search, on the shipped configurations. Each
+// agent is first pretrained from a recorded run where there is one, then
+// plays live cycles against its environment with exploration off, under
+// a 0.05 s search timeout; pacman runs at depth 96 to fit in memory.
+// Takes the number of cycles, 300 by default, and runs 3 seeds of each.
+// Run from the repository's top directory.
+#include "agent.hpp"
+#include "search.hpp"
+#include "util.hpp"
+#include "bench.hpp"
+
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+
+struct game_t {
+    const char *conf;
+    const char *log; // the run to pretrain from, if any
+};
+
+static const game_t Games[] = {
+    { "rockpaper", "rockpaper-rao-1" },
+    { "coinflip", NULL },
+    { "cheesemaze", "cheesemaze-yadu-3" },
+    { "tiger", "tiger-ryk-6.complete" },
+    { "tictactoe", "tictactoe-ryk-1-complete" },
+    { "pacman", "pacman-rao-2" },
+};
+
+static const unsigned Seeds = 3;
+
+// play the cycles, adding up the reward after the first percept, the
+// searches' processor time and their simulations, which the search logs
+static void play(const game_t &game, bool frozen, unsigned seed,
+        size_t cycles, double &reward, double &seconds, size_t &sims) {
+    options_t options;
+    setDefaultOptions(options);
+    readConf(std::string(game.conf) + ".conf", options);
+    options["timeout"] = "0.05";
+    options["search-frozen"] = frozen ? "1" : "0";
+    if (std::string(game.conf) == "pacman")
+        options["ct-depth"] = "96";
+
+    char log_path[] = "/tmp/bench_frozen_XXXXXX";
+    close(mkstemp(log_path));
+    aixi::log.open(log_path);
+    srand(seed);
+    Environment *env = newEnvironment(options);
+    Agent agent(options);
+    if (game.log != NULL)
+        agent.pretrain(std::string("logs/") + game.log + ".csv");
+
+    for (size_t cycle = 0; cycle < cycles; cycle++) {
+        percept_t observation = env->getObservation();
+        percept_t reward_now = env->getReward();
+        agent.searchTreeReset();
+        agent.modelUpdate(observation, reward_now);
+        if (cycle > 0)
+            reward += reward_now;
+        action_t action;
+        if (agent.historySize() >= agent.maxTreeDepth()) {
+            clock_t start = clock();
+            action = search(agent);
+            seconds += double(clock() - start) / CLOCKS_PER_SEC;
+        } else {
+            action = agent.genRandomAction();
+        }
+        agent.modelUpdate(action);
+        if (env->isFinished())
+            env->envReset();
+        else
+            env->performAction(action);
+    }
+    delete env;
+    aixi::log.close();
+
+    std::ifstream log(log_path);
+    std::string line;
+    while (std::getline(log, line)) {
+        if (line.compare(0, 13, "simulations: ") == 0)
+            sims += strtoul(line.c_str() + 13, NULL, 10);
+    }
+    remove(log_path);
+}
+
+int main(int argc, char **argv) {
+    size_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : 300;
+    printf("%-11s %10s %10s %12s %10s\n", "", "sims/s", "frozen",
+            "avg reward", "frozen");
+    for (size_t g = 0; g < 6; g++) {
+        double rate[2], reward[2];
+        for (int frozen = 0; frozen < 2; frozen++) {
+            double total_reward = 0.0, seconds = 0.0;
+            size_t sims = 0;
+            for (unsigned seed = 1; seed <= Seeds; seed++)
+                play(Games[g], frozen, seed, cycles, total_reward, seconds,
+                        sims);
+            rate[frozen] = sims / seconds;
+            reward[frozen] = total_reward / (Seeds * (cycles - 1));
+        }
+        printf("%-11s %10.0f %10.0f %12.3f %10.3f\n", Games[g].conf, rate[0],
+                rate[1], reward[0], reward[1]);
+    }
+    return 0;
+}
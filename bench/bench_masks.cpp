@@ -0,0 +1,82 @@
+// Model size, percept update time and log-loss of the exact model on
+// pacman, unfactored, factored and read through context masks. The model
+// learns the environment's percepts under random actions, with a new
+// episode whenever one finishes. The loss of each percept is scored before
+// the model learns it. Takes the number of cycles, 2000 by default; run
+// from the directory holding pacman.conf.
+#include "agent.hpp"
+#include "bench.hpp"
+
+#include <cmath>
+#include <cstdlib>
+
+struct configuration_t {
+    const char *depth;
+    const char *factored;
+    const char *context;
+};
+
+static const configuration_t Configurations[] = {
+    { "256", "0", "" },
+    { "256", "1", "" },
+    { "89", "1", "" },
+    { "256", "1", "action:1,observation:1:12-15,reward:1,"
+            "observation:1:0-11,action:2,observation:2,reward:2,action:3,"
+            "observation:3:12-15" },
+    { "256", "1", "action:1,observation:1,reward:1,action:2,"
+            "observation:2,reward:2,action:3,observation:3" },
+};
+
+int main(int argc, char **argv) {
+    size_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+    for (size_t c = 0; c < 5; c++) {
+        const configuration_t &conf = Configurations[c];
+        options_t options;
+        setDefaultOptions(options);
+        if (!readConf("pacman.conf", options)) {
+            printf("pacman.conf not found\n");
+            return 1;
+        }
+        options["ct-depth"] = conf.depth;
+        options["ct-factored"] = conf.factored;
+        options["ct-context"] = conf.context;
+
+        srand(1);
+        Agent agent(options);
+        Environment *env = newEnvironment(options);
+        size_t episodes = 1, scored = 0;
+        double loss = 0.0, update_time = 0.0;
+        for (size_t cycle = 0; cycle < cycles; cycle++) {
+            percept_t observation = env->getObservation();
+            percept_t reward = env->getReward();
+            if (agent.historySize() >= agent.maxTreeDepth()) {
+                loss -= log2(agent.perceptProbability(observation, reward));
+                scored++;
+            }
+            double start = benchSeconds();
+            agent.modelUpdate(observation, reward);
+            update_time += benchSeconds() - start;
+
+            action_t action = agent.genRandomAction();
+            agent.modelUpdate(action);
+            if (env->isFinished()) {
+                delete env;
+                env = newEnvironment(options);
+                episodes++;
+                continue;
+            }
+            env->performAction(action);
+        }
+        delete env;
+
+        model_stats_t stats;
+        agent.modelStats(stats);
+        printf("depth %s, factored %s, context '%s':\n", conf.depth,
+                conf.factored, conf.context);
+        printf("  %zu episodes, span %zu, %zu nodes, %.0f us per percept "
+                "update, %.2f bits per percept\n", episodes,
+                agent.maxTreeDepth(), stats.nodes,
+                update_time / cycles * 1e6, loss / scored);
+    }
+    return 0;
+}
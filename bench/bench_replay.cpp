@@ -0,0 +1,102 @@
+// Model size, update time and log-loss of the exact model replaying the
+// recorded runs under logs/, each with its own configuration. The loss of
+// each percept is scored before the model learns it. Build it a second time
+// with CXXFLAGS="-O2 -g -DCT_COMPACT_NODES" to compare the compact nodes.
+// Run from the repository's top directory.
+#include "agent.hpp"
+#include "bench.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+struct replay_t {
+    const char *log;
+    size_t cycles; // cycles replayed, 0 for the whole log
+};
+
+static const replay_t Replays[] = {
+    { "cheesemaze-yadu-3", 0 },
+    { "tiger-ryk-6.complete", 0 },
+    { "rockpaper-rao-1", 0 },
+    { "tictactoe-ryk-3", 2000 },
+    { "pacman-rao-2", 5000 },
+};
+
+// the fields of a csv line
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    std::stringstream in(line);
+    std::string field;
+    while (std::getline(in, field, ',')) {
+        field.erase(0, field.find_first_not_of(" "));
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+static bool replay(const replay_t &replay) {
+    std::string path = std::string("logs/") + replay.log;
+    options_t options;
+    setDefaultOptions(options);
+    if (!readConf(path + ".conf", options))
+        return false;
+    std::ifstream csv((path + ".csv").c_str());
+    std::string line;
+    if (!std::getline(csv, line))
+        return false;
+    std::vector<std::string> header = splitFields(line);
+    size_t columns[3] = { header.size(), header.size(), header.size() };
+    const char *names[3] = { "observation", "reward", "action" };
+    for (size_t i = 0; i < header.size(); i++) {
+        for (size_t j = 0; j < 3; j++) {
+            if (header[i] == names[j])
+                columns[j] = i;
+        }
+    }
+
+    Agent agent(options);
+    size_t cycles = 0, scored = 0;
+    double loss = 0.0, update_time = 0.0;
+    while (std::getline(csv, line)
+            && (replay.cycles == 0 || cycles < replay.cycles)) {
+        std::vector<std::string> fields = splitFields(line);
+        if (line.empty() || line[0] == '-'
+                || fields.size() <= std::max(columns[0],
+                        std::max(columns[1], columns[2])))
+            continue;
+        percept_t observation = strtoul(fields[columns[0]].c_str(), NULL, 10);
+        percept_t reward = strtoul(fields[columns[1]].c_str(), NULL, 10);
+        action_t action = strtoul(fields[columns[2]].c_str(), NULL, 10);
+
+        if (agent.historySize() >= agent.maxTreeDepth()) {
+            loss -= log2(agent.perceptProbability(observation, reward));
+            scored++;
+        }
+        double start = benchSeconds();
+        agent.modelUpdate(observation, reward);
+        agent.modelUpdate(action);
+        update_time += benchSeconds() - start;
+        cycles++;
+    }
+
+    model_stats_t stats;
+    agent.modelStats(stats);
+    printf("%-22s %6zu cycles %9zu nodes %7.1f MB %7.2f us/cycle "
+            "%.4f bits/percept\n", replay.log, cycles, stats.nodes,
+            stats.bytes / 1048576.0, update_time / cycles * 1e6,
+            loss / scored);
+    return true;
+}
+
+int main(void) {
+    printf("node size %zu bytes\n", sizeof(CTNode));
+    for (size_t r = 0; r < 5; r++) {
+        if (!replay(Replays[r])) {
+            printf("%s: cannot read the log\n", Replays[r].log);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+// The symbol-level context tree against binary trees of the same reach on
+// pacman: nodes, the time to learn a percept, to find its probability and
+// to sample a cycle and revert it, and the log-loss of the percepts. The
+// model learns the environment's percepts under random actions, with a new
+// episode whenever one finishes. Every 10th cycle samples 10 simulated
+// cycles. Takes the number of cycles, 10000 by default; run from the
+// directory holding pacman.conf.
+#include "agent.hpp"
+#include "bench.hpp"
+
+#include <cmath>
+#include <cstdlib>
+
+struct configuration_t {
+    const char *backend;
+    const char *depth;
+    const char *factored;
+};
+
+// a pacman cycle is 26 bits, so a symbol level reaches over 13 bits
+static const configuration_t Configurations[] = {
+    { "symbol", "2", "0" },
+    { "symbol", "4", "0" },
+    { "symbol", "8", "0" },
+    { "exact", "52", "0" },
+    { "exact", "78", "0" },
+    { "exact", "52", "1" },
+};
+
+int main(int argc, char **argv) {
+    size_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    printf("model                nodes    update  percept   sample"
+            "  log-loss\n");
+    for (size_t c = 0; c < 6; c++) {
+        const configuration_t &conf = Configurations[c];
+        options_t options;
+        setDefaultOptions(options);
+        if (!readConf("pacman.conf", options)) {
+            printf("pacman.conf not found\n");
+            return 1;
+        }
+        options["ct-backend"] = conf.backend;
+        options["ct-depth"] = conf.depth;
+        options["ct-factored"] = conf.factored;
+        options["agent-horizon"] = "4";
+
+        srand(1);
+        Agent agent(options);
+        Environment *env = newEnvironment(options);
+        size_t scored = 0, samples = 0;
+        double loss = 0.0, update_time = 0.0, percept_time = 0.0;
+        double sample_time = 0.0;
+        for (size_t cycle = 0; cycle < cycles; cycle++) {
+            percept_t observation = env->getObservation();
+            percept_t reward = env->getReward();
+            bool ready = agent.historySize() >= agent.maxTreeDepth();
+            if (ready) {
+                double start = benchSeconds();
+                loss -= log2(agent.perceptProbability(observation, reward));
+                percept_time += benchSeconds() - start;
+                scored++;
+            }
+            double start = benchSeconds();
+            agent.modelUpdate(observation, reward);
+            update_time += benchSeconds() - start;
+
+            action_t action = agent.genRandomAction();
+            agent.modelUpdate(action);
+            if (ready && cycle % 10 == 0) {
+                start = benchSeconds();
+                agent.beginSimulation();
+                for (size_t k = 0; k < 10; k++) {
+                    ModelUndo undo(agent);
+                    delete[] agent.genPerceptAndUpdate();
+                    agent.modelUpdate(agent.genRandomAction());
+                    agent.modelRevert(undo);
+                }
+                agent.endSimulation();
+                sample_time += benchSeconds() - start;
+                samples += 10;
+            }
+            if (env->isFinished()) {
+                delete env;
+                env = newEnvironment(options);
+                continue;
+            }
+            env->performAction(action);
+        }
+        delete env;
+
+        model_stats_t stats;
+        agent.modelStats(stats);
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s, %s", conf.factored[0] == '1' ?
+                "factored " : "", conf.backend, conf.depth);
+        printf("%-18s %7zu %6.0f us %6.0f us %6.0f us %6.2f bits\n", name,
+                stats.nodes, update_time / cycles * 1e6,
+                percept_time / scored * 1e6, sample_time / samples * 1e6,
+                loss / scored);
+    }
+    return 0;
+}
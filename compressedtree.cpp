@@ -0,0 +1,488 @@
+#include "compressedtree.hpp"
+#include "logmath.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+
+const size_t CompressedContextTree::MaxChainLength;
+
+// log2(2 - 2^(1 - n)). Mixing a KT estimate e down a chain of n unary
+// contexts gives e (1 - 2^-n) + c 2^-n, c being the probability of the
+// bottom context, which is a single weighted mix of e scaled by this and
+// c scaled by 2^(1 - n).
+static weight_t log_chain_scale[CompressedContextTree::MaxChainLength];
+
+static struct chain_scale_init_t {
+    chain_scale_init_t(void) {
+        for (size_t n = 1; n < CompressedContextTree::MaxChainLength; n++)
+            log_chain_scale[n] = log2(2.0 - exp2(1.0 - n));
+    }
+} chain_scale_init;
+
+// the lowest n bits of a word, n < 64
+static inline uint64_t lowBits(size_t n) {
+    return (uint64_t(1) << n) - 1;
+}
+
+// log weighted probability at the top of a chain of n unary contexts with
+// the same KT estimate above a bottom context
+static inline weight_t logProbChain(weight_t log_prob_est,
+        weight_t log_prob_bottom, size_t n, bool leaf) {
+    if (leaf)
+        return log_prob_est;
+    if (n == 0)
+        return log_prob_bottom;
+    return logWeightedMix(log_prob_est + log_chain_scale[n],
+            log_prob_bottom - n + 1);
+}
+
+// extend the hash of a context by the symbol read at the next depth
+static inline uint64_t extendHash(uint64_t hash, symbol_t sym) {
+    return (hash ^ (sym ? 0x9E3779B97F4A7C15ULL : 0xC2B2AE3D27D4EB4FULL))
+            * 0xFF51AFD7ED558CCDULL + 1;
+}
+
+// create a compressed context tree of specified maximum depth
+CompressedContextTree::CompressedContextTree(size_t depth, size_t lookahead) :
+        ContextModel(depth, lookahead) {
+    clear();
+}
+
+CompressedContextTree::~CompressedContextTree(void) {
+}
+
+// clear the entire context tree
+void CompressedContextTree::clear(void) {
+    m_history.clear();
+    m_nodes.clear();
+    m_free.clear();
+    m_nodes.push_back(node_t());
+    m_nodes[0].length = 1;
+    m_contexts = 1;
+}
+
+// take a fresh node from the arena, reusing released slots first
+node_index_t CompressedContextTree::newNode(void) {
+    if (!m_free.empty()) {
+        node_index_t index = m_free.back();
+        m_free.pop_back();
+        m_nodes[index] = node_t();
+        return index;
+    }
+    m_nodes.push_back(node_t());
+    return node_index_t(m_nodes.size() - 1);
+}
+
+// return a node to the arena's free list
+void CompressedContextTree::freeNode(node_index_t index) {
+    assert(index != NoChild);
+    m_contexts -= m_nodes[index].length;
+    m_free.push_back(index);
+}
+
+// create the chain of unseen contexts from the given depth down to the
+// maximum depth, one node per MaxChainLength contexts
+node_index_t CompressedContextTree::newChain(size_t age, size_t depth) {
+    node_index_t first = NoChild, last = NoChild;
+    symbol_t last_sym = 0;
+
+    while (true) {
+        size_t length = std::min(MaxChainLength, m_depth - depth + 1);
+        uint64_t context = m_history.context(age + depth);
+
+        node_index_t index = newNode();
+        m_nodes[index].length = length;
+        m_nodes[index].label = context & lowBits(length - 1);
+        m_contexts += length;
+
+        if (last == NoChild)
+            first = index;
+        else
+            m_nodes[last].child[last_sym] = index;
+
+        if (depth + length - 1 == m_depth)
+            return first;
+        last = index;
+        last_sym = (context >> (length - 1)) & 1;
+        depth += length;
+    }
+}
+
+// split a node whose label first differs from the context at bit k; the
+// node keeps the contexts down to depth + k, and a new child takes the rest
+void CompressedContextTree::split(node_index_t index, size_t depth,
+        size_t k) {
+    node_index_t lower = newNode();
+    node_t &node = m_nodes[index];
+    symbol_t sym = (node.label >> k) & 1;
+
+    m_nodes[lower] = node;
+    m_nodes[lower].length = node.length - k - 1;
+    m_nodes[lower].label = node.label >> (k + 1);
+    updateLogProbability(lower, depth + k + 1);
+
+    node.length = k + 1;
+    node.label &= lowBits(k);
+    node.child[sym] = lower;
+    node.child[!sym] = NoChild;
+}
+
+// merge a node with its only child when the chain fits in one node
+void CompressedContextTree::merge(node_index_t index) {
+    node_t &node = m_nodes[index];
+    if ((node.child[0] == NoChild) == (node.child[1] == NoChild))
+        return;
+
+    symbol_t sym = node.child[1] != NoChild;
+    node_index_t child_index = node.child[sym];
+    const node_t &child = m_nodes[child_index];
+    if (node.length + child.length > MaxChainLength)
+        return;
+
+    node.label |= uint64_t(sym) << (node.length - 1);
+    node.label |= child.label << node.length;
+    node.length += child.length;
+    node.child[0] = child.child[0];
+    node.child[1] = child.child[1];
+
+    // the contexts now belong to the merged node
+    m_contexts += child.length;
+    freeNode(child_index);
+}
+
+// log weighted probability of the bottom context of a node
+weight_t CompressedContextTree::logProbBottom(const node_t &node,
+        size_t bottom_depth) const {
+    if (bottom_depth == m_depth)
+        return node.log_prob_est;
+
+    weight_t log_prob_children = 0.0;
+    for (int s = 0; s < 2; s++) {
+        if (node.child[s] != NoChild)
+            log_prob_children += m_nodes[node.child[s]].log_prob_weighted;
+    }
+    return logWeightedMix(node.log_prob_est, log_prob_children);
+}
+
+// recompute the weighted probability of a node at the given depth
+void CompressedContextTree::updateLogProbability(node_index_t index,
+        size_t depth) {
+    node_t &node = m_nodes[index];
+    size_t bottom = depth + node.length - 1;
+    node.log_prob_weighted = logProbChain(node.log_prob_est,
+            logProbBottom(node, bottom), node.length - 1, bottom == m_depth);
+}
+
+// collect the nodes along the context starting at the given age, creating
+// and splitting nodes so the path reaches the maximum depth
+void CompressedContextTree::walk(size_t age) {
+    node_index_t current = 0;
+    size_t depth = 0;
+
+    m_path.clear();
+    m_path_depth.clear();
+
+    while (true) {
+        m_path.push_back(current);
+        m_path_depth.push_back(depth);
+
+        // Compare the whole label with the context at once
+        uint64_t context = m_history.context(age + depth);
+        uint64_t diff = (context ^ m_nodes[current].label)
+                & lowBits(m_nodes[current].length - 1);
+        if (diff != 0)
+            split(current, depth, __builtin_ctzll(diff));
+
+        const node_t &node = m_nodes[current];
+        size_t bottom = depth + node.length - 1;
+        if (bottom == m_depth)
+            return;
+
+        symbol_t sym = (context >> (node.length - 1)) & 1;
+        node_index_t next = node.child[sym];
+        if (next == NoChild) {
+            // The arena may grow here, so only indices are held across it
+            next = newChain(age, bottom + 1);
+            m_nodes[current].child[sym] = next;
+        }
+        current = next;
+        depth = bottom + 1;
+    }
+}
+
+// updates the context tree with a new binary symbol
+void CompressedContextTree::update(const symbol_t sym) {
+    // the context of the new symbol starts at the most recent one
+    walk(0);
+
+    for (size_t i = m_path.size(); i-- > 0;) {
+        node_t &node = m_nodes[m_path[i]];
+        node.log_prob_est += logKTMultiplier(node.count[sym],
+                node.count[0] + node.count[1]);
+        node.count[sym]++;
+        updateLogProbability(m_path[i], m_path_depth[i]);
+    }
+
+    updateHistory(sym);
+}
+
+// Revert the CT to its state prior to the most recently observed symbol
+void CompressedContextTree::revert(void) {
+    symbol_t sym = m_history.recent(0);
+
+    // the context of the last symbol starts one symbol further back; every
+    // context on it exists, so the walk neither creates nor splits nodes
+    walk(1);
+
+    for (size_t i = m_path.size(); i-- > 0;) {
+        node_index_t index = m_path[i];
+        node_t &node = m_nodes[index];
+        node.count[sym]--;
+
+        if (node.count[0] == 0 && node.count[1] == 0) {
+            if (i > 0) {
+                // Release the chain and unlink it from its parent
+                node_t &parent = m_nodes[m_path[i - 1]];
+                parent.child[parent.child[1] == index] = NoChild;
+                freeNode(index);
+            } else {
+                // Back to the empty tree
+                m_contexts -= node.length - 1;
+                m_nodes[0] = node_t();
+                m_nodes[0].length = 1;
+            }
+            continue;
+        }
+
+        node.log_prob_est -= logKTMultiplier(node.count[sym],
+                node.count[0] + node.count[1]);
+        merge(index);
+        updateLogProbability(index, m_path_depth[i]);
+    }
+}
+
+// read the contexts along a context out of the chains holding them
+void CompressedContextTree::readContexts(const std::vector<symbol_t> &context,
+        std::vector<context_t> &path, std::vector<context_t> &sibling) const {
+    context_t unseen = { false, { 0, 0 }, 0.0, 0.0 };
+    path.assign(m_depth + 1, unseen);
+    sibling.assign(m_depth, unseen);
+
+    node_index_t current = 0;
+    size_t depth = 0;
+    while (true) {
+        const node_t &node = m_nodes[current];
+        size_t bottom = depth + node.length - 1;
+        bool leaf = bottom == m_depth;
+        weight_t log_prob_bottom = logProbBottom(node, bottom);
+
+        for (size_t d = depth; d <= bottom; d++) {
+            context_t chained = { true, { node.count[0], node.count[1] },
+                    node.log_prob_est, logProbChain(node.log_prob_est,
+                            log_prob_bottom, bottom - d, leaf) };
+            path[d] = chained;
+            if (d == bottom)
+                break;
+
+            // where the context leaves the label, the rest of the chain is
+            // the sibling and the contexts below are not seen
+            if (((node.label >> (d - depth)) & 1) != context[d]) {
+                context_t rest = chained;
+                rest.log_prob_weighted = logProbChain(node.log_prob_est,
+                        log_prob_bottom, bottom - d - 1, leaf);
+                sibling[d] = rest;
+                return;
+            }
+        }
+        if (leaf)
+            return;
+
+        node_index_t other = node.child[!context[bottom]];
+        if (other != NoChild) {
+            const node_t &child = m_nodes[other];
+            context_t top = { true, { child.count[0], child.count[1] },
+                    child.log_prob_est, child.log_prob_weighted };
+            sibling[bottom] = top;
+        }
+        current = node.child[context[bottom]];
+        if (current == NoChild)
+            return;
+        depth = bottom + 1;
+    }
+}
+
+// the probability of a block of symbols, added to copies of the contexts
+// of the equivalent uncompressed tree, kept by context hash
+double CompressedContextTree::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    assert(n <= 64 && first <= n);
+    if (first == n)
+        return 0.0;
+
+    std::unordered_map<uint64_t, context_t> copies;
+    std::vector<symbol_t> context(m_depth);
+    std::vector<uint64_t> hash(m_depth + 1);
+    std::vector<context_t> path, sibling;
+    weight_t log_prob_root = 0.0;
+
+    for (size_t j = first; j < n; j++) {
+        hash[0] = 0;
+        for (size_t d = 0; d < m_depth; d++) {
+            context[d] = blockContextSymbol(block, j, d);
+            hash[d + 1] = extendHash(hash[d], context[d]);
+        }
+        readContexts(context, path, sibling);
+
+        // the copies made for the earlier symbols stand in for the nodes
+        std::unordered_map<uint64_t, context_t>::const_iterator it;
+        for (size_t d = 0; d <= m_depth; d++) {
+            it = copies.find(hash[d]);
+            if (it != copies.end())
+                path[d] = it->second;
+            if (d == m_depth)
+                break;
+            it = copies.find(extendHash(hash[d], !context[d]));
+            if (it != copies.end())
+                sibling[d] = it->second;
+        }
+
+        symbol_t sym = (block >> j) & 1;
+        weight_t child_log_prob = 0.0;
+        for (size_t d = m_depth + 1; d-- > 0;) {
+            context_t &copy = path[d];
+            if (!copy.seen) {
+                context_t fresh = { true, { 0, 0 }, 0.0, 0.0 };
+                copy = fresh;
+            }
+            copy.log_prob_est += logKTMultiplier(copy.count[sym],
+                    copy.count[0] + copy.count[1]);
+            copy.count[sym]++;
+
+            if (d == m_depth) {
+                copy.log_prob_weighted = copy.log_prob_est;
+            } else {
+                weight_t log_prob_children = 0.0;
+                for (int s = 0; s < 2; s++) {
+                    if (s == context[d])
+                        log_prob_children += child_log_prob;
+                    else if (sibling[d].seen)
+                        log_prob_children += sibling[d].log_prob_weighted;
+                }
+                copy.log_prob_weighted = logWeightedMix(copy.log_prob_est,
+                        log_prob_children);
+            }
+            child_log_prob = copy.log_prob_weighted;
+            copies[hash[d]] = copy;
+        }
+        log_prob_root = child_log_prob;
+    }
+    return log_prob_root - m_nodes[0].log_prob_weighted;
+}
+
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h), from the stored nodes and without modifying the tree
+double CompressedContextTree::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    std::vector<node_index_t> path;
+    std::vector<size_t> path_depth, path_length;
+
+    // the nodes along the context, down to a missing child or a split label
+    node_index_t current = 0;
+    size_t depth = 0;
+    bool split = false;
+    while (true) {
+        const node_t &node = m_nodes[current];
+        uint64_t context = m_history.context(depth);
+        uint64_t diff = (context ^ node.label) & lowBits(node.length - 1);
+
+        path.push_back(current);
+        path_depth.push_back(depth);
+        if (diff != 0) {
+            path_length.push_back(__builtin_ctzll(diff) + 1);
+            split = true;
+            break;
+        }
+        path_length.push_back(node.length);
+
+        size_t bottom = depth + node.length - 1;
+        if (bottom == m_depth)
+            break;
+        current = node.child[(context >> (node.length - 1)) & 1];
+        if (current == NoChild)
+            break;
+        depth = bottom + 1;
+    }
+
+    // as in CTNode::logProbPath
+    weight_t child_log_prob = -1.0;
+    for (size_t i = path.size(); i-- > 0;) {
+        const node_t &node = m_nodes[path[i]];
+        weight_t log_prob_est = node.log_prob_est
+                + logKTMultiplier(node.count[sym],
+                        node.count[0] + node.count[1]);
+        size_t bottom = path_depth[i] + path_length[i] - 1;
+
+        weight_t log_prob_bottom = log_prob_est;
+        if (bottom != m_depth) {
+            // Combine the updated child with its untouched sibling, which
+            // is the rest of the chain when the context leaves a label
+            symbol_t path_sym = m_history.recent(bottom);
+            bool has_sibling;
+            weight_t log_prob_sibling = 0.0;
+            if (split && i + 1 == path.size()) {
+                size_t node_bottom = path_depth[i] + node.length - 1;
+                has_sibling = true;
+                log_prob_sibling = logProbChain(node.log_prob_est,
+                        logProbBottom(node, node_bottom),
+                        node.length - path_length[i] - 1,
+                        node_bottom == m_depth);
+            } else {
+                node_index_t sibling = node.child[!path_sym];
+                has_sibling = sibling != NoChild;
+                if (has_sibling)
+                    log_prob_sibling = m_nodes[sibling].log_prob_weighted;
+            }
+
+            weight_t log_prob_children = 0.0;
+            for (int s = 0; s < 2; s++) {
+                if (s == path_sym)
+                    log_prob_children += child_log_prob;
+                else if (has_sibling)
+                    log_prob_children += log_prob_sibling;
+            }
+            log_prob_bottom = logWeightedMix(log_prob_est, log_prob_children);
+        }
+        child_log_prob = logProbChain(log_prob_est, log_prob_bottom,
+                path_length[i] - 1, bottom == m_depth);
+    }
+
+    return child_log_prob - m_nodes[0].log_prob_weighted;
+}
+
+// generate a single random symbol distributed according to the context tree
+// statistics and update the context tree with it
+symbol_t CompressedContextTree::genRandomSymbolAndUpdate(void) {
+    symbol_t sym = (rand01() > predict(false));
+    update(sym);
+    return sym;
+}
+
+// the logarithm of the block probability of the whole sequence
+double CompressedContextTree::logBlockProbability(void) const {
+    return m_nodes[0].log_prob_weighted;
+}
+
+// node and context counts
+void CompressedContextTree::logStats(std::ostream &out) const {
+    out << "compressed context tree: " << size() << " nodes holding "
+            << m_contexts << " contexts" << std::endl;
+}
+
+// node count and the memory held by the arena
+void CompressedContextTree::stats(model_stats_t &stats) const {
+    ContextModel::stats(stats);
+    stats.bytes += m_nodes.capacity() * sizeof(node_t)
+            + m_free.capacity() * sizeof(node_index_t);
+}
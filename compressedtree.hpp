@@ -0,0 +1,134 @@
+#ifndef __COMPRESSEDTREE_HPP__
+#define __COMPRESSEDTREE_HPP__
+
+#include <vector>
+#include <stdint.h>
+
+#include "main.hpp"
+#include "predict.hpp"
+
+// A path-compressed context tree: a chain of up to MaxChainLength contexts
+// with a single child each is one node labelled with their context bits,
+// its weighted probability worked out in closed form
+class CompressedContextTree: public ContextModel {
+public:
+
+    // contexts held by one node at most; the label has one bit fewer
+    static const size_t MaxChainLength = 64;
+
+    // create a compressed context tree of specified maximum depth, keeping
+    // enough history to revert the given number of symbols
+    CompressedContextTree(size_t depth, size_t lookahead = 0);
+
+    virtual ~CompressedContextTree(void);
+
+    // clear the entire context tree
+    virtual void clear(void);
+
+    // updates the context tree with a new binary symbol
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    // removes the most recently observed symbol from the context tree
+    virtual void revert(void);
+
+    // generate a single random symbol distributed according to the context
+    // tree statistics and update the context tree with it
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    // the logarithm of the block probability of the whole sequence
+    virtual double logBlockProbability(void) const;
+
+    // Calculate the probability of the next symbol given the next history
+    // P(x[i]=sym|h), without modifying the context tree
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    // the probability of a block, evaluated on copies of the contexts it
+    // would change without modifying the context tree
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
+
+    // node and context counts
+    virtual void logStats(std::ostream &out) const;
+
+    // node count and the memory held by the arena
+    virtual void stats(model_stats_t &stats) const;
+
+    // number of nodes in the context tree, including the root
+    virtual size_t size(void) const {
+        return m_nodes.size() - m_free.size();
+    }
+
+    // number of contexts the nodes stand for, i.e. the size of the
+    // equivalent uncompressed context tree
+    size_t contexts(void) const {
+        return m_contexts;
+    }
+
+private:
+    // a chain of contexts sharing the same counts
+    struct node_t {
+        weight_t log_prob_est;      // log KT estimated probability
+        weight_t log_prob_weighted; // log weighted probability of the top
+        count_t count[2];           // a,b in CTW literature
+        node_index_t child[2];      // children of the bottom context
+        uint64_t label;    // bit j: context bit leaving the j'th context
+        uint32_t length;   // number of contexts in the chain
+    };
+
+    // one context of the equivalent uncompressed tree, as a block
+    // evaluation copies it; a context no node holds is not seen
+    struct context_t {
+        bool seen;
+        count_t count[2];
+        weight_t log_prob_est;
+        weight_t log_prob_weighted;
+    };
+
+    // take a fresh node from the arena, reusing released slots first
+    node_index_t newNode(void);
+
+    // return a node to the arena's free list
+    void freeNode(node_index_t index);
+
+    // create the chain of unseen contexts from the given depth down to the
+    // maximum depth, reading the context starting at the given age
+    node_index_t newChain(size_t age, size_t depth);
+
+    // split a node whose label first differs from the context at bit k,
+    // moving the contexts below bit k into a new child
+    void split(node_index_t index, size_t depth, size_t k);
+
+    // merge a node with its only child when the chain fits in one node
+    void merge(node_index_t index);
+
+    // log weighted probability of the bottom context of a node
+    weight_t logProbBottom(const node_t &node, size_t bottom_depth) const;
+
+    // recompute the weighted probability of a node at the given depth
+    void updateLogProbability(node_index_t index, size_t depth);
+
+    // read the contexts along the given context out of the chains holding
+    // them: path[d] is the context at depth d, sibling[d] its child off
+    // the path
+    void readContexts(const std::vector<symbol_t> &context,
+            std::vector<context_t> &path,
+            std::vector<context_t> &sibling) const;
+
+    // collect the nodes along the context starting at the given age,
+    // creating and splitting nodes so the path reaches the maximum depth
+    void walk(size_t age);
+
+    // Node arena; the root lives at index 0. Released slots are kept on a
+    // free list and handed out again before the arena grows.
+    std::vector<node_t> m_nodes;
+    std::vector<node_index_t> m_free;
+    size_t m_contexts; // contexts held by all nodes
+
+    // scratch buffers of the current walk: the nodes along the context and
+    // the depth of the top context of each
+    std::vector<node_index_t> m_path;
+    std::vector<size_t> m_path_depth;
+};
+
+#endif // __COMPRESSEDTREE_HPP__
@@ -17,6 +17,9 @@ public:
 
     // Constructor: set up the initial environment percept
 
+    virtual ~Environment(void) {
+    }
+
     // receives the agent's action and calculates the new environment percept
     virtual void performAction(action_t action) = 0;
 
@@ -0,0 +1,427 @@
+#include "hashtree.hpp"
+#include "logmath.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+// number of consecutive slots a context may occupy
+static const size_t HashProbeLength = 4;
+
+// slot index of a context that is not stored
+static const size_t NoSlot = size_t(-1);
+
+// extend a context hash by the next older symbol of the context
+static inline uint64_t extendHash(uint64_t hash, symbol_t sym) {
+    return (hash ^ (sym ? 0x9E3779B97F4A7C15ULL : 0xC2B2AE3D27D4EB4FULL))
+            * 0xFF51AFD7ED558CCDULL + 1;
+}
+
+// mix a context hash and its depth into the bits selecting slot and tag
+static inline uint64_t mixHash(uint64_t hash, size_t depth) {
+    uint64_t h = hash + depth * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// the non-zero tag stored to identify a context
+static inline uint32_t hashCheck(uint64_t mixed) {
+    return uint32_t(mixed >> 32) | 1;
+}
+
+// create a hashed context tree of specified maximum depth whose table
+// takes at most the given number of bytes
+HashedContextTree::HashedContextTree(size_t depth, size_t memory,
+        size_t lookahead) :
+        ContextModel(depth, lookahead), m_used(0), m_evictions(0) {
+    size_t slots = HashProbeLength;
+    while (2 * slots * sizeof(entry_t) <= memory)
+        slots *= 2;
+    m_table.resize(slots);
+    m_mask = slots - 1;
+    clear();
+}
+
+HashedContextTree::~HashedContextTree(void) {
+}
+
+// clear the entire context tree
+void HashedContextTree::clear(void) {
+    entry_t empty = { 0, 0, { 0, 0 }, 0.0, 0.0 };
+    m_history.clear();
+    std::fill(m_table.begin(), m_table.end(), empty);
+    m_root = empty;
+    m_used = 0;
+    m_evictions = 0;
+}
+
+// find the slot of a context, NoSlot if it is not stored
+size_t HashedContextTree::find(uint64_t hash, size_t depth) const {
+    uint64_t mixed = mixHash(hash, depth);
+    uint32_t check = hashCheck(mixed);
+
+    for (size_t i = 0; i < HashProbeLength; i++) {
+        size_t slot = (mixed + i) & m_mask;
+        if (m_table[slot].check == check && m_table[slot].depth == depth)
+            return slot;
+    }
+    return NoSlot;
+}
+
+// the slot findOrInsert would give a context, NoSlot if there is none
+size_t HashedContextTree::probe(uint64_t hash, size_t depth) const {
+    uint64_t mixed = mixHash(hash, depth);
+    uint32_t check = hashCheck(mixed);
+    size_t empty = NoSlot, victim = NoSlot;
+
+    for (size_t i = 0; i < HashProbeLength; i++) {
+        size_t slot = (mixed + i) & m_mask;
+        const entry_t &entry = m_table[slot];
+        if (entry.check == check && entry.depth == depth)
+            return slot;
+        if (entry.check == 0) {
+            if (empty == NoSlot)
+                empty = slot;
+        } else if (entry.depth >= depth
+                && (victim == NoSlot
+                        || entry.count[0] + entry.count[1]
+                                < m_table[victim].count[0]
+                                        + m_table[victim].count[1])) {
+            victim = slot;
+        }
+    }
+    return empty != NoSlot ? empty : victim;
+}
+
+// find the entry of a context, storing it if it is new
+HashedContextTree::entry_t *HashedContextTree::findOrInsert(uint64_t hash,
+        size_t depth) {
+    size_t slot = probe(hash, depth);
+    if (slot == NoSlot)
+        return NULL;
+
+    uint32_t check = hashCheck(mixHash(hash, depth));
+    entry_t &entry = m_table[slot];
+    if (entry.check == check && entry.depth == depth)
+        return &entry;
+    if (entry.check == 0)
+        m_used++;
+    else
+        m_evictions++;
+
+    entry_t fresh = { check, uint32_t(depth), { 0, 0 }, 0.0, 0.0 };
+    entry = fresh;
+    return &entry;
+}
+
+// the entry in a slot as a block evaluation sees it: its copy, or else the
+// table's
+const HashedContextTree::entry_t &HashedContextTree::slotEntry(
+        const slot_copies_t &copies, size_t slot) const {
+    slot_copies_t::const_iterator it = copies.find(slot);
+    return it != copies.end() ? it->second : m_table[slot];
+}
+
+// find the slot of a context among the copies and the table, NoSlot if it
+// is in neither
+size_t HashedContextTree::findCopy(const slot_copies_t &copies,
+        uint64_t hash, size_t depth) const {
+    uint64_t mixed = mixHash(hash, depth);
+    uint32_t check = hashCheck(mixed);
+
+    for (size_t i = 0; i < HashProbeLength; i++) {
+        size_t slot = (mixed + i) & m_mask;
+        const entry_t &entry = slotEntry(copies, slot);
+        if (entry.check == check && entry.depth == depth)
+            return slot;
+    }
+    return NoSlot;
+}
+
+// find the copy of a context's entry, storing it among the copies as
+// findOrInsert would in the table
+HashedContextTree::entry_t *HashedContextTree::findOrInsertCopy(
+        slot_copies_t &copies, uint64_t hash, size_t depth) const {
+    uint64_t mixed = mixHash(hash, depth);
+    uint32_t check = hashCheck(mixed);
+    size_t empty = NoSlot, victim = NoSlot;
+    count_t victim_visits = 0;
+
+    for (size_t i = 0; i < HashProbeLength; i++) {
+        size_t slot = (mixed + i) & m_mask;
+        const entry_t &entry = slotEntry(copies, slot);
+        count_t visits = entry.count[0] + entry.count[1];
+        if (entry.check == check && entry.depth == depth)
+            return &copies.insert(std::make_pair(slot, entry)).first->second;
+        if (entry.check == 0) {
+            if (empty == NoSlot)
+                empty = slot;
+        } else if (entry.depth >= depth
+                && (victim == NoSlot || visits < victim_visits)) {
+            victim = slot;
+            victim_visits = visits;
+        }
+    }
+
+    size_t slot = empty != NoSlot ? empty : victim;
+    if (slot == NoSlot)
+        return NULL;
+    entry_t fresh = { check, uint32_t(depth), { 0, 0 }, 0.0, 0.0 };
+    entry_t &copy = copies[slot];
+    copy = fresh;
+    return &copy;
+}
+
+// collect the entries along the context starting at the given age,
+// stopping at the first one not stored
+void HashedContextTree::walk(size_t age, bool create) {
+    uint64_t hash = 0;
+    uint64_t context = 0;
+
+    m_path.clear();
+    m_path_hash.clear();
+    m_path.push_back(&m_root);
+    m_path_hash.push_back(hash);
+
+    for (size_t d = 0; d < m_depth; d++) {
+        if ((d & 63) == 0)
+            context = m_history.context(age + d);
+        hash = extendHash(hash, context & 1);
+        context >>= 1;
+
+        entry_t *entry;
+        if (create) {
+            entry = findOrInsert(hash, d + 1);
+        } else {
+            size_t slot = find(hash, d + 1);
+            entry = slot == NoSlot ? NULL : &m_table[slot];
+        }
+        if (entry == NULL)
+            break;
+        m_path.push_back(entry);
+        m_path_hash.push_back(hash);
+    }
+}
+
+// sum of the log weighted probabilities of the children of the node at the
+// given depth of the path, the child on the path contributing the given value
+weight_t HashedContextTree::logProbChildren(
+        const std::vector<uint64_t> &path_hash, size_t d, symbol_t path_sym,
+        weight_t log_prob_path_child, bool &leaf) const {
+    leaf = (d == m_depth);
+    if (leaf)
+        return 0.0;
+
+    bool path_child = d + 1 < path_hash.size();
+    size_t sibling = find(extendHash(path_hash[d], !path_sym), d + 1);
+    leaf = !path_child && sibling == NoSlot;
+
+    weight_t log_prob = 0.0;
+    for (int s = 0; s < 2; s++) {
+        if (s == path_sym && path_child)
+            log_prob += log_prob_path_child;
+        else if (s != path_sym && sibling != NoSlot)
+            log_prob += m_table[sibling].log_prob_weighted;
+    }
+    return log_prob;
+}
+
+// updates the context tree with a new binary symbol
+void HashedContextTree::update(const symbol_t sym) {
+    // the context of the new symbol starts at the most recent one
+    walk(0, true);
+
+    weight_t child_log_prob = 0.0;
+    for (size_t d = m_path.size(); d-- > 0;) {
+        entry_t &entry = *m_path[d];
+        bool leaf;
+        weight_t log_prob_children = logProbChildren(m_path_hash, d,
+                d < m_depth ? m_history.recent(d) : false, child_log_prob,
+                leaf);
+
+        entry.log_prob_est += logKTMultiplier(entry.count[sym],
+                entry.count[0] + entry.count[1]);
+        entry.count[sym]++;
+        entry.log_prob_weighted =
+                leaf ? entry.log_prob_est :
+                        logWeightedMix(entry.log_prob_est, log_prob_children);
+        child_log_prob = entry.log_prob_weighted;
+    }
+
+    updateHistory(sym);
+}
+
+// Revert the CT to its state prior to the most recently observed symbol
+void HashedContextTree::revert(void) {
+    symbol_t sym = m_history.recent(0);
+
+    // the context of the last symbol starts one symbol further back
+    walk(1, false);
+
+    weight_t child_log_prob = 0.0;
+    for (size_t d = m_path.size(); d-- > 0;) {
+        entry_t &entry = *m_path[d];
+        bool leaf;
+        weight_t log_prob_children = logProbChildren(m_path_hash, d,
+                d < m_depth ? m_history.recent(d + 1) : false,
+                child_log_prob, leaf);
+
+        // An entry evicted and seen again may not hold this update
+        if (entry.count[sym] > 0) {
+            entry.count[sym]--;
+            entry.log_prob_est -= logKTMultiplier(entry.count[sym],
+                    entry.count[0] + entry.count[1]);
+        }
+
+        if (d > 0 && entry.count[0] == 0 && entry.count[1] == 0) {
+            // Release the context when there is no context
+            entry.check = 0;
+            m_used--;
+            m_path.resize(d);
+            continue;
+        }
+        if (entry.count[0] == 0 && entry.count[1] == 0)
+            entry.log_prob_est = 0.0;
+
+        entry.log_prob_weighted =
+                leaf ? entry.log_prob_est :
+                        logWeightedMix(entry.log_prob_est, log_prob_children);
+        child_log_prob = entry.log_prob_weighted;
+    }
+}
+
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h), along the path update would take
+double HashedContextTree::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    static const entry_t fresh = { 0, 0, { 0, 0 }, 0.0, 0.0 };
+    std::vector<const entry_t*> path;
+    std::vector<uint64_t> path_hash;
+    path.reserve(m_depth + 1);
+    path_hash.reserve(m_depth + 1);
+
+    uint64_t hash = 0;
+    uint64_t context = 0;
+    path.push_back(&m_root);
+    path_hash.push_back(hash);
+    for (size_t d = 0; d < m_depth; d++) {
+        if ((d & 63) == 0)
+            context = m_history.context(d);
+        hash = extendHash(hash, context & 1);
+        context >>= 1;
+        size_t slot = probe(hash, d + 1);
+        if (slot == NoSlot)
+            break;
+        const entry_t &entry = m_table[slot];
+        bool stored = entry.check == hashCheck(mixHash(hash, d + 1))
+                && entry.depth == d + 1;
+        path.push_back(stored ? &entry : &fresh);
+        path_hash.push_back(hash);
+    }
+
+    weight_t child_log_prob = 0.0;
+    for (size_t d = path.size(); d-- > 0;) {
+        const entry_t &entry = *path[d];
+        bool leaf;
+        weight_t log_prob_children = logProbChildren(path_hash, d,
+                d < m_depth ? m_history.recent(d) : false, child_log_prob,
+                leaf);
+        weight_t log_prob_est = entry.log_prob_est
+                + logKTMultiplier(entry.count[sym],
+                        entry.count[0] + entry.count[1]);
+        child_log_prob = leaf ? log_prob_est :
+                logWeightedMix(log_prob_est, log_prob_children);
+    }
+
+    return child_log_prob - m_root.log_prob_weighted;
+}
+
+// the probability of a block of symbols, added to copies of the slots it
+// would change
+double HashedContextTree::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    assert(n <= 64 && first <= n);
+    slot_copies_t copies;
+    entry_t root = m_root;
+    std::vector<entry_t*> path;
+    std::vector<uint64_t> path_hash;
+
+    for (size_t j = first; j < n; j++) {
+        // the entries along the context of the j'th symbol, as walk finds
+        // or stores them
+        uint64_t hash = 0;
+        path.clear();
+        path_hash.clear();
+        path.push_back(&root);
+        path_hash.push_back(hash);
+        for (size_t d = 0; d < m_depth; d++) {
+            hash = extendHash(hash, blockContextSymbol(block, j, d));
+            entry_t *entry = findOrInsertCopy(copies, hash, d + 1);
+            if (entry == NULL)
+                break;
+            path.push_back(entry);
+            path_hash.push_back(hash);
+        }
+
+        symbol_t sym = (block >> j) & 1;
+        weight_t child_log_prob = 0.0;
+        for (size_t d = path.size(); d-- > 0;) {
+            entry_t &entry = *path[d];
+            bool leaf = (d == m_depth);
+            weight_t log_prob_children = 0.0;
+            if (!leaf) {
+                symbol_t path_sym = blockContextSymbol(block, j, d);
+                bool path_child = d + 1 < path.size();
+                size_t sibling = findCopy(copies,
+                        extendHash(path_hash[d], !path_sym), d + 1);
+                leaf = !path_child && sibling == NoSlot;
+                for (int s = 0; s < 2; s++) {
+                    if (s == path_sym && path_child)
+                        log_prob_children += child_log_prob;
+                    else if (s != path_sym && sibling != NoSlot)
+                        log_prob_children += slotEntry(copies,
+                                sibling).log_prob_weighted;
+                }
+            }
+
+            entry.log_prob_est += logKTMultiplier(entry.count[sym],
+                    entry.count[0] + entry.count[1]);
+            entry.count[sym]++;
+            entry.log_prob_weighted =
+                    leaf ? entry.log_prob_est :
+                            logWeightedMix(entry.log_prob_est,
+                                    log_prob_children);
+            child_log_prob = entry.log_prob_weighted;
+        }
+    }
+    return root.log_prob_weighted - m_root.log_prob_weighted;
+}
+
+// generate a single random symbol distributed according to the context tree
+// statistics and update the context tree with it
+symbol_t HashedContextTree::genRandomSymbolAndUpdate(void) {
+    symbol_t sym = (rand01() > predict(false));
+    update(sym);
+    return sym;
+}
+
+// the logarithm of the block probability of the whole sequence
+double HashedContextTree::logBlockProbability(void) const {
+    return m_root.log_prob_weighted;
+}
+
+// table occupancy and eviction count
+void HashedContextTree::logStats(std::ostream &out) const {
+    out << "hashed context tree: " << m_used << " of " << m_table.size()
+            << " slots used, " << m_evictions << " evictions" << std::endl;
+}
+
+// the table is allocated up front, so its size is the memory held
+void HashedContextTree::stats(model_stats_t &stats) const {
+    ContextModel::stats(stats);
+    stats.bytes += m_table.size() * sizeof(entry_t);
+}
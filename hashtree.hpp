@@ -0,0 +1,131 @@
+#ifndef __HASHTREE_HPP__
+#define __HASHTREE_HPP__
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "main.hpp"
+#include "predict.hpp"
+
+// A context tree in a fixed-size hash table keyed by (depth, context hash).
+// A new context takes an empty slot of its probe window, else evicts the
+// least visited one no shallower than it; failing both, its parent is a leaf.
+class HashedContextTree: public ContextModel {
+public:
+
+    // create a hashed context tree of specified maximum depth whose table
+    // takes at most the given number of bytes
+    HashedContextTree(size_t depth, size_t memory, size_t lookahead = 0);
+
+    virtual ~HashedContextTree(void);
+
+    // clear the entire context tree
+    virtual void clear(void);
+
+    // updates the context tree with a new binary symbol
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    // removes the most recently observed symbol from the context tree
+    virtual void revert(void);
+
+    // generate a single random symbol distributed according to the context
+    // tree statistics and update the context tree with it
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    // the logarithm of the block probability of the whole sequence
+    virtual double logBlockProbability(void) const;
+
+    // Calculate the probability of the next symbol given the next history
+    // P(x[i]=sym|h), without modifying the context tree
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    // the probability of a block, evaluated on copies of the slots it would
+    // change without modifying the table
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
+
+    // table occupancy and eviction count
+    virtual void logStats(std::ostream &out) const;
+
+    // node count and the memory held by the table
+    virtual void stats(model_stats_t &stats) const;
+
+    // number of nodes in the context tree, including the root
+    virtual size_t size(void) const {
+        return m_used + 1;
+    }
+
+    // number of slots in the table
+    size_t capacity(void) const {
+        return m_table.size();
+    }
+
+    // number of contexts displaced by the replacement policy
+    virtual unsigned long long evictions(void) const {
+        return m_evictions;
+    }
+
+    // table space handed over to other contexts by those evictions
+    virtual unsigned long long reclaimedBytes(void) const {
+        return m_evictions * sizeof(entry_t);
+    }
+
+private:
+    // a context node stored in the table
+    struct entry_t {
+        uint32_t check;     // tag identifying the context, 0 if empty
+        uint32_t depth;     // depth of the context
+        count_t count[2];   // a,b in CTW literature
+        weight_t log_prob_est;      // log KT estimated probability
+        weight_t log_prob_weighted; // log weighted block probability
+    };
+
+    // copies of the slots a block evaluation changes, by slot index
+    typedef std::unordered_map<size_t, entry_t> slot_copies_t;
+
+    // find the slot of a context, an invalid index if it is not stored
+    size_t find(uint64_t hash, size_t depth) const;
+
+    // the slot findOrInsert would store a context in, without storing it
+    size_t probe(uint64_t hash, size_t depth) const;
+
+    // find the entry of a context, storing it if it is new; NULL if the
+    // replacement policy leaves no room for it
+    entry_t *findOrInsert(uint64_t hash, size_t depth);
+
+    // the entry in a slot as a block evaluation sees it
+    const entry_t &slotEntry(const slot_copies_t &copies, size_t slot) const;
+
+    // find and findOrInsert on the table as a block evaluation sees it,
+    // storing new contexts in the copies
+    size_t findCopy(const slot_copies_t &copies, uint64_t hash,
+            size_t depth) const;
+    entry_t *findOrInsertCopy(slot_copies_t &copies, uint64_t hash,
+            size_t depth) const;
+
+    // collect the entries along the context starting at the given age,
+    // stopping at the first one not stored
+    void walk(size_t age, bool create);
+
+    // sum of the log weighted probabilities of the children of the node at
+    // the given depth of the path with the given context hashes, the child
+    // on the path contributing the given value
+    weight_t logProbChildren(const std::vector<uint64_t> &path_hash,
+            size_t d, symbol_t path_sym, weight_t log_prob_path_child,
+            bool &leaf) const;
+
+    std::vector<entry_t> m_table; // the hash table, a power of two slots
+    size_t m_mask;                // number of slots - 1
+    entry_t m_root;               // the root, kept outside the table
+    size_t m_used;                // occupied slots
+    unsigned long long m_evictions;
+
+    // scratch buffers of the current walk: the entries along the context
+    // (the root first) and the context hash at every depth
+    std::vector<entry_t*> m_path;
+    std::vector<uint64_t> m_path_hash;
+};
+
+#endif // __HASHTREE_HPP__
@@ -0,0 +1,80 @@
+#include "history.hpp"
+#include "util.hpp"
+
+#include <cstring>
+
+// smallest buffer, two words so that a context read always spans two words
+static const size_t MinHistoryCapacity = 128;
+
+// create an empty history holding at least the given number of symbols
+History::History(size_t capacity) :
+        m_head(0), m_size(0), m_stored(0) {
+    size_t slots = MinHistoryCapacity;
+    while (slots < capacity)
+        slots *= 2;
+    m_words.assign(slots / 64, 0);
+    m_mask = slots - 1;
+}
+
+// keep only the n most recent symbols
+void History::truncate(size_t n) {
+    if (m_stored > n)
+        m_stored = n;
+    if (m_size > n)
+        m_size = n;
+}
+
+// remove every symbol
+void History::clear(void) {
+    m_head = 0;
+    m_size = 0;
+    m_stored = 0;
+}
+
+// grow the buffer to hold at least the given number of symbols,
+// keeping the stored symbols
+void History::reserve(size_t capacity) {
+    if (capacity <= this->capacity())
+        return;
+
+    History grown(capacity);
+    for (size_t age = m_stored; age-- > 0;)
+        grown.push(recent(age));
+    grown.m_size = m_size;
+    *this = grown;
+}
+
+// write the history to a binary snapshot: the buffer geometry followed by
+// the packed words
+void History::save(std::ostream &out) const {
+    writeWord(out, m_words.size());
+    writeWord(out, m_head);
+    writeWord(out, m_size);
+    writeWord(out, m_stored);
+    writeBlock(out, &m_words[0], m_words.size() * sizeof(uint64_t));
+}
+
+// restore the history from a snapshot held in memory
+bool History::load(const char *&data, const char *end) {
+    uint64_t n_words, head, size, stored;
+    if (!readWord(data, end, n_words) || !readWord(data, end, head)
+            || !readWord(data, end, size) || !readWord(data, end, stored))
+        return false;
+
+    // the buffer must be a power of two words, at least two of them
+    if (n_words < 2 || (n_words & (n_words - 1)) != 0
+            || n_words > size_t(end - data) / sizeof(uint64_t)
+            || head >= n_words * 64 || stored > n_words * 64 || stored > size)
+        return false;
+
+    const void *words;
+    if (!readBlock(data, end, words, n_words * sizeof(uint64_t)))
+        return false;
+    m_words.resize(n_words);
+    memcpy(&m_words[0], words, n_words * sizeof(uint64_t));
+    m_mask = n_words * 64 - 1;
+    m_head = head;
+    m_size = size;
+    m_stored = stored;
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef __HISTORY_HPP__
+#define __HISTORY_HPP__
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+#include "main.hpp"
+
+// A fixed-capacity history of binary symbols, packed 64 to a word in a
+// circular buffer. Only the most recent capacity() symbols are kept; older
+// ones are overwritten as new symbols arrive. Symbols are addressed by age,
+// 0 being the most recent, which is how the context tree reads them.
+class History {
+public:
+
+    // create an empty history holding at least the given number of symbols
+    History(size_t capacity = 0);
+
+    // append a symbol to the history
+    void push(symbol_t sym) {
+        m_head = (m_head - 1) & m_mask;
+        uint64_t bit = uint64_t(1) << (m_head & 63);
+        if (sym)
+            m_words[m_head >> 6] |= bit;
+        else
+            m_words[m_head >> 6] &= ~bit;
+        m_size++;
+        if (m_stored <= m_mask)
+            m_stored++;
+    }
+
+    // remove the n most recent symbols
+    void pop(size_t n) {
+        assert(n <= m_stored);
+        m_head = (m_head + n) & m_mask;
+        m_size -= n;
+        m_stored -= n;
+    }
+
+    // the symbol of the given age, 0 being the most recent
+    symbol_t recent(size_t age) const {
+        assert(age < m_stored);
+        size_t slot = (m_head + age) & m_mask;
+        return (m_words[slot >> 6] >> (slot & 63)) & 1;
+    }
+
+    // 64 consecutive symbols starting at the given age; bit j of the result
+    // is the symbol of age + j. Bits older than stored() are undefined.
+    uint64_t context(size_t age) const {
+        size_t slot = (m_head + age) & m_mask;
+        size_t word = slot >> 6, shift = slot & 63;
+        uint64_t bits = m_words[word] >> shift;
+        if (shift != 0)
+            bits |= m_words[(word + 1) & (m_words.size() - 1)] << (64 - shift);
+        return bits;
+    }
+
+    // number of symbols appended and not popped, including overwritten ones
+    size_t size(void) const {
+        return m_size;
+    }
+
+    // number of symbols still held in the buffer
+    size_t stored(void) const {
+        return m_stored;
+    }
+
+    // maximum number of symbols held in the buffer
+    size_t capacity(void) const {
+        return m_mask + 1;
+    }
+
+    // memory held by the buffer, in bytes
+    size_t bytes(void) const {
+        return m_words.size() * sizeof(uint64_t);
+    }
+
+    // keep only the n most recent symbols
+    void truncate(size_t n);
+
+    // remove every symbol
+    void clear(void);
+
+    // grow the buffer to hold at least the given number of symbols,
+    // keeping the stored symbols
+    void reserve(size_t capacity);
+
+    // write the history to a binary snapshot
+    void save(std::ostream &out) const;
+
+    // restore the history from a snapshot held in memory, stepping past
+    // it; false if the snapshot is malformed
+    bool load(const char *&data, const char *end);
+
+private:
+    std::vector<uint64_t> m_words; // packed symbols, a power of two words
+    size_t m_mask;   // capacity - 1, the capacity being a power of two
+    size_t m_head;   // slot of the most recent symbol
+    size_t m_size;   // logical length of the history
+    size_t m_stored; // symbols held in the buffer, at most capacity
+};
+
+#endif // __HISTORY_HPP__
@@ -0,0 +1,35 @@
+#include "logmath.hpp"
+
+double log_kt_numerator[LogKTTableSize];
+double log_kt_denominator[LogKTTableSize];
+double log_kt_numerator_sum[LogKTTableSize];
+double log_kt_denominator_sum[LogKTTableSize];
+log_add_sample_t log_add_table[LogAddTableSize];
+
+// Fill the tables before main() runs
+static struct LogMathTables {
+    LogMathTables(void) {
+        for (unsigned int n = 0; n < LogKTTableSize; n++) {
+            log_kt_numerator[n] = log2(n + 0.5);
+            log_kt_denominator[n] = log2(n + 1.0);
+        }
+        log_kt_numerator_sum[0] = 0.0;
+        log_kt_denominator_sum[0] = 0.0;
+        for (unsigned int n = 1; n < LogKTTableSize; n++) {
+            log_kt_numerator_sum[n] = log_kt_numerator_sum[n - 1]
+                    + log_kt_numerator[n - 1];
+            log_kt_denominator_sum[n] = log_kt_denominator_sum[n - 1]
+                    + log_kt_denominator[n - 1];
+        }
+
+        for (int i = 0; i < LogAddTableSize; i++) {
+            double x = -LogAddTableRange + double(i) / LogAddTableStep;
+            // log1p keeps full precision where 2^x is tiny
+            if (x <= 0)
+                log_add_table[i].value = log1p(exp2(x)) * M_LOG2E;
+            else
+                log_add_table[i].value = x + log1p(exp2(-x)) * M_LOG2E;
+            log_add_table[i].slope = 1.0 / (1.0 + exp2(-x));
+        }
+    }
+} log_math_tables;
@@ -0,0 +1,93 @@
+#ifndef __LOGMATH_HPP__
+#define __LOGMATH_HPP__
+
+#include <cmath>
+
+// Arithmetic in the log2 domain used by the context tree updates. Small
+// cases are read from tables built at start up; everything else falls back
+// to the exact formulas.
+
+// counts below this bound take the KT multiplier from the tables
+static const unsigned int LogKTTableSize = 256;
+
+// log2(1 + 2^x) is interpolated from the table for |x| below this bound
+static const int LogAddTableRange = 32;
+
+// table entries per unit of x
+static const int LogAddTableStep = 16;
+
+// number of entries in the log2(1 + 2^x) table
+static const int LogAddTableSize = 2 * LogAddTableRange * LogAddTableStep + 1;
+
+// log2(a + 1/2) and log2(n + 1) for a, n < LogKTTableSize
+extern double log_kt_numerator[LogKTTableSize];
+extern double log_kt_denominator[LogKTTableSize];
+
+// sums of the first n entries of the tables above: log2 of the KT
+// numerator and denominator products of a sequence of n symbols
+extern double log_kt_numerator_sum[LogKTTableSize];
+extern double log_kt_denominator_sum[LogKTTableSize];
+
+// samples of log2(1 + 2^x) and its derivative, 2^x / (1 + 2^x), spaced
+// 1/LogAddTableStep apart from x = -LogAddTableRange
+struct log_add_sample_t {
+    double value;
+    double slope;
+};
+extern log_add_sample_t log_add_table[LogAddTableSize];
+
+// log2((count_sym + 1/2) / (count_total + 1)), the logarithm of the
+// KT-estimator update multiplier. The table lookup differs from the direct
+// formula by a few ulp at most.
+inline double logKTMultiplier(unsigned int count_sym,
+        unsigned int count_total) {
+    if (count_total < LogKTTableSize) {
+        return log_kt_numerator[count_sym] - log_kt_denominator[count_total];
+    }
+    return log2((count_sym + 0.5) / (count_total + 1));
+}
+
+// log2 of the KT estimated probability of a sequence with the given
+// counts, the product of the multipliers of its symbols in any order
+inline double logKTEstimate(unsigned int count_0, unsigned int count_1) {
+    unsigned int count_total = count_0 + count_1;
+    if (count_total < LogKTTableSize) {
+        return log_kt_numerator_sum[count_0] + log_kt_numerator_sum[count_1]
+                - log_kt_denominator_sum[count_total];
+    }
+    return (lgamma(count_0 + 0.5) + lgamma(count_1 + 0.5)
+            - lgamma(count_total + 1.0) - 2 * lgamma(0.5)) * M_LOG2E;
+}
+
+// log2(1 + 2^x), by cubic Hermite interpolation of the table inside
+// [-LogAddTableRange, LogAddTableRange]; the absolute error there is below
+// 2e-9. Outside the range a single exp2 term is exact to double precision.
+inline double logOnePlusExp2(double x) {
+    if (x <= -LogAddTableRange) {
+        return exp2(x) * M_LOG2E;
+    }
+    if (x >= LogAddTableRange) {
+        return x + exp2(-x) * M_LOG2E;
+    }
+
+    double t = (x + LogAddTableRange) * LogAddTableStep;
+    int i = int(t);
+    double u = t - i;
+    const log_add_sample_t &lo = log_add_table[i];
+    const log_add_sample_t &hi = log_add_table[i + 1];
+    const double h = 1.0 / LogAddTableStep;
+
+    double u2 = u * u;
+    double u3 = u2 * u;
+    return (2 * u3 - 3 * u2 + 1) * lo.value + (u3 - 2 * u2 + u) * h * lo.slope
+            + (3 * u2 - 2 * u3) * hi.value + (u3 - u2) * h * hi.slope;
+}
+
+// log2((2^log_prob_est + 2^log_prob_children) / 2), the CTW weighted block
+// probability of a node from its KT estimate and its children's product
+inline double logWeightedMix(double log_prob_est, double log_prob_children) {
+    return logOnePlusExp2(log_prob_est - log_prob_children)
+            + log_prob_children - 1;
+}
+
+#endif // __LOGMATH_HPP__
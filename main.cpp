@@ -42,6 +42,17 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
         assert(0 <= terminate_lifetime);
     }
 
+    // Log the model's loss on each percept, from its full distribution
+    bool log_percept_loss = strExtract<int>(options["log-percept-loss"]) != 0;
+    unsigned int obs_bits = strExtract<unsigned int>(options["observation-bits"]);
+    std::vector<double> percept_probs;
+
+    // Model growth is logged per cycle from the running node totals
+    model_stats_t model_stats;
+    ai.modelStats(model_stats);
+    unsigned long long nodes_created = model_stats.created;
+    unsigned long long nodes_destroyed = model_stats.destroyed;
+
     // Agent/environment interaction loop
     action_t action = 0;
     int cycle = 1;
@@ -61,6 +72,14 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
         // Reset the UCT
         ai.searchTreeReset();
 
+        // The model's log-loss on the percept, before learning from it
+        if (log_percept_loss && ai.historySize() >= ai.maxTreeDepth()) {
+            ai.perceptDistribution(percept_probs);
+            aixi::log << "percept log-loss: "
+                    << -log2(percept_probs[observation + (reward << obs_bits)])
+                    << std::endl;
+        }
+
         // Update agent's environment model with the new percept
         ai.modelUpdate(observation, reward);
 
@@ -116,13 +135,26 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
         aixi::log << "Search tree size: "
                 << ai.searchTree()->getDecisionNodeInfo() << std::endl;
         aixi::log << "Global cycle number: " << global_cycles_g << std::endl;
+        ai.logModelStats(aixi::log);
 
-        // Log the data in a more compact form
+        // Log the data in a more compact form; the nodes at each depth go
+        // in one space-separated field
+        ai.modelStats(model_stats);
         compactLog << global_cycles_g << ", " << cycle << ", " << observation
                 << ", " << reward << ", " << action << ", " << explore_g << ", "
                 << explored << ", " << explore_rate_g << ", " << ai.reward()
                 << ", " << ai.averageReward() << ", " << env.isFinished()
-                << std::endl;
+                << ", " << ai.modelEvictions() << ", "
+                << ai.modelReclaimedBytes() << ", " << model_stats.nodes << ", "
+                << model_stats.bytes << ", "
+                << model_stats.created - nodes_created << ", "
+                << model_stats.destroyed - nodes_destroyed << ", "
+                << model_stats.max_history << ",";
+        for (size_t d = 0; d < model_stats.depth_nodes.size(); d++)
+            compactLog << " " << model_stats.depth_nodes[d];
+        compactLog << std::endl;
+        nodes_created = model_stats.created;
+        nodes_destroyed = model_stats.destroyed;
 
         // Break out before performing another action, since the environment is finished.
         if (dobreak) {
@@ -157,13 +189,30 @@ int main(int argc, char *argv[]) {
 
     // Print header to compactLog
     compactLog
-            << "global_cycle, cycle, observation, reward, action, explore_on, explored, explore_rate_g, total reward, average reward, end of game"
+            << "global_cycle, cycle, observation, reward, action, explore_on, explored, explore_rate_g, total reward, average reward, end of game, ct evictions, ct reclaimed bytes, ct nodes, ct bytes, ct nodes created, ct nodes destroyed, max history, ct nodes by depth"
             << std::endl;
 
     options_t options;
 
     // Default configuration values
-    options["ct-depth"] = "3";				// max context tree depth
+    options["ct-depth"] = "3";				// max context tree depth, in symbols for the symbol backend
+    options["ct-factored"] = "0";			// one context tree for all percept bits
+    options["ct-backend"] = "exact";		// exact, hashed, compressed, symbol, or compare
+    options["ct-shadow"] = "hashed";		// backend compared with exact: hashed or compressed
+    options["ct-hash-memory"] = "256";		// hashed context tree budget in MB
+    options["max-ct-nodes"] = "0";			// exact context tree node budget, 0 for none
+    options["ct-lazy-depth"] = "0";			// depth from which exact tree contexts extend lazily
+    options["ct-lazy-visits"] = "0";		// visits before a lazy context extends, 0 for eager
+    options["ct-context"] = "";				// context mask, e.g. action:1,observation:1:0-3
+    options["ct-overlay"] = "0";			// simulate on copy-on-write overlays of the tree
+    options["ct-journal"] = "1";			// journal simulated updates to revert them by copying
+    options["ct-arena-dir"] = "";			// directory for files to page exact tree nodes out to, empty for memory
+    options["search-frozen"] = "0";		// simulate without updating the trees, caching their predictions
+    options["rollout-ct-depth"] = "0";		// depth of a shallower tree for playouts, 0 for none
+    options["log-percept-loss"] = "0";		// log the model's loss on every percept
+    // load-model and save-model name an exact context tree snapshot to start
+    // from and to write when the run ends; pretrain-log names a run's csv log
+    // to train the model on before the live run; none is set by default
     options["agent-horizon"] = "16";		// agent max search horizon
     options["exploration"] = "0";			// do not explore_g
     options["explore-decay"] = "1.0";		// exploration rate does not decay
@@ -197,8 +246,13 @@ int main(int argc, char *argv[]) {
     // Set up the environment
     Environment * env = getEnvFromOptions(options);
 
-    // Set up the agent
+    // Set up the agent, warm-started from a saved model or a recorded run
+    // if one is given
     Agent ai(options);
+    if (options.count("load-model") > 0)
+        ai.loadModel(options["load-model"]);
+    if (options.count("pretrain-log") > 0)
+        ai.pretrain(options["pretrain-log"]);
 
     // Set the global experiment options
     setGlobalOptions(options);
@@ -244,6 +298,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (options.count("save-model") > 0)
+        ai.saveModel(options["save-model"]);
+
     std::cout << "Done!" << std::endl;
     aixi::log.close();
     compactLog.close();
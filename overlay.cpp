@@ -0,0 +1,349 @@
+#include "overlay.hpp"
+#include "logmath.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+// create an overlay over the given committed tree
+ContextTreeOverlay::ContextTreeOverlay(const ContextTree &base,
+        size_t lookahead) :
+        ContextModel(base.depth(), lookahead), m_base(base) {
+    m_context_ages = base.contextMask();
+    discard();
+}
+
+ContextTreeOverlay::~ContextTreeOverlay(void) {
+}
+
+// Drop every change. The committed tree may have grown since the overlay
+// was last discarded, so its arena size and history are taken afresh.
+void ContextTreeOverlay::discard(void) {
+    m_delta.clear();
+    m_new.clear();
+    m_base_size = node_index_t(m_base.m_nodes.size());
+    m_history = m_base.m_history;
+}
+
+void ContextTreeOverlay::clear(void) {
+    discard();
+}
+
+// the current version of a node: the overlay's own node, its copy of a
+// committed node, or else the committed node itself
+const CTNode &ContextTreeOverlay::node(node_index_t index) const {
+    if (index >= m_base_size)
+        return m_new[index - m_base_size];
+    std::unordered_map<node_index_t, CTNode>::const_iterator it =
+            m_delta.find(index);
+    return it != m_delta.end() ? it->second : m_base.m_nodes[index];
+}
+
+// a node the overlay may modify, copied from the committed tree first
+CTNode &ContextTreeOverlay::writable(node_index_t index) {
+    if (index >= m_base_size)
+        return m_new[index - m_base_size];
+    return m_delta.insert(std::make_pair(index, m_base.m_nodes[index])).first->second;
+}
+
+// sum of the log weighted probabilities of a node's children, with the
+// estimate of the symbols they have not seen
+weight_t ContextTreeOverlay::logProbChildren(const CTNode &n) const {
+    return n.logProbChildren([this](node_index_t index) -> const CTNode & {
+        return node(index);
+    });
+}
+
+// collect the nodes along the context starting at the given age, root first
+void ContextTreeOverlay::walk(size_t age) {
+    node_index_t current = 0;
+    uint64_t context = 0;
+
+    m_path.clear();
+    m_path.push_back(current);
+    for (size_t d = 0; d < m_depth; d++) {
+        const CTNode &n = node(current);
+        if (m_base.isLeafContext(n, d, n.visits() - count_t(age)))
+            break;
+
+        symbol_t sym;
+        if (!m_context_ages.empty()) {
+            sym = m_history.recent(age + m_context_ages[d]);
+        } else {
+            if ((d & 63) == 0)
+                context = m_history.context(age + d);
+            sym = context & 1;
+            context >>= 1;
+        }
+
+        node_index_t next = n.m_child[sym];
+        if (next == NoChild) {
+            // m_new may grow here, so only indices are held across it
+            next = node_index_t(m_base_size + m_new.size());
+            m_new.push_back(CTNode());
+            writable(current).m_child[sym] = next;
+        }
+        m_path.push_back(next);
+        current = next;
+    }
+}
+
+// updates the overlay with a new binary symbol
+void ContextTreeOverlay::update(const symbol_t sym) {
+    // the context of the new symbol starts at the most recent one
+    walk(0);
+
+    for (size_t d = m_path.size(); d-- > 0;) {
+        CTNode &n = writable(m_path[d]);
+        n.update(sym);
+        n.updateLogProbability(n.isLeaf(), logProbChildren(n));
+    }
+    updateHistory(sym);
+}
+
+// revert the overlay to its state prior to the most recently observed symbol
+void ContextTreeOverlay::revert(void) {
+    symbol_t sym = m_history.recent(0);
+
+    // the context of the last symbol starts one symbol further back, and
+    // every node on it exists
+    walk(1);
+
+    for (size_t d = m_path.size(); d-- > 0;) {
+        CTNode &n = writable(m_path[d]);
+        n.revert(sym);
+        if (n.visits() > 0)
+            n.updateLogProbability(n.isLeaf(), logProbChildren(n));
+        else if (d > 0)
+            writable(m_path[d - 1]).m_child[m_history.recent(
+                    contextAge(d - 1) + 1)] = NoChild;
+    }
+}
+
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h), without modifying the overlay
+double ContextTreeOverlay::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    std::vector<node_index_t> context_path;
+    context_path.reserve(m_depth + 1);
+
+    node_index_t current = 0;
+    uint64_t context = 0;
+    bool pruned = false;
+    context_path.push_back(current);
+    for (size_t d = 0; d < m_depth; d++) {
+        const CTNode &n = node(current);
+        if (m_base.isLeafContext(n, d, n.visits())) {
+            pruned = true;
+            break;
+        }
+        symbol_t context_sym;
+        if (!m_context_ages.empty()) {
+            context_sym = m_history.recent(m_context_ages[d]);
+        } else {
+            if ((d & 63) == 0)
+                context = m_history.context(d);
+            context_sym = context & 1;
+            context >>= 1;
+        }
+        current = n.m_child[context_sym];
+        if (current == NoChild)
+            break;
+        context_path.push_back(current);
+    }
+
+    return CTNode::logProbPath(
+            [this](node_index_t index) -> const CTNode & {
+                return node(index);
+            },
+            &context_path[0], context_path.size(),
+            context_path.size() == m_depth + 1 || pruned, sym,
+            [this](size_t d) { return m_history.recent(contextAge(d)); });
+}
+
+// The probability of a block of symbols, from copies of the nodes it would
+// change, as for the committed tree
+double ContextTreeOverlay::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    static thread_local ContextTreeCursor cursor;
+    return cursor.logProbBlock(*this, block, n, first);
+}
+
+// generate a single random symbol distributed according to the overlay's
+// statistics and update the overlay with it
+symbol_t ContextTreeOverlay::genRandomSymbolAndUpdate(void) {
+    symbol_t sym = (rand01() > predict(false));
+    update(sym);
+    return sym;
+}
+
+// the logarithm of the block probability of the whole sequence
+double ContextTreeOverlay::logBlockProbability(void) const {
+    return node(0).m_log_prob_weighted;
+}
+
+ContextTreeCursor::ContextTreeCursor(void) :
+        m_tree(NULL), m_overlay(NULL), m_history(NULL), m_arena_size(0),
+        m_block(0), m_next_new(0), m_stamp(0) {
+}
+
+// the slot holding a node, or the empty slot it would go in
+size_t ContextTreeCursor::find(node_index_t index) const {
+    size_t mask = m_slots.size() - 1;
+    size_t slot = (index * 0x9E3779B1u) & mask;
+    while (m_slots[slot].stamp == m_stamp && m_slots[slot].index != index)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// a node as the tree, or the overlay over it, holds it
+const CTNode &ContextTreeCursor::source(node_index_t index) const {
+    return m_overlay != NULL ? m_overlay->node(index) : m_tree->m_nodes[index];
+}
+
+// the current version of a node: the cursor's copy, or else the tree's
+const CTNode &ContextTreeCursor::node(node_index_t index) const {
+    const slot_t &slot = m_slots[find(index)];
+    return slot.stamp == m_stamp ? slot.node : source(index);
+}
+
+// a copy of a node the evaluation may modify, taken on first use
+CTNode &ContextTreeCursor::writable(node_index_t index) {
+    slot_t &slot = m_slots[find(index)];
+    if (slot.stamp != m_stamp) {
+        slot.index = index;
+        slot.stamp = m_stamp;
+        slot.node = index < m_arena_size ? source(index) : CTNode();
+    }
+    return slot.node;
+}
+
+// sum of the log weighted probabilities of a node's children, with the
+// estimate of the symbols they have not seen
+weight_t ContextTreeCursor::logProbChildren(const CTNode &n) const {
+    return n.logProbChildren([this](node_index_t index) -> const CTNode & {
+        return node(index);
+    });
+}
+
+// the symbol of the given age in the context of the j'th block symbol: the
+// block symbols before it, most recent first, then the history
+symbol_t ContextTreeCursor::contextSymbol(size_t j, size_t age) const {
+    if (age < j)
+        return (m_block >> (j - 1 - age)) & 1;
+    return m_history->recent(age - j);
+}
+
+// add the j'th block symbol to the copies and return its log probability
+double ContextTreeCursor::update(size_t j) {
+    weight_t log_prob_root = node(0).m_log_prob_weighted;
+    node_index_t current = 0;
+    size_t fresh_depth = m_tree->depth() + 1; // depth of the first new node
+
+    m_path.clear();
+    m_path.push_back(current);
+    for (size_t d = 0; d < m_tree->depth(); d++) {
+        const CTNode &n = node(current);
+        if (m_tree->isLeafContext(n, d, n.visits()))
+            break;
+
+        symbol_t sym = contextSymbol(j, m_tree->contextAge(d));
+        node_index_t next = n.m_child[sym];
+        if (next == NoChild) {
+            next = m_next_new++;
+            writable(next);
+            writable(current).m_child[sym] = next;
+            fresh_depth = std::min(fresh_depth, d + 1);
+        }
+        m_path.push_back(next);
+        current = next;
+    }
+
+    symbol_t sym = (m_block >> j) & 1;
+    if (!CompactWeights) {
+        for (size_t d = m_path.size(); d-- > 0;) {
+            CTNode &n = writable(m_path[d]);
+            n.update(sym);
+            n.updateLogProbability(n.isLeaf(), logProbChildren(n));
+        }
+        return node(0).m_log_prob_weighted - log_prob_root;
+    }
+
+    // The weighted probabilities before the update are worked out along
+    // the path as well, as for a prediction
+    weight_t child_log_prob = 0.0;
+    weight_t child_log_prob_before = 0.0;
+    for (size_t d = m_path.size(); d-- > 0;) {
+        CTNode &n = writable(m_path[d]);
+        weight_t log_prob_before = n.logProbEstimated();
+        n.update(sym);
+        if (n.isLeaf()) {
+            child_log_prob = n.updateLogProbability(true, 0.0);
+        } else {
+            // the counts the children have not seen are the same before
+            // and after the update
+            symbol_t path_sym = contextSymbol(j, m_tree->contextAge(d));
+            weight_t log_prob_rest = n.logProbChildren(
+                    [this](node_index_t index) -> const CTNode & {
+                        return node(index);
+                    }, path_sym);
+            child_log_prob = n.updateLogProbability(false,
+                    log_prob_rest + child_log_prob);
+            // a node the walk has just given its first child was a leaf
+            if (n.m_child[!path_sym] != NoChild || d + 1 < fresh_depth)
+                log_prob_before = logWeightedMix(log_prob_before,
+                        log_prob_rest + child_log_prob_before);
+        }
+        child_log_prob_before = log_prob_before;
+    }
+    return child_log_prob - child_log_prob_before;
+}
+
+// the logarithm of the probability of a block of symbols
+double ContextTreeCursor::logProbBlock(const ContextTree &tree,
+        uint64_t block, size_t n, size_t first) {
+    m_tree = &tree;
+    m_overlay = NULL;
+    m_history = &tree.m_history;
+    m_arena_size = node_index_t(tree.m_nodes.size());
+    return evaluate(block, n, first);
+}
+
+// the same for a tree seen through an overlay, whose own nodes are
+// numbered from the end of the tree's arena
+double ContextTreeCursor::logProbBlock(const ContextTreeOverlay &overlay,
+        uint64_t block, size_t n, size_t first) {
+    m_tree = &overlay.m_base;
+    m_overlay = &overlay;
+    m_history = &overlay.m_history;
+    m_arena_size = node_index_t(overlay.m_base_size + overlay.m_new.size());
+    return evaluate(block, n, first);
+}
+
+// the probability of the block from the first symbol on
+double ContextTreeCursor::evaluate(uint64_t block, size_t n, size_t first) {
+    assert(n <= 64 && first <= n);
+    m_block = block;
+    m_next_new = m_arena_size;
+
+    // Every symbol copies at most one node per depth. Keep the table at
+    // most half full; a fresh stamp empties it.
+    size_t slots = 64;
+    while (slots < 2 * (n - first) * (m_tree->depth() + 1))
+        slots *= 2;
+    if (m_slots.size() < slots) {
+        slot_t empty = { 0, 0, CTNode() };
+        m_slots.assign(slots, empty);
+        m_stamp = 0;
+    }
+    if (++m_stamp == 0) {
+        for (size_t i = 0; i < m_slots.size(); i++)
+            m_slots[i].stamp = 0;
+        m_stamp = 1;
+    }
+
+    double log_prob = 0.0;
+    for (size_t j = first; j < n; j++)
+        log_prob += update(j);
+    return log_prob;
+}
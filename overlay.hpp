@@ -0,0 +1,153 @@
+#ifndef __OVERLAY_HPP__
+#define __OVERLAY_HPP__
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "main.hpp"
+#include "predict.hpp"
+
+// A copy-on-write view of a committed context tree for one simulation,
+// which copies the nodes it changes and numbers the ones it creates from
+// the end of the committed arena; the committed tree is only read
+class ContextTreeOverlay: public ContextModel {
+    friend class ContextTreeCursor; // read the nodes and the history
+
+public:
+
+    // create an overlay over the given committed tree, keeping enough
+    // history to revert the given number of symbols
+    ContextTreeOverlay(const ContextTree &base, size_t lookahead = 0);
+
+    virtual ~ContextTreeOverlay(void);
+
+    // drop every change and take up the committed tree's current state
+    void discard(void);
+
+    // the committed tree cannot be cleared through an overlay, so this
+    // only discards the changes
+    virtual void clear(void);
+
+    // updates the overlay with a new binary symbol
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    // removes the most recently observed symbol from the overlay
+    virtual void revert(void);
+
+    // generate a single random symbol distributed according to the
+    // overlay's statistics and update the overlay with it
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    // the logarithm of the block probability of the whole sequence
+    virtual double logBlockProbability(void) const;
+
+    // Calculate the probability of the next symbol given the next history
+    // P(x[i]=sym|h), without modifying the overlay
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    // the probability of a block, evaluated on a cursor of the calling
+    // thread without modifying the overlay
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
+
+    // number of nodes seen through the overlay
+    virtual size_t size(void) const {
+        return m_base.size() + m_new.size();
+    }
+
+    // number of committed nodes copied into the overlay
+    size_t copied(void) const {
+        return m_delta.size();
+    }
+
+private:
+    // the current version of a node
+    const CTNode &node(node_index_t index) const;
+
+    // a node the overlay may modify, copied from the committed tree first
+    CTNode &writable(node_index_t index);
+
+    // sum of the log weighted probabilities of a node's children, with
+    // the estimate of the symbols they have not seen
+    weight_t logProbChildren(const CTNode &node) const;
+
+    // collect the nodes along the context starting at the given age, down
+    // to the maximum depth or a context acting as a leaf, creating missing
+    // nodes
+    void walk(size_t age);
+
+    const ContextTree &m_base;
+    node_index_t m_base_size; // arena size of the committed tree
+
+    std::unordered_map<node_index_t, CTNode> m_delta; // modified committed nodes
+    std::vector<CTNode> m_new; // nodes created by the overlay
+
+    std::vector<node_index_t> m_path; // scratch buffer of the current walk
+};
+
+// A scratch view of a context tree for one thread, evaluating a block of
+// symbols on copies of the nodes it would change in a reused flat table
+class ContextTreeCursor {
+public:
+
+    ContextTreeCursor(void);
+
+    // as ContextModel::logProbBlock, for the given tree
+    double logProbBlock(const ContextTree &tree, uint64_t block, size_t n,
+            size_t first);
+
+    // the same for a tree seen through an overlay
+    double logProbBlock(const ContextTreeOverlay &overlay, uint64_t block,
+            size_t n, size_t first);
+
+private:
+    // a node copied into the cursor, current while its stamp is
+    struct slot_t {
+        node_index_t index;
+        unsigned int stamp;
+        CTNode node;
+    };
+
+    // a node as the tree, or the overlay over it, holds it
+    const CTNode &source(node_index_t index) const;
+
+    // the current version of a node
+    const CTNode &node(node_index_t index) const;
+
+    // a copy of a node the evaluation may modify, taken on first use;
+    // nodes numbered past the tree's arena start out empty
+    CTNode &writable(node_index_t index);
+
+    // the slot holding a node, or the empty slot it would go in
+    size_t find(node_index_t index) const;
+
+    // sum of the log weighted probabilities of a node's children, with
+    // the estimate of the symbols they have not seen
+    weight_t logProbChildren(const CTNode &node) const;
+
+    // the symbol of the given age in the context of the j'th block symbol
+    symbol_t contextSymbol(size_t j, size_t age) const;
+
+    // add the j'th block symbol to the copies of the nodes on its context,
+    // returning its log probability
+    double update(size_t j);
+
+    // the probability of the block from the first symbol on
+    double evaluate(uint64_t block, size_t n, size_t first);
+
+    const ContextTree *m_tree;
+    const ContextTreeOverlay *m_overlay; // NULL for the tree itself
+    const history_t *m_history;          // the history the block follows
+    node_index_t m_arena_size;           // nodes held by the tree or overlay
+    uint64_t m_block;
+    node_index_t m_next_new; // number of the next node the block creates
+
+    std::vector<slot_t> m_slots; // open-addressed, a power of two slots
+    unsigned int m_stamp;        // stamp of the current evaluation
+
+    std::vector<node_index_t> m_path; // scratch buffer of the current walk
+};
+
+#endif // __OVERLAY_HPP__
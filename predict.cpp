@@ -1,310 +1,1284 @@
 #include "predict.hpp"
+#include "logmath.hpp"
+#include "overlay.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <limits>
+#include <thread>
 #include <stdio.h>
 
 CTNode::CTNode(void) :
-        m_log_prob_est(0.0), m_log_prob_weighted(0.0) {
+#ifndef CT_COMPACT_NODES
+        m_log_prob_est(0.0),
+#endif
+        m_log_prob_weighted(0.0) {
     m_count[0] = 0;
     m_count[1] = 0;
-    m_child[0] = NULL;
-    m_child[1] = NULL;
-}
-
-CTNode::~CTNode(void) {
-    if (m_child[0])
-        delete m_child[0];
-    if (m_child[1])
-        delete m_child[1];
+    m_child[0] = NoChild;
+    m_child[1] = NoChild;
 }
 
 void CTNode::print(void) const {
     std::cout << "Printing node..." << std::endl;
 }
 
-// number of descendants of a node in the context tree
-size_t CTNode::size(void) const {
-
-    size_t rval = 1;
-    rval += child(false) ? child(false)->size() : 0;
-    rval += child(true) ? child(true)->size() : 0;
-    return rval;
-}
-
 // compute the logarithm of the KT-estimator update multiplier
 double CTNode::logKTMul(symbol_t sym) const {
-    return log2((m_count[sym] + 0.5) / (m_count[0] + m_count[1] + 1));;
+    return logKTMultiplier(m_count[sym], m_count[0] + m_count[1]);
 }
 
 // Calculate the logarithm of the weighted block probability.
-void CTNode::updateLogProbability(void) {
-
-    if (m_child[0] == NULL) {
-        if (m_child[1] == NULL) {
-            // Calculate weighted log probability when the node is leaf
-            m_log_prob_weighted = m_log_prob_est;
-        } else {
-            // Calculate weighted log probability when the node has no right child(sym 0)
-            m_log_prob_weighted = log2(
-                    pow(2, m_log_prob_est - m_child[1]->m_log_prob_weighted)
-                            + 1) + m_child[1]->m_log_prob_weighted - 1;
-        }
+// A missing child contributes a log probability of zero, so a single
+// expression covers nodes with one or two children.
+weight_t CTNode::updateLogProbability(bool leaf,
+        weight_t log_prob_children) {
+    weight_t log_prob_weighted;
+    if (leaf) {
+        // Calculate weighted log probability when the node is leaf
+        log_prob_weighted = logProbEstimated();
     } else {
-        if (m_child[1] == NULL) {
-            // Calculate weighted log probability when the node has no left child(sym 1)
-            m_log_prob_weighted = log2(
-                    pow(2, m_log_prob_est - m_child[0]->m_log_prob_weighted)
-                            + 1) + m_child[0]->m_log_prob_weighted - 1;
-        } else {
-            // Calculate weighted log probability with both children(sym 1 and sym 2)
-            m_log_prob_weighted = log2(
-                    pow(2,
-                            m_log_prob_est
-                                    - (m_child[0]->m_log_prob_weighted
-                                            + m_child[1]->m_log_prob_weighted))
-                            + 1)
-                    + (m_child[0]->m_log_prob_weighted
-                            + m_child[1]->m_log_prob_weighted) - 1;
-        }
+        // Calculate weighted log probability from the children
+        log_prob_weighted = logWeightedMix(logProbEstimated(),
+                log_prob_children);
     }
-
+    m_log_prob_weighted = log_prob_weighted;
+    return log_prob_weighted;
 }
 
-// Update the node after having observed a new symbol.
+// Count a newly observed symbol in the node's KT estimate.
 void CTNode::update(const symbol_t symbol) {
+#ifndef CT_COMPACT_NODES
     // Update the KT estimate for this node
     m_log_prob_est += logKTMul(symbol);
+#endif
 
     // Update 0 or 1 counter for this node
+    assert(m_count[symbol] < count_t(node_count_t(~0u)));
     m_count[symbol]++;
-    // Update the weighted probability of this node
-    updateLogProbability();
 }
 
-// Return the node to its state immediately prior to the last update.
+// Return the counts and the KT estimate to their state immediately prior
+// to the last update.
 void CTNode::revert(const symbol_t symbol) {
     // Decrement the count for the symbol
     m_count[symbol]--;
     if (m_count[0] == 0 && m_count[1] == 0) {
+        // back to a node never visited, as an emptied root is
+#ifndef CT_COMPACT_NODES
+        m_log_prob_est = 0.0;
+#endif
+        m_log_prob_weighted = 0.0;
         return;
     }
-    // Reset the KT estimate on the node and then weighted log probability
+    // Reset the KT estimate on the node
+#ifndef CT_COMPACT_NODES
     m_log_prob_est -= logKTMul(symbol);
-    updateLogProbability();
+#endif
+}
+
+// update a node never visited before, as the first node of a chain of
+// them: its KT estimate and so its weighted probability become 1/2
+void CTNode::updateFresh(const symbol_t symbol) {
+    m_count[symbol] = 1;
+#ifndef CT_COMPACT_NODES
+    m_log_prob_est = -1.0;
+#endif
+    m_log_prob_weighted = -1.0;
+}
+
+// create a model with the specified maximum context depth, keeping
+// enough history to revert the given number of symbols
+ContextModel::ContextModel(size_t depth, size_t lookahead) :
+        m_history(depth + lookahead + 1), m_depth(depth), m_lookahead(
+                lookahead), m_max_history(0) {
+}
+
+ContextModel::~ContextModel(void) {
+}
+
+// reset the history to the last ct-depth size of history
+void ContextModel::resetHistory(void) {
+    m_history.truncate(contextSpan());
+}
+
+// update the model with a list of symbols
+void ContextModel::update(const symbol_list_t &symbol_list) {
+    for (size_t i = 0; i < symbol_list.size(); i++) {
+        // Update one symbol at a time in the block of symbols
+        update(symbol_list[i]);
+    }
+}
+
+// updates the history statistics, without touching the model
+void ContextModel::updateHistory(const symbol_list_t &symbol_list) {
+    for (size_t i = 0; i < symbol_list.size(); i++) {
+        updateHistory(symbol_list[i]);
+    }
+}
+
+void ContextModel::updateHistory(const symbol_t sym) {
+    m_history.push(sym);
+    if (m_history.size() > m_max_history)
+        m_max_history = m_history.size();
+}
+
+// shrinks the history down to a former size
+void ContextModel::revertHistory(size_t newsize) {
+
+    assert(newsize <= m_history.size());
+    m_history.pop(m_history.size() - newsize);
+}
+
+// the estimated probability of observing a particular symbol next
+double ContextModel::predict(symbol_t sym) const {
+    return exp2(getLogProbNextSymbolGivenH(sym));
+}
+
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h) and update
+double ContextModel::getLogProbNextSymbolGivenHWithUpdate(symbol_t sym) {
+    double prob_log_next_bit, new_log_block_prob, last_log_block_prob;
+
+    last_log_block_prob = logBlockProbability();
+    // To calculate the root probability as if the next symbol was 0
+    update(sym);
+    new_log_block_prob = logBlockProbability();
+    prob_log_next_bit = new_log_block_prob - last_log_block_prob;
+    // Remove the recently added 0, which was used for calculating the root prob
+
+    return prob_log_next_bit;
+}
+
+// generate a specified number of random symbols
+// distributed according to the model statistics
+// Note: It does not revert the history
+void ContextModel::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+
+    genRandomSymbolsAndUpdate(symbols, bits);
+
+    // restore the model to it's original state
+    for (size_t i = 0; i < bits; i++)
+        revert();
+}
+
+// Generate a specified number of random symbols distributed according to
+// the model statistics and update the model with the newly
+// generated bits
+void ContextModel::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
+        size_t bits) {
+
+    for (int i = 0; i < bits; i++) {
+        symbols[i] = genRandomSymbolAndUpdate();
+    }
+}
+
+// Update the model with a block of symbols, bit i the i'th
+void ContextModel::updateBlock(uint64_t block, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        update(symbol_t((block >> i) & 1));
+}
+
+// Generate a block of symbols distributed according to the model
+// statistics, updating the model with each
+uint64_t ContextModel::genRandomBlockAndUpdate(size_t n) {
+    uint64_t block = 0;
+    for (size_t i = 0; i < n; i++)
+        block |= uint64_t(genRandomSymbolAndUpdate()) << i;
+    return block;
+}
+
+// Remove the last symbols from the model, most recent first
+void ContextModel::revertBlock(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        revert();
+        revertHistory(historySize() - 1);
+    }
+}
+
+// The probability of each block of the given number of symbols that can
+// come next, walking the blocks as a binary tree
+void ContextModel::blockDistribution(size_t bits, std::vector<double> &probs) {
+    probs.assign(size_t(1) << bits, 1.0);
+    if (bits > 0)
+        blockDistribution(bits, 0, 0, 0.0, probs);
+}
+
+// Fill in the probabilities of the blocks extending a prefix. Each prefix
+// is added to the model once and removed again once its extensions are
+// done; the last symbol of a block is predicted without updating. Every
+// symbol's probability is predicted rather than taken from the change in
+// the block probability, which a model may hold at lower precision.
+void ContextModel::blockDistribution(size_t bits, size_t length,
+        size_t prefix, double log_prob, std::vector<double> &probs) {
+    for (int sym = 0; sym < 2; sym++) {
+        size_t block = prefix | (size_t(sym) << length);
+        double sym_log_prob = log_prob + getLogProbNextSymbolGivenH(sym);
+        if (length + 1 == bits) {
+            probs[block] = exp2(sym_log_prob);
+            continue;
+        }
+
+        update(sym);
+        blockDistribution(bits, length + 1, block, sym_log_prob, probs);
+        revert();
+        revertHistory(historySize() - 1);
+    }
+}
+
+// get the n'th history symbol, false if it is no longer stored
+bool ContextModel::nthHistorySymbol(size_t n, symbol_t &sym) const {
+    size_t age = m_history.size() - 1 - n;
+    if (n >= m_history.size() || age >= m_history.stored())
+        return false;
+    sym = m_history.recent(age);
+    return true;
+}
+
+// make room in the history to revert the given number of symbols
+void ContextModel::reserveLookahead(size_t lookahead) {
+    m_lookahead = lookahead;
+    m_history.reserve(contextSpan() + lookahead + 1);
+}
+
+// backends read the context in history order unless they support masks
+bool ContextModel::setContextMask(const std::vector<size_t> & /* ages */) {
+    return false;
+}
+
+// the oldest symbol any depth of the context reads, plus one
+size_t ContextModel::contextSpan(void) const {
+    if (m_context_ages.empty())
+        return m_depth;
+    return *std::max_element(m_context_ages.begin(), m_context_ages.end()) + 1;
+}
+
+// write backend specific statistics to a log
+void ContextModel::logStats(std::ostream & /* out */) const {
+}
+
+// backends are not saved unless they say otherwise
+bool ContextModel::save(std::ostream & /* out */) const {
+    return false;
+}
+
+bool ContextModel::load(const char *& /* data */,
+        const char * /* end */) {
+    return false;
+}
+
+// backends keep no journal unless they say otherwise
+bool ContextModel::setJournaling(bool /* on */) {
+    return false;
+}
+
+size_t ContextModel::journalMark(void) const {
+    return 0;
+}
+
+void ContextModel::rollback(size_t /* mark */) {
+}
+
+// models without a memory bound never evict
+unsigned long long ContextModel::evictions(void) const {
+    return 0;
+}
+
+unsigned long long ContextModel::reclaimedBytes(void) const {
+    return 0;
+}
+
+// the node count and the history, for backends that track nothing else
+void ContextModel::stats(model_stats_t &stats) const {
+    stats.nodes = size();
+    stats.depth_nodes.clear();
+    stats.bytes = m_history.bytes();
+    stats.created = 0;
+    stats.destroyed = 0;
+    stats.max_history = m_max_history;
 }
 
 // create a context tree of specified maximum depth
-ContextTree::ContextTree(size_t depth) :
-        m_root(new CTNode()), m_depth(depth) {
-    return;
+ContextTree::ContextTree(size_t depth, size_t lookahead) :
+        ContextModel(depth, lookahead), m_hot_depth(0), m_max_nodes(0), m_lazy_depth(
+                0), m_lazy_visits(0), m_evicted_nodes(0), m_depth_nodes(
+                depth + 1, 0), m_created_nodes(0), m_released_nodes(0), m_journaling(
+                false) {
+    m_nodes.push_back(CTNode());
+    m_depth_nodes[0] = 1;
 }
 
 ContextTree::~ContextTree(void) {
-    if (m_root)
-        delete m_root;
 }
 
-// reset the history to the last ct-depth size of history
-void ContextTree::resetHistory(void) {
-    m_history.erase(m_history.begin(),
-            m_history.begin() + (m_history.size() - m_depth));
+// Read the context through a mask of history ages. The tree must still be
+// empty, since its nodes stand for the contexts the old mask read; its
+// depth becomes the size of the mask.
+bool ContextTree::setContextMask(const std::vector<size_t> &ages) {
+    if (ages.empty() || size() > 1 || m_nodes[0].visits() > 0)
+        return false;
+    m_context_ages = ages;
+    m_depth = ages.size();
+    m_depth_nodes.assign(m_depth + 1, 0);
+    m_depth_nodes[0] = 1;
+    m_history.reserve(contextSpan() + m_lookahead + 1);
+    return true;
+}
+
+// take a fresh node at the given depth from the arena, reusing released
+// slots first
+node_index_t ContextTree::newNode(size_t depth) {
+    m_depth_nodes[depth]++;
+    m_created_nodes++;
+    if (depth < m_hot_depth && !m_hot_free.empty()) {
+        node_index_t index = m_hot_free.back();
+        m_hot_free.pop_back();
+        m_nodes[index] = CTNode();
+        return index;
+    }
+    if (!m_free.empty()) {
+        node_index_t index = m_free.back();
+        m_free.pop_back();
+        m_nodes[index] = CTNode();
+        return index;
+    }
+    m_nodes.push_back(CTNode());
+    return node_index_t(m_nodes.size() - 1);
+}
+
+// return a node at the given depth to the arena's free list
+void ContextTree::freeNode(node_index_t index, size_t depth) {
+    assert(index != NoChild && m_depth_nodes[depth] > 0);
+    m_depth_nodes[depth]--;
+    m_released_nodes++;
+    if (index < (node_index_t(1) << m_hot_depth))
+        m_hot_free.push_back(index);
+    else
+        m_free.push_back(index);
+}
+
+// Set the slots of the first levels aside: the levels above the hot depth
+// hold fewer than 2^depth nodes, the root included. The slots are handed
+// out lowest first, so the levels are laid out roughly breadth first.
+void ContextTree::reserveHotSlots(void) {
+    node_index_t slots = node_index_t(1) << m_hot_depth;
+    m_nodes.reserve(slots);
+    m_hot_free.clear();
+    for (node_index_t index = slots; index-- > 1;) {
+        m_nodes.push_back(CTNode());
+        m_hot_free.push_back(index);
+    }
+    m_nodes.adviseHot(slots);
+}
+
+// levels of a file-backed tree given the slots at the front of its arena
+static const size_t ArenaHotDepth = 16;
+
+// Move the arena to a mapped file, while the tree only has its root
+bool ContextTree::setArenaFile(const std::string &dir) {
+    if (size() > 1 || m_nodes[0].visits() > 0)
+        return false;
+    if (!m_nodes.mapFile(dir))
+        return false;
+    m_hot_depth = std::min(m_depth, ArenaHotDepth);
+    reserveHotSlots();
+    return true;
+}
+
+// Sum of the log weighted probabilities of a node's children. A node
+// extended lazily has counted symbols before its children existed; their
+// KT estimate stands in for the children's prediction of them, so that the
+// children's share of the mixture stays a distribution over the sequence.
+weight_t ContextTree::logProbChildren(const CTNode &node) const {
+    return node.logProbChildren([this](node_index_t index) -> const CTNode & {
+        return m_nodes[index];
+    });
 }
 
 // clear the entire context tree
 void ContextTree::clear(void) {
     m_history.clear();
-    if (m_root)
-        delete m_root;
-    m_root = new CTNode();
+    // Resetting the arena releases every node at once
+    m_nodes.clear();
+    m_free.clear();
+    m_nodes.push_back(CTNode());
+    if (m_hot_depth > 0)
+        reserveHotSlots();
+    m_journal.clear();
+    m_journal_marks.clear();
+    m_released_nodes = m_created_nodes;
+    m_depth_nodes.assign(m_depth + 1, 0);
+    m_depth_nodes[0] = 1;
 }
 
 void ContextTree::print(void) {
     std::cout << "Printing tree..." << std::endl;
-    m_root->print();
+    m_nodes[0].print();
 }
 
 // updates the context tree with a new binary symbol
 void ContextTree::update(const symbol_t sym) {
-    std::vector<CTNode*> context_path;
-    CTNode* current = m_root;
+    updateSymbol<0>(sym);
+}
+
+// a walk's buffer of one entry per depth: the array on the stack when the
+// depth is fixed at compile time, otherwise the tree's heap buffer
+template<size_t Depth, typename T>
+static T *walkBuffer(T *fixed, std::vector<T> &buffer, size_t depth) {
+    if (Depth > 0)
+        return fixed;
+    buffer.resize(depth + 1);
+    return &buffer[0];
+}
+
+// update with a new binary symbol, for a maximum depth known at compile
+// time or 0 for the tree's own
+template<size_t Depth>
+void ContextTree::updateSymbol(const symbol_t sym) {
+    node_index_t fixed_path[Depth + 1];
+    node_index_t *context_path = walkBuffer<Depth>(fixed_path, m_path,
+            m_depth);
+    node_index_t current = 0;
+
+    if (m_journaling)
+        m_journal_marks.push_back(m_journal.size());
 
     // Create a list of the path tranversed
     // bitfix=0, as the last history symbol is also used
-    walkAndGeneratePath(0, context_path, &current);
-
-    while (context_path.empty() != true) {
-        // Update the nodes along the context path bottom up
-        current->update(sym);
+    size_t length = walkAndGeneratePath<Depth>(0, context_path, current);
+
+    while (length > 0) {
+        // Update the nodes along the context path bottom up; the nodes the
+        // walk created need no journal entry of their own
+        CTNode &node = m_nodes[current];
+        if (node.visits() > 0)
+            journal(current);
+        node.update(sym);
+        node.updateLogProbability(node.isLeaf(), logProbChildren(node));
         // Move one level up, along the context path
-        current = context_path.back();
-        context_path.pop_back();
+        current = context_path[--length];
     }
     // Update the root node
-    current->update(sym);
+    journal(current);
+    CTNode &root = m_nodes[current];
+    root.update(sym);
+    root.updateLogProbability(root.isLeaf(), logProbChildren(root));
     updateHistory(sym);
-}
-
-// update the context tree with a list of symbols
-void ContextTree::update(const symbol_list_t &symbol_list) {
-    for (size_t i = 0; i < symbol_list.size(); i++) {
-        // Update one symbol at a time in the block of symbols
-        update(symbol_list[i]);
-    }
-}
 
-// updates the history statistics, without touching the context tree
-void ContextTree::updateHistory(const symbol_list_t &symbol_list) {
-    for (size_t i = 0; i < symbol_list.size(); i++) {
-        m_history.push_back(symbol_list[i]);
-    }
-}
-
-void ContextTree::updateHistory(const symbol_t sym) {
-    m_history.push_back(sym);
+    // Only observed symbols prune; sampled ones are always reverted, and
+    // pruning under them would make the revert inexact
+    if (m_max_nodes > 0 && size() > m_max_nodes && !m_journaling)
+        prune();
+#ifdef CT_COMPACT_NODES
+    if (!m_journaling && std::max(m_nodes[0].m_count[0], m_nodes[0].m_count[1])
+            >= NodeCountRescale)
+        rescale();
+#endif
 }
 
 // Create a path list from root node to one level above the leaf node
 // along the context, used for updating and reverting the Context tree
-// from bottom up
-void ContextTree::walkAndGeneratePath(int bit_fix,
-        std::vector<CTNode*> &context_path, CTNode **current) {
+// from bottom up; returns its length
+template<size_t Depth>
+size_t ContextTree::walkAndGeneratePath(int bit_fix,
+        node_index_t *context_path, node_index_t &current) {
+    const int depth = int(Depth > 0 ? Depth : m_depth);
     int traverse_depth = 0;
     int cur_history_sym;
+    uint64_t context = 0;
 
     // Store the path of current context in the traverse list
-    while (traverse_depth < m_depth) {
-        cur_history_sym = m_history.at(
-                bit_fix + (m_history.size() - 1) - traverse_depth);
+    while (traverse_depth < depth) {
+        // A pruned context, or one not yet visited often enough to be
+        // extended, acts as a leaf. A revert walks for a symbol its nodes
+        // have already counted.
+        const CTNode &node = m_nodes[current];
+        if (isLeafContext(node, traverse_depth,
+                node.visits() - (bit_fix < 0 ? 1 : 0)))
+            break;
+
+        // Read the context 64 symbols at a time, or symbol by symbol
+        // through the mask
+        if (!m_context_ages.empty()) {
+            cur_history_sym = m_history.recent(
+                    m_context_ages[traverse_depth] - bit_fix);
+        } else {
+            if ((traverse_depth & 63) == 0)
+                context = m_history.context(traverse_depth - bit_fix);
+            cur_history_sym = context & 1;
+            context >>= 1;
+        }
 
-        // Add a new context node, if it is a new context
-        if ((*current)->m_child[cur_history_sym] == NULL) {
-            CTNode* node = new CTNode();
-            (*current)->m_child[cur_history_sym] = node;
+        // Add a new context node, if it is a new context. The arena may
+        // grow here, so only indices are held across the allocation.
+        if (m_nodes[current].m_child[cur_history_sym] == NoChild) {
+            node_index_t node = newNode(traverse_depth + 1);
+            m_nodes[current].m_child[cur_history_sym] = node;
+            if (m_journaling) {
+                journal_entry_t entry = { node, current,
+                        uint32_t(traverse_depth + 1), true, CTNode() };
+                m_journal.push_back(entry);
+            }
 
         }
         // Store the current node on the context path,
         // used when updating and reverting the Context tree bottom up
-        context_path.push_back((*current));
+        context_path[traverse_depth] = current;
 
-        (*current) = (*current)->m_child[cur_history_sym];
+        current = m_nodes[current].m_child[cur_history_sym];
         traverse_depth++;
     }
+    return traverse_depth;
+}
+
+// The nodes a thread of a bulk update has created, each with its depth,
+// and the nodes of the shared arena it has linked them to
+struct ContextTree::bulk_arena_t {
+    std::vector<CTNode> nodes;
+    std::vector<uint32_t> depths;
+    std::vector<node_index_t> linked;
+    std::vector<node_index_t> path; // scratch buffer of the current walk
+
+    // a node of the shared arena, or one of this thread's
+    CTNode &node(NodeArena<CTNode> &shared, node_index_t index) {
+        return (index & LocalNode) ? nodes[index & ~LocalNode] : shared[index];
+    }
+
+    // as ContextTree::logProbChildren, finding the children here too
+    weight_t logProbChildren(NodeArena<CTNode> &shared,
+            const CTNode &parent) {
+        return parent.logProbChildren(
+                [&](node_index_t index) -> const CTNode & {
+                    return node(shared, index);
+                });
+    }
+};
+
+// Update the tree with a sequence of symbols in bulk. The first levels of
+// the contexts are walked for every symbol in turn, which also sorts the
+// symbols by the subtree they reach below those levels. Each subtree is
+// then updated with its own symbols in order, so that every node counts
+// the same symbols in the same order as when the tree is updated symbol by
+// symbol. The weighted probabilities of the first levels only depend on
+// their final counts and children, and are worked out last.
+void ContextTree::bulkUpdate(const symbol_list_t &symbols, size_t threads) {
+    bulkUpdate(symbols, std::vector<bool>(symbols.size(), true), threads);
+}
+
+void ContextTree::bulkUpdate(const symbol_list_t &symbols,
+        const std::vector<bool> &learn, size_t threads) {
+    assert(learn.size() == symbols.size());
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // the context of the first symbol must be in the history already
+    size_t span = contextSpan(), n = symbols.size();
+    assert(historySize() >= span);
+
+    bool ordered = m_journaling || m_max_nodes > 0;
+#ifdef CT_COMPACT_NODES
+    ordered = ordered || std::max(m_nodes[0].m_count[0],
+            m_nodes[0].m_count[1]) + n >= NodeCountRescale;
+#endif
+    if (ordered) {
+        for (size_t i = 0; i < n; i++) {
+            if (learn[i])
+                update(symbols[i]);
+            else
+                updateHistory(symbols[i]);
+        }
+        return;
+    }
+
+    // Split the tree far enough down for the threads to share many
+    // subtrees, so that the largest ones do not hold up the rest; smaller
+    // subtrees also keep each thread's working set small
+    size_t split = 0;
+    while ((size_t(1) << split) < 64 * threads && split < 16
+            && split + 1 < m_depth)
+        split++;
+
+    // the sequence, after the context of its first symbol
+    std::vector<unsigned char> seq(span + n);
+    for (size_t age = 0; age < span; age++)
+        seq[span - 1 - age] = m_history.recent(age);
+    for (size_t i = 0; i < n; i++)
+        seq[span + i] = symbols[i];
+
+    // Update the first levels in order, keeping the first symbols of the
+    // context of each symbol that reaches a subtree below them
+    const size_t Unsplit = ~size_t(0);
+    std::vector<size_t> keys(n, Unsplit);
+    std::vector<node_index_t> roots(size_t(1) << split, NoChild);
+    for (size_t i = 0; i < n; i++) {
+        if (!learn[i])
+            continue;
+        size_t pos = span + i, key = 0, depth = 0;
+        node_index_t current = 0;
+        for (; depth < split; depth++) {
+            const CTNode &node = m_nodes[current];
+            if (isLeafContext(node, depth, node.visits()))
+                break;
+            symbol_t sym = seq[pos - 1 - contextAge(depth)];
+            if (node.m_child[sym] == NoChild) {
+                node_index_t child = newNode(depth + 1);
+                m_nodes[current].m_child[sym] = child;
+            }
+            m_nodes[current].update(seq[pos]);
+            current = m_nodes[current].m_child[sym];
+            key |= size_t(sym) << depth;
+        }
+        if (depth < split) {
+            m_nodes[current].update(seq[pos]);
+        } else {
+            keys[i] = key;
+            roots[key] = current;
+        }
+    }
+
+    // Sort the positions by subtree, in order within each
+    std::vector<size_t> starts(roots.size() + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (keys[i] != Unsplit)
+            starts[keys[i] + 1]++;
+    }
+    std::vector<std::pair<size_t, size_t> > order; // largest subtrees first
+    for (size_t key = 0; key < roots.size(); key++) {
+        if (starts[key + 1] > 0)
+            order.push_back(std::make_pair(starts[key + 1], key));
+        starts[key + 1] += starts[key];
+    }
+    std::sort(order.rbegin(), order.rend());
+    std::vector<size_t> positions(starts.back());
+    std::vector<size_t> fill(starts);
+    for (size_t i = 0; i < n; i++) {
+        if (keys[i] != Unsplit)
+            positions[fill[keys[i]]++] = span + i;
+    }
+
+    // Update the subtrees, each thread taking the largest left next
+    threads = std::min(threads, order.size());
+    std::vector<bulk_arena_t> arenas(threads);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&, t]() {
+            for (size_t b = next++; b < order.size(); b = next++) {
+                size_t key = order[b].second;
+                bulkUpdateSubtree(roots[key], split, &seq[0],
+                        &positions[starts[key]], order[b].first, arenas[t]);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads; t++)
+        workers[t].join();
+
+    // Append the nodes the threads created to the arena, renumbering the
+    // links to them; released slots are left for later updates
+    size_t created = 0;
+    for (size_t t = 0; t < threads; t++)
+        created += arenas[t].nodes.size();
+    assert(m_nodes.size() + created <= LocalNode);
+    m_nodes.reserve(m_nodes.size() + created);
+    for (size_t t = 0; t < threads; t++) {
+        bulk_arena_t &arena = arenas[t];
+        node_index_t base = node_index_t(m_nodes.size());
+        for (size_t j = 0; j < arena.nodes.size(); j++) {
+            CTNode &node = arena.nodes[j];
+            for (int s = 0; s < 2; s++) {
+                if (node.m_child[s] & LocalNode)
+                    node.m_child[s] = base + (node.m_child[s] & ~LocalNode);
+            }
+            m_depth_nodes[arena.depths[j]]++;
+        }
+        for (size_t j = 0; j < arena.linked.size(); j++) {
+            CTNode &node = m_nodes[arena.linked[j]];
+            for (int s = 0; s < 2; s++) {
+                if (node.m_child[s] & LocalNode)
+                    node.m_child[s] = base + (node.m_child[s] & ~LocalNode);
+            }
+        }
+        if (!arena.nodes.empty())
+            m_nodes.append(&arena.nodes[0], arena.nodes.size());
+        m_created_nodes += arena.nodes.size();
+        arena = bulk_arena_t();
+    }
+
+    // Work out the weighted probabilities of the first levels bottom up,
+    // children first
+    std::vector<std::pair<node_index_t, size_t> > top;
+    top.push_back(std::make_pair(node_index_t(0), size_t(0)));
+    for (size_t i = 0; i < top.size(); i++) {
+        const CTNode &node = m_nodes[top[i].first];
+        for (int s = 0; s < 2 && top[i].second + 1 < split; s++) {
+            if (node.m_child[s] != NoChild)
+                top.push_back(std::make_pair(node.m_child[s],
+                        top[i].second + 1));
+        }
+    }
+    for (size_t i = top.size(); i-- > 0;) {
+        CTNode &node = m_nodes[top[i].first];
+        if (node.visits() > 0)
+            node.updateLogProbability(node.isLeaf(), logProbChildren(node));
+    }
+
+    updateHistory(symbols);
+}
+
+// Update the subtree at a node of the given depth with the symbols at the
+// given positions of the sequence, in order, as ContextTree::update would.
+// Nodes of the shared arena are changed in place, as no other thread
+// reaches them; new nodes go in the thread's own arena.
+void ContextTree::bulkUpdateSubtree(node_index_t root, size_t depth,
+        const unsigned char *seq, const size_t *positions, size_t n,
+        bulk_arena_t &arena) {
+    std::vector<node_index_t> &path = arena.path;
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = positions[i];
+        node_index_t current = root;
+
+        // walk the context down from the subtree's root, creating missing
+        // nodes; the thread's arena may grow, so only indices are held
+        path.clear();
+        for (size_t d = depth; d < m_depth; d++) {
+            const CTNode &node = arena.node(m_nodes, current);
+            if (isLeafContext(node, d, node.visits()))
+                break;
+            symbol_t sym = seq[pos - 1 - contextAge(d)];
+            if (node.m_child[sym] == NoChild) {
+                node_index_t child = LocalNode
+                        | node_index_t(arena.nodes.size());
+                if (!(current & LocalNode))
+                    arena.linked.push_back(current);
+                arena.nodes.push_back(CTNode());
+                arena.depths.push_back(uint32_t(d + 1));
+                arena.node(m_nodes, current).m_child[sym] = child;
+            }
+            path.push_back(current);
+            current = arena.node(m_nodes, current).m_child[sym];
+        }
+
+        // update the nodes along the context bottom up
+        for (;;) {
+            CTNode &node = arena.node(m_nodes, current);
+            node.update(seq[pos]);
+            node.updateLogProbability(node.isLeaf(),
+                    arena.logProbChildren(m_nodes, node));
+            if (path.empty())
+                break;
+            current = path.back();
+            path.pop_back();
+        }
+    }
 }
 
 // Revert the CT to its state prior to the most recently observed symbol
 void ContextTree::revert(void) {
-    std::vector<CTNode*> context_path;
-    CTNode* current = m_root;
-    int cur_depth = m_depth;
+    revertSymbol<0>();
+}
+
+// remove the most recent symbol, for a maximum depth known at compile
+// time or 0 for the tree's own
+template<size_t Depth>
+void ContextTree::revertSymbol(void) {
+    node_index_t fixed_path[Depth + 1];
+    node_index_t *context_path = walkBuffer<Depth>(fixed_path, m_path,
+            m_depth);
+    node_index_t current = 0;
+    symbol_t sym = m_history.recent(0);
+
+    // A journaled update is undone by copying back what it changed
+    if (m_journaling && !m_journal_marks.empty()) {
+        rollbackUpdate();
+        return;
+    }
 
     // Create a list of the path tranversed
     // bitfix=-1, as the last history symbol is not
-    walkAndGeneratePath(-1, context_path, &current);
+    size_t length = walkAndGeneratePath<Depth>(-1, context_path, current);
+    int cur_depth = length;
 
-    while (context_path.empty() != true) {
+    while (length > 0) {
         // Update the nodes along the context path bottom up
-        current->revert(m_history.at(m_history.size() - 1));
-
-        if (current->m_count[0] == 0 && current->m_count[1] == 0) {
-            // Delete the context node when there is no context
-            delete current;
-            // Reset the parent's child node pointer for the symbol
-            current = context_path.back();
-            context_path.pop_back();
-            current->m_child[m_history.at(m_history.size() - cur_depth - 1)] =
-                    NULL;
+        CTNode &node = m_nodes[current];
+        node.revert(sym);
+
+        if (node.m_count[0] == 0 && node.m_count[1] == 0) {
+            // Release the context node when there is no context
+            freeNode(current, cur_depth);
+            // Reset the parent's child node index for the symbol
+            current = context_path[--length];
+            m_nodes[current].m_child[m_history.recent(
+                    contextAge(cur_depth - 1) + 1)] = NoChild;
         } else {
+            node.updateLogProbability(node.isLeaf(), logProbChildren(node));
             // Update the nodes one level up
-            current = context_path.back();
-            context_path.pop_back();
+            current = context_path[--length];
         }
         cur_depth--;
     }
     // Revert the root node
-    current->revert(m_history.at(m_history.size() - 1));
+    CTNode &root = m_nodes[current];
+    root.revert(sym);
+    if (root.visits() > 0)
+        root.updateLogProbability(root.isLeaf(), logProbChildren(root));
 }
 
-// shrinks the history down to a former size
-void ContextTree::revertHistory(size_t newsize) {
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h), for the depth the tree was created with
+double ContextTree::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    return logProbNextSymbol<0>(sym);
+}
 
-    assert(newsize <= m_history.size());
-    while (m_history.size() > newsize)
-        m_history.pop_back();
+// the walks for the depths newContextTree() specialises
+template void ContextTree::updateSymbol<96>(const symbol_t sym);
+template void ContextTree::updateSymbol<110>(const symbol_t sym);
+template void ContextTree::updateSymbol<192>(const symbol_t sym);
+template void ContextTree::updateSymbol<256>(const symbol_t sym);
+template void ContextTree::revertSymbol<96>(void);
+template void ContextTree::revertSymbol<110>(void);
+template void ContextTree::revertSymbol<192>(void);
+template void ContextTree::revertSymbol<256>(void);
+template symbol_t ContextTree::genSymbolAndUpdate<96>(void);
+template symbol_t ContextTree::genSymbolAndUpdate<110>(void);
+template symbol_t ContextTree::genSymbolAndUpdate<192>(void);
+template symbol_t ContextTree::genSymbolAndUpdate<256>(void);
+
+// create an exact context tree, specialised for the depth and percept
+// widths of the shipped configurations: cheese maze, coin flip, pacman,
+// rock paper scissors, tic-tac-toe and extended tiger
+ContextTree *newContextTree(size_t depth, size_t lookahead, size_t obs_bits,
+        size_t rew_bits) {
+    if (depth == 96 && obs_bits == 4 && rew_bits == 5)
+        return new ContextTreeT<96, 4, 5>(lookahead);
+    if (depth == 110 && obs_bits == 1 && rew_bits == 1)
+        return new ContextTreeT<110, 1, 1>(lookahead);
+    if (depth == 256 && obs_bits == 16 && rew_bits == 8)
+        return new ContextTreeT<256, 16, 8>(lookahead);
+    if (depth == 96 && obs_bits == 2 && rew_bits == 2)
+        return new ContextTreeT<96, 2, 2>(lookahead);
+    if (depth == 192 && obs_bits == 18 && rew_bits == 3)
+        return new ContextTreeT<192, 18, 3>(lookahead);
+    if (depth == 96 && obs_bits == 2 && rew_bits == 8)
+        return new ContextTreeT<96, 2, 8>(lookahead);
+
+    switch (depth) {
+    case 96:
+        return new ContextTreeT<96>(lookahead);
+    case 110:
+        return new ContextTreeT<110>(lookahead);
+    case 192:
+        return new ContextTreeT<192>(lookahead);
+    case 256:
+        return new ContextTreeT<256>(lookahead);
+    default:
+        return new ContextTree(depth, lookahead);
+    }
 }
 
-// Calculate the probability of the next symbol given the next history P(x[i]=sym|h)
-double ContextTree::getLogProbNextSymbolGivenH(symbol_t sym) {
-    double prob_log_next_bit, new_log_block_prob, last_log_block_prob;
+// The probability of a block of symbols, from copies of the nodes it would
+// change. Each thread has its own cursor, so concurrent readers do not
+// interfere as long as the tree is not updated meanwhile.
+double ContextTree::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    static thread_local ContextTreeCursor cursor;
+    return cursor.logProbBlock(*this, block, n, first);
+}
 
-    last_log_block_prob = logBlockProbability();
-    // To calculate the root probability as if the next symbol was 0
-    update(sym);
-    new_log_block_prob = logBlockProbability();
+// Generate a random symbol distributed according to the context tree
+// statistics and update the context tree with it. The context is walked
+// once; P(0|h) is computed bottom up on copies of the path nodes, which are
+// committed as they are if 0 is drawn and updated in place otherwise.
+symbol_t ContextTree::genRandomSymbolAndUpdate(void) {
+    return genSymbolAndUpdate<0>();
+}
 
-    prob_log_next_bit = new_log_block_prob - last_log_block_prob;
-    // Remove the recently added 0, which was used for calculating the root prob
-    revert();
-    revertHistory(m_history.size() - 1);
+// sample and update in one walk, for a maximum depth known at compile time
+// or 0 for the tree's own
+template<size_t Depth>
+symbol_t ContextTree::genSymbolAndUpdate(void) {
+    node_index_t fixed_path[Depth + 1];
+    weight_t fixed_update[Depth + 1];
+    node_index_t *path = walkBuffer<Depth>(fixed_path, m_path, m_depth);
+    weight_t *path_update = walkBuffer<Depth>(fixed_update, m_path_update,
+            m_depth);
+    node_index_t current = 0;
 
-    return prob_log_next_bit;
+    if (m_journaling)
+        m_journal_marks.push_back(m_journal.size());
+
+    // bitfix=0, as the last history symbol is also used
+    size_t length = walkAndGeneratePath<Depth>(0, path, current);
+    path[length++] = current;
+
+    // Nodes from this depth down have never been visited. After one update
+    // any such chain has KT and weighted probabilities of exactly 1/2, so
+    // only the nodes above it need the full computation.
+    size_t fresh_depth = 0;
+    while (fresh_depth < length
+            && m_nodes[path[fresh_depth]].visits() > 0)
+        fresh_depth++;
+
+    // Work out the probability of 0 along the visited nodes, keeping the
+    // weighted probabilities it would give them
+    weight_t log_prob_0 = CTNode::logProbPath(
+            [this](node_index_t index) -> const CTNode & {
+                return m_nodes[index];
+            },
+            path, fresh_depth, fresh_depth == length, false,
+            [this](size_t d) { return m_history.recent(contextAge(d)); },
+            path_update);
+
+    // Sample the next bit
+    symbol_t sym = (rand01() > exp2(log_prob_0));
+
+    // Commit the update along the same context path. Below the fresh depth
+    // every node was created by the walk, except an unvisited root.
+    for (size_t d = 0; d < fresh_depth; d++)
+        journal(path[d]);
+    if (fresh_depth == 0)
+        journal(0);
+    for (size_t d = fresh_depth; d < length; d++) {
+        CTNode &node = m_nodes[path[d]];
+        node.updateFresh(sym);
+    }
+    if (sym == false) {
+        // the weighted probabilities are already worked out
+        for (size_t d = 0; d < fresh_depth; d++) {
+            CTNode &node = m_nodes[path[d]];
+            node.update(false);
+            node.m_log_prob_weighted = path_update[d];
+        }
+    } else {
+        for (size_t d = fresh_depth; d-- > 0;) {
+            CTNode &node = m_nodes[path[d]];
+            node.update(sym);
+            node.updateLogProbability(node.isLeaf(), logProbChildren(node));
+        }
+    }
+
+    updateHistory(sym);
+    return sym;
 }
 
-// Calculate the probability of the next symbol given the next history
-// P(x[i]=sym|h) and update
-double ContextTree::getLogProbNextSymbolGivenHWithUpdate(symbol_t sym) {
-    double prob_log_next_bit, new_log_block_prob, last_log_block_prob;
+// Start or stop journaling. Updates journaled from now on are reverted by
+// copying back the nodes they changed; stopping drops the journal, after
+// which the updates stay as they are.
+bool ContextTree::setJournaling(bool on) {
+    m_journaling = on;
+    if (!on) {
+        m_journal.clear();
+        m_journal_marks.clear();
+    }
+    return true;
+}
 
-    last_log_block_prob = logBlockProbability();
-    // To calculate the root probability as if the next symbol was 0
-    update(sym);
-    new_log_block_prob = logBlockProbability();
-    prob_log_next_bit = new_log_block_prob - last_log_block_prob;
-    // Remove the recently added 0, which was used for calculating the root prob
+// The block distribution, with the prefix updates journaled so that the
+// tree is left exactly as it was
+void ContextTree::blockDistribution(size_t bits, std::vector<double> &probs) {
+    bool journaling = m_journaling;
+    m_journaling = true;
+    ContextModel::blockDistribution(bits, probs);
+    if (!journaling)
+        setJournaling(false);
+}
 
-    return prob_log_next_bit;
+// undo the journaled updates made after the given mark
+void ContextTree::rollback(size_t mark) {
+    while (m_journal_marks.size() > mark)
+        rollbackUpdate();
 }
 
-// generate a specified number of random symbols
-// distributed according to the context tree statistics
-// Note: It does not revert the history
-void ContextTree::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+// Undo the most recent journaled update, latest change first: changed
+// nodes get their prior state back and created ones are released
+void ContextTree::rollbackUpdate(void) {
+    size_t first = m_journal_marks.back();
+    m_journal_marks.pop_back();
+
+    for (size_t i = m_journal.size(); i-- > first;) {
+        const journal_entry_t &entry = m_journal[i];
+        if (entry.created) {
+            CTNode &parent = m_nodes[entry.parent];
+            parent.m_child[parent.m_child[1] == entry.index] = NoChild;
+            freeNode(entry.index, entry.depth);
+        } else {
+            m_nodes[entry.index] = entry.node;
+        }
+    }
+    m_journal.resize(first);
+}
 
-    genRandomSymbolsAndUpdate(symbols, bits);
+// limit the number of nodes, 0 for no limit
+void ContextTree::setMaxNodes(size_t max_nodes) {
+    m_max_nodes = max_nodes;
+}
 
-    // restore the context tree to it's original state
-    for (size_t i = 0; i < bits; i++)
-        revert();
+// Extend the contexts at and below the given depth lazily. Most deep
+// contexts are seen only once or twice, and a leaf standing in for the
+// chain below it predicts exactly as the chain would while all its visits
+// have shared the rest of the context, since a node whose only child has
+// the same counts has the same weighted probability as that child. Once a node is
+// extended its children only count the symbols from then on, and the
+// symbols before are left to its own estimate in the weighted mixture.
+void ContextTree::setLazyExtension(size_t depth, count_t visits) {
+    m_lazy_depth = depth;
+    m_lazy_visits = visits;
 }
 
-// Generate a specified number of random symbols distributed according to
-// the context tree statistics and update the context tree with the newly
-// generated bits
-void ContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols,
-        size_t bits) {
-    double prob_next_bit;
-    symbol_t sym;
+// Prune the least visited subtrees until the tree is back under its low
+// water mark. The node at the top of a pruned subtree stays as a leaf: its
+// KT estimate already counts every symbol its descendants saw, so it takes
+// over their prediction, and it is not extended again (regrown children
+// would not account for those symbols) unless it lies below the lazy
+// extension depth.
+void ContextTree::prune(void) {
+    size_t target = m_max_nodes - m_max_nodes / 4;
+
+    // Collect the nodes in pre-order, with their depths
+    std::vector<std::pair<node_index_t, size_t> > order;
+    order.reserve(size());
+    order.push_back(std::make_pair(node_index_t(0), size_t(0)));
+    for (size_t i = 0; i < order.size(); i++) {
+        const CTNode &node = m_nodes[order[i].first];
+        for (int s = 0; s < 2; s++) {
+            if (node.m_child[s] != NoChild)
+                order.push_back(std::make_pair(node.m_child[s],
+                        order[i].second + 1));
+        }
+    }
 
-    for (int i = 0; i < bits; i++) {
-        // Calculate the probability of the next symbol to be 0, given history
-        prob_next_bit = pow(2, getLogProbNextSymbolGivenH(0));
+    // Candidates are the internal nodes below the root, least visited
+    // first and deepest first among equals, so that a node always comes
+    // before its ancestors
+    std::vector<std::pair<std::pair<count_t, size_t>, node_index_t> > candidates;
+    for (size_t i = 1; i < order.size(); i++) {
+        const CTNode &node = m_nodes[order[i].first];
+        if (!node.isLeaf())
+            candidates.push_back(std::make_pair(
+                    std::make_pair(node.visits(), m_depth - order[i].second),
+                    order[i].first));
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    std::vector<std::pair<node_index_t, size_t> > stack;
+    for (size_t i = 0; i < candidates.size() && size() > target; i++) {
+        CTNode &node = m_nodes[candidates[i].second];
+        size_t depth = m_depth - candidates[i].first.second;
+
+        // Release every descendant
+        for (int s = 0; s < 2; s++) {
+            if (node.m_child[s] != NoChild)
+                stack.push_back(std::make_pair(node.m_child[s], depth + 1));
+            node.m_child[s] = NoChild;
+        }
+        while (!stack.empty()) {
+            node_index_t index = stack.back().first;
+            depth = stack.back().second;
+            stack.pop_back();
+            for (int s = 0; s < 2; s++) {
+                if (m_nodes[index].m_child[s] != NoChild)
+                    stack.push_back(std::make_pair(m_nodes[index].m_child[s],
+                            depth + 1));
+            }
+            freeNode(index, depth);
+            m_evicted_nodes++;
+        }
+    }
 
-        // Sample the next bit
-        sym = (rand01() > prob_next_bit);
-        update(sym);
-        symbols[i] = sym;
+    // Recompute the weighted probabilities bottom up, children first
+    for (size_t i = order.size(); i-- > 0;) {
+        CTNode &node = m_nodes[order[i].first];
+        if (node.visits() > 0)
+            node.updateLogProbability(node.isLeaf(), logProbChildren(node));
     }
 }
 
-// the logarithm of the block probability of the whole sequence
-double ContextTree::logBlockProbability(void) {
-    return m_root->logProbWeighted();
+#ifdef CT_COMPACT_NODES
+// Halve the counts of every node, rounding up so that no visited node is
+// left without counts, and recompute the weighted probabilities bottom up.
+// No count of a child exceeds its parent's, so the root's are the first to
+// need it. A node counted at most once per symbol is left as it is, and so
+// is its subtree.
+void ContextTree::rescale(void) {
+    std::vector<node_index_t> order;
+    order.push_back(0);
+    for (size_t i = 0; i < order.size(); i++) {
+        CTNode &node = m_nodes[order[i]];
+        node.m_count[0] = (node.m_count[0] + 1u) / 2;
+        node.m_count[1] = (node.m_count[1] + 1u) / 2;
+        for (int s = 0; s < 2; s++) {
+            node_index_t child = node.m_child[s];
+            if (child != NoChild && (m_nodes[child].m_count[0] > 1
+                    || m_nodes[child].m_count[1] > 1))
+                order.push_back(child);
+        }
+    }
+
+    for (size_t i = order.size(); i-- > 0;) {
+        CTNode &node = m_nodes[order[i]];
+        node.updateLogProbability(node.isLeaf(), logProbChildren(node));
+    }
+}
+#endif
+
+// number of nodes released by pruning
+unsigned long long ContextTree::evictions(void) const {
+    return m_evicted_nodes;
+}
+
+// bytes of node storage released by pruning, available for reuse
+unsigned long long ContextTree::reclaimedBytes(void) const {
+    return m_evicted_nodes * sizeof(CTNode);
+}
+
+// Nodes by depth, node churn and memory. The memory is that of the arena,
+// the free list, the journal and the history as allocated, so it does not
+// shrink when nodes are released.
+void ContextTree::stats(model_stats_t &stats) const {
+    stats.nodes = size();
+    stats.depth_nodes = m_depth_nodes;
+    stats.bytes = m_nodes.capacity() * sizeof(CTNode)
+            + (m_free.capacity() + m_hot_free.capacity()) * sizeof(node_index_t)
+            + m_journal.capacity() * sizeof(journal_entry_t)
+            + m_journal_marks.capacity() * sizeof(size_t)
+            + m_history.bytes();
+    stats.created = m_created_nodes;
+    stats.destroyed = m_released_nodes;
+    stats.max_history = m_max_history;
 }
 
-// get the n'th most recent history symbol, NULL if doesn't exist
-const symbol_t *ContextTree::nthHistorySymbol(size_t n) const {
-    return n < m_history.size() ? &m_history[n] : NULL;
+// recount the nodes at each depth, walking the tree breadth first
+void ContextTree::countDepthNodes(void) {
+    m_depth_nodes.assign(m_depth + 1, 0);
+    std::vector<node_index_t> level(1, node_index_t(0)), next;
+    for (size_t d = 0; d <= m_depth && !level.empty(); d++) {
+        m_depth_nodes[d] = level.size();
+        next.clear();
+        for (size_t i = 0; i < level.size(); i++) {
+            for (int s = 0; s < 2; s++) {
+                if (m_nodes[level[i]].m_child[s] != NoChild)
+                    next.push_back(m_nodes[level[i]].m_child[s]);
+            }
+        }
+        level.swap(next);
+    }
+}
+
+// node count and pruning totals, when the tree has a node budget
+void ContextTree::logStats(std::ostream &out) const {
+    if (m_max_nodes > 0)
+        out << "context tree: " << size() << " of at most " << m_max_nodes
+                << " nodes, " << m_evicted_nodes << " pruned" << std::endl;
+}
+
+// Write the tree to a binary snapshot: its depth, context mask and node
+// layout, the node arena as it is in memory, the free list and the history
+bool ContextTree::save(std::ostream &out) const {
+    writeWord(out, m_depth);
+    writeWord(out, m_context_ages.size());
+    for (size_t d = 0; d < m_context_ages.size(); d++)
+        writeWord(out, m_context_ages[d]);
+    writeWord(out, m_lazy_depth);
+    writeWord(out, m_lazy_visits);
+    writeWord(out, sizeof(CTNode));
+    writeWord(out, m_nodes.size());
+
+    // the free slots at the front of a file-backed arena are free slots
+    // like any other to the tree the snapshot is loaded into
+    std::vector<node_index_t> free_list(m_free);
+    free_list.insert(free_list.end(), m_hot_free.begin(), m_hot_free.end());
+    writeWord(out, free_list.size());
+    writeWord(out, m_evicted_nodes);
+    writeBlock(out, &m_nodes[0], m_nodes.size() * sizeof(CTNode));
+    if (!free_list.empty())
+        writeBlock(out, &free_list[0], free_list.size() * sizeof(node_index_t));
+    m_history.save(out);
+    return bool(out);
+}
+
+// Restore the tree from a snapshot held in memory. The snapshot must come
+// from a tree of the same depth and context mask built with the same node
+// layout. Its nodes were grown with the lazy extension it records, which
+// replaces the tree's own.
+bool ContextTree::load(const char *&data, const char *end) {
+    uint64_t depth, n_ages, age, lazy_depth, lazy_visits, node_size, n_nodes,
+            n_free, evicted;
+    if (!readWord(data, end, depth) || !readWord(data, end, n_ages)
+            || n_ages != m_context_ages.size())
+        return false;
+    for (size_t d = 0; d < n_ages; d++) {
+        if (!readWord(data, end, age) || age != m_context_ages[d])
+            return false;
+    }
+    if (!readWord(data, end, lazy_depth) || !readWord(data, end, lazy_visits)
+            || lazy_visits != count_t(lazy_visits))
+        return false;
+    if (!readWord(data, end, node_size)
+            || !readWord(data, end, n_nodes) || !readWord(data, end, n_free)
+            || !readWord(data, end, evicted))
+        return false;
+    if (depth != m_depth || node_size != sizeof(CTNode) || n_nodes == 0
+            || n_free >= n_nodes)
+        return false;
+
+    // bound the node count before its size in bytes can wrap
+    if (n_nodes > size_t(end - data) / sizeof(CTNode)
+            || n_nodes > std::numeric_limits<node_index_t>::max())
+        return false;
+
+    const void *nodes, *free_list = NULL;
+    if (!readBlock(data, end, nodes, n_nodes * sizeof(CTNode)))
+        return false;
+    if (n_free > 0
+            && !readBlock(data, end, free_list, n_free * sizeof(node_index_t)))
+        return false;
+
+    // The nodes held so far are released and the loaded ones created
+    m_released_nodes += size() - 1;
+    const CTNode *first = static_cast<const CTNode *>(nodes);
+    m_nodes.assign(first, n_nodes);
+    m_hot_free.clear();
+    const node_index_t *free_first = static_cast<const node_index_t *>(free_list);
+    m_free.assign(free_first, free_first + n_free);
+    m_evicted_nodes = evicted;
+    m_created_nodes += size() - 1;
+
+    // Reject child links that leave the arena
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+        if (m_nodes[i].m_child[0] >= n_nodes
+                || m_nodes[i].m_child[1] >= n_nodes) {
+            clear();
+            return false;
+        }
+    }
+
+    // and free slots that leave it, name the root or are listed twice,
+    // which newNode would hand out over a live node
+    std::vector<bool> listed(n_nodes, false);
+    for (size_t i = 0; i < m_free.size(); i++) {
+        if (m_free[i] == NoChild || m_free[i] >= n_nodes
+                || listed[m_free[i]]) {
+            clear();
+            return false;
+        }
+        listed[m_free[i]] = true;
+    }
+
+    if (!m_history.load(data, end)) {
+        clear();
+        return false;
+    }
+    setLazyExtension(size_t(lazy_depth), count_t(lazy_visits));
+    countDepthNodes();
+    return true;
+}
+
+// the logarithm of the block probability of the whole sequence
+double ContextTree::logBlockProbability(void) const {
+    return m_nodes[0].logProbWeighted();
 }
 
 int count;
@@ -312,14 +1286,14 @@ int count;
 // Debug tree, print history symbols and the context tree in Pre order
 void ContextTree::debugTree() {
 
-    std::cout << "History : " << "C0 = " << m_root->m_count[0] << " C1 = "
-            << m_root->m_count[1] << std::endl;
-    for (int i = 0; i < m_history.size(); i++) {
-        std::cout << m_history.at(i);
+    std::cout << "History : " << "C0 = " << m_nodes[0].m_count[0]
+            << " C1 = " << m_nodes[0].m_count[1] << std::endl;
+    for (size_t age = m_history.stored(); age-- > 0;) {
+        std::cout << m_history.recent(age);
     }
     count = 0;
     std::cout << std::endl;
-    printTree(m_root);
+    printTree(&m_nodes[0]);
     std::cout << std::endl;
 
 }
@@ -328,17 +1302,17 @@ void ContextTree::debugTree() {
 void ContextTree::debugTreeStructure() {
 
     // Print the history
-    std::cout << "History : " << "C0 = " << m_root->m_count[0] << " C1 = "
-            << m_root->m_count[1] << std::endl;
-    for (int i = 0; i < m_history.size(); i++) {
-        std::cout << m_history.at(i);
+    std::cout << "History : " << "C0 = " << m_nodes[0].m_count[0]
+            << " C1 = " << m_nodes[0].m_count[1] << std::endl;
+    for (size_t age = m_history.stored(); age-- > 0;) {
+        std::cout << m_history.recent(age);
     }
     count = 0;
     std::cout << std::endl;
 
     // Print the nodes in separate trees
     std::vector<CTNode*> node_list;
-    node_list.push_back(m_root);
+    node_list.push_back(&m_nodes[0]);
     std::cout << "Weighted..." << std::endl;
     printTreeStructure(node_list, 0, 0);
     std::cout << std::endl;
@@ -377,15 +1351,17 @@ void ContextTree::printTreeStructure(std::vector<CTNode*> node_list,
             if (type == 0) {
                 data[i] = node->m_log_prob_weighted;
             } else if (type == 1) {
-                data[i] = node->m_log_prob_est;
+                data[i] = node->logProbEstimated();
             } else if (type == 2) {
                 data[i] = node->m_count[0];
             } else {
                 data[i] = node->m_count[1];
             }
 
-            next_list[i * 2] = node->m_child[1];
-            next_list[i * 2 + 1] = node->m_child[0];
+            next_list[i * 2] = node->m_child[1] == NoChild ?
+                    NULL : &m_nodes[node->m_child[1]];
+            next_list[i * 2 + 1] = node->m_child[0] == NoChild ?
+                    NULL : &m_nodes[node->m_child[0]];
         } else {
             // The node is does not exist
             data[i] = -1.234;
@@ -424,10 +1400,134 @@ void ContextTree::printTree(CTNode *node) {
     std::cout << "Count " << ++count << " Node Weighted probability "
             << node->m_log_prob_weighted << std::endl;
 
-    if (node->m_child[1] != NULL)
-        printTree(node->m_child[1]);
+    if (node->m_child[1] != NoChild)
+        printTree(&m_nodes[node->m_child[1]]);
 
-    if (node->m_child[0] != NULL)
-        printTree(node->m_child[0]);
+    if (node->m_child[0] != NoChild)
+        printTree(&m_nodes[node->m_child[0]]);
 }
 
+
+// take ownership of both models, which must have the same depth
+ContextModelPair::ContextModelPair(ContextModel *primary, ContextModel *shadow,
+        size_t lookahead) :
+        ContextModel(primary->depth(), lookahead), m_primary(primary), m_shadow(
+                shadow), m_primary_loss(0.0), m_shadow_loss(0.0), m_abs_diff(
+                0.0), m_compared(0) {
+    assert(primary->depth() == shadow->depth());
+}
+
+ContextModelPair::~ContextModelPair(void) {
+    delete m_primary;
+    delete m_shadow;
+}
+
+void ContextModelPair::resetHistory(void) {
+    ContextModel::resetHistory();
+    m_primary->resetHistory();
+    m_shadow->resetHistory();
+}
+
+void ContextModelPair::clear(void) {
+    m_history.clear();
+    m_primary->clear();
+    m_shadow->clear();
+    m_primary_loss = m_shadow_loss = m_abs_diff = 0.0;
+    m_compared = 0;
+}
+
+// update both models, accumulating their loss on the symbol
+void ContextModelPair::update(const symbol_t sym) {
+    double primary_before = m_primary->logBlockProbability();
+    double shadow_before = m_shadow->logBlockProbability();
+
+    m_primary->update(sym);
+    m_shadow->update(sym);
+    compare(m_primary->logBlockProbability() - primary_before,
+            m_shadow->logBlockProbability() - shadow_before);
+    ContextModel::updateHistory(sym);
+}
+
+void ContextModelPair::updateHistory(const symbol_t sym) {
+    ContextModel::updateHistory(sym);
+    m_primary->updateHistory(sym);
+    m_shadow->updateHistory(sym);
+}
+
+void ContextModelPair::revert(void) {
+    m_primary->revert();
+    m_shadow->revert();
+}
+
+void ContextModelPair::revertHistory(size_t newsize) {
+    ContextModel::revertHistory(newsize);
+    m_primary->revertHistory(newsize);
+    m_shadow->revertHistory(newsize);
+}
+
+// sample from the primary model and update the shadow model with the result
+symbol_t ContextModelPair::genRandomSymbolAndUpdate(void) {
+    double primary_before = m_primary->logBlockProbability();
+    double shadow_before = m_shadow->logBlockProbability();
+
+    symbol_t sym = m_primary->genRandomSymbolAndUpdate();
+    m_shadow->update(sym);
+    compare(m_primary->logBlockProbability() - primary_before,
+            m_shadow->logBlockProbability() - shadow_before);
+    ContextModel::updateHistory(sym);
+    return sym;
+}
+
+double ContextModelPair::logBlockProbability(void) const {
+    return m_primary->logBlockProbability();
+}
+
+double ContextModelPair::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    return m_primary->getLogProbNextSymbolGivenH(sym);
+}
+
+double ContextModelPair::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    return m_primary->logProbBlock(block, n, first);
+}
+
+void ContextModelPair::reserveLookahead(size_t lookahead) {
+    ContextModel::reserveLookahead(lookahead);
+    m_primary->reserveLookahead(lookahead);
+    m_shadow->reserveLookahead(lookahead);
+}
+
+// log-loss of both models and their mean absolute difference per symbol
+void ContextModelPair::logStats(std::ostream &out) const {
+    m_primary->logStats(out);
+    m_shadow->logStats(out);
+    out << "model comparison: symbols " << m_compared << ", log-loss "
+            << m_primary_loss << " vs " << m_shadow_loss
+            << ", mean |log-probability difference| "
+            << (m_compared ? m_abs_diff / m_compared : 0.0) << std::endl;
+}
+
+unsigned long long ContextModelPair::evictions(void) const {
+    return m_primary->evictions();
+}
+
+unsigned long long ContextModelPair::reclaimedBytes(void) const {
+    return m_primary->reclaimedBytes();
+}
+
+size_t ContextModelPair::size(void) const {
+    return m_primary->size();
+}
+
+void ContextModelPair::stats(model_stats_t &stats) const {
+    m_primary->stats(stats);
+}
+
+// accumulate the log probabilities both models gave the last symbol
+void ContextModelPair::compare(double primary_log_prob,
+        double shadow_log_prob) {
+    m_primary_loss -= primary_log_prob;
+    m_shadow_loss -= shadow_log_prob;
+    m_abs_diff += fabs(primary_log_prob - shadow_log_prob);
+    m_compared++;
+}
@@ -1,9 +1,16 @@
 #ifndef __PREDICT_HPP__
 #define __PREDICT_HPP__
 
-#include <deque>
+#include <cassert>
 #include <cmath>
-
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "arena.hpp"
+#include "history.hpp"
+#include "logmath.hpp"
 #include "main.hpp"
 
 // stores symbol occurrence counts
@@ -13,10 +20,34 @@ typedef unsigned int count_t;
 typedef double weight_t;
 
 // stores the agent's history in terms of primitive symbols
-typedef std::deque<symbol_t> history_t;
+typedef History history_t;
+
+// index of a node in the context tree's node arena
+typedef uint32_t node_index_t;
+
+// CT_COMPACT_NODES packs nodes into 16 bytes: a float weight, 16-bit counts
+// halved once the root's reach NodeCountRescale, no stored KT estimate
+#ifdef CT_COMPACT_NODES
+typedef float node_weight_t;
+typedef uint16_t node_count_t;
+static const count_t NodeCountRescale = 0xE000;
+#else
+typedef weight_t node_weight_t;
+typedef count_t node_count_t;
+#endif
+
+// single precision weights predict from the path's weights before and
+// after an update, so that their rounding cancels out
+static const bool CompactWeights = sizeof(node_weight_t) < sizeof(weight_t);
+
+// child index of a missing child; the root lives at this index in the arena
+// and is never the child of another node
+static const node_index_t NoChild = 0;
 
 class CTNode {
     friend class ContextTree; // i.e. ContextTree can access private members of CTNode
+    friend class ContextTreeOverlay;
+    friend class ContextTreeCursor;
 
 public:
 
@@ -29,7 +60,11 @@ public:
 
     // log KT estimated probability
     weight_t logProbEstimated(void) const {
+#ifdef CT_COMPACT_NODES
+        return logKTEstimate(m_count[false], m_count[true]);
+#else
         return m_log_prob_est;
+#endif
     }
 
     // the number of times this context has been visited
@@ -37,103 +72,356 @@ public:
         return m_count[false] + m_count[true];
     }
 
-    // child corresponding to a particular symbol
-    const CTNode *child(symbol_t sym) const {
-        return m_child[sym];
+    // true if the node has no children
+    bool isLeaf(void) const {
+        return m_child[false] == NoChild && m_child[true] == NoChild;
     }
 
-    // number of descendants
-    size_t size(void) const;
-
 private:
     CTNode(void);
 
-    ~CTNode(void);
-
     // compute the logarithm of the KT-estimator update multiplier   
     double logKTMul(symbol_t sym) const;
 
-    // Calculate the logarithm of the weighted block probability.
+    // the log KT estimated probability once the node is updated with sym
+    weight_t logProbEstimatedAfter(symbol_t sym) const {
+        return logProbEstimated() + logKTMul(sym);
+    }
+
+    // Calculate the logarithm of the weighted block probability, given the
+    // sum of the log weighted probabilities of the node's children.
     // be careful of numerical issues, use an identity for log(a+b)
-    //  so that you can work in logspace instead.
-    void updateLogProbability(void);
+    //  so that you can work in logspace instead. Returns it at full
+    // precision, whatever precision the node stores it in.
+    weight_t updateLogProbability(bool leaf, weight_t log_prob_children);
 
-    // Update the node after having observed a new symbol.
+    // Count a newly observed symbol in the node's KT estimate; the
+    // weighted probability is updated once the children have been
     void update(const symbol_t symbol);
 
-    // Return the node to its state immediately prior to the last update.
+    // Return the counts and the KT estimate to their state immediately
+    // prior to the last update
     void revert(const symbol_t symbol);
 
+    // the log KT estimate of the symbols a lazily extended node counted
+    // before its children existed, standing in for their prediction
+    weight_t logProbUnpassed(count_t passed_0, count_t passed_1) const {
+        if (m_count[0] <= passed_0 && m_count[1] <= passed_1)
+            return 0.0;
+        return logKTEstimate(m_count[0] > passed_0 ? m_count[0] - passed_0 : 0,
+                m_count[1] > passed_1 ? m_count[1] - passed_1 : 0);
+    }
+
+    // sum of the log weighted probabilities of the children, but the one
+    // for skip, found through nodes(index), and of the unpassed symbols
+    template<typename Nodes>
+    weight_t logProbChildren(const Nodes &nodes, int skip = -1) const {
+        weight_t log_prob = 0.0;
+        count_t passed[2] = { 0, 0 };
+        for (int s = 0; s < 2; s++) {
+            if (m_child[s] == NoChild)
+                continue;
+            const CTNode &child = nodes(m_child[s]);
+            if (s != skip)
+                log_prob += child.m_log_prob_weighted;
+            passed[0] += child.m_count[0];
+            passed[1] += child.m_count[1];
+        }
+        return log_prob + logProbUnpassed(passed[0], passed[1]);
+    }
+
+    // the log probability of a symbol along a context path of nodes
+    template<typename Nodes, typename PathSymbol>
+    static weight_t logProbPath(const Nodes &nodes, const node_index_t *path,
+            size_t length, bool leaf_end, symbol_t sym,
+            const PathSymbol &path_sym, weight_t *log_prob_after = NULL);
+
+    // update a node never visited before, as the first node of a chain of
+    // them, whose probabilities all become exactly 1/2
+    void updateFresh(const symbol_t symbol);
+
+#ifndef CT_COMPACT_NODES
     weight_t m_log_prob_est;      // log KT estimated probability
-    weight_t m_log_prob_weighted; // log weighted block probability
+#endif
+    node_weight_t m_log_prob_weighted; // log weighted block probability
 
     // one slot for each symbol
-    count_t m_count[2];  // a,b in CTW literature
-    CTNode *m_child[2];
+    node_count_t m_count[2];  // a,b in CTW literature
+    node_index_t m_child[2]; // arena indices of the children
 
 };
 
-class ContextTree {
-public:
+// The log probability of sym along a context path, root first, whose d'th
+// context symbol is path_sym(d), ending at a leaf if leaf_end. Below an
+// unseen context the chain of new nodes has probability exactly 1/2.
+template<typename Nodes, typename PathSymbol>
+weight_t CTNode::logProbPath(const Nodes &nodes, const node_index_t *path,
+        size_t length, bool leaf_end, symbol_t sym,
+        const PathSymbol &path_sym, weight_t *log_prob_after) {
+    weight_t child_log_prob = -1.0;
+    weight_t child_log_prob_before = 0.0;
+    for (size_t d = length; d-- > 0;) {
+        const CTNode &node = nodes(path[d]);
+        weight_t log_prob_est = node.logProbEstimatedAfter(sym);
+
+        if (leaf_end && d + 1 == length) {
+            child_log_prob = log_prob_est;
+            child_log_prob_before = node.logProbEstimated();
+        } else {
+            // the updated child, its untouched sibling and the symbols
+            // neither has seen
+            symbol_t context_sym = path_sym(d);
+            weight_t log_prob_rest = node.logProbChildren(nodes, context_sym);
+            child_log_prob = logWeightedMix(log_prob_est,
+                    log_prob_rest + child_log_prob);
+            // a lazy leaf gets its first child in this update
+            bool leaf = d + 1 == length && node.m_child[!context_sym]
+                    == NoChild;
+            if (CompactWeights)
+                child_log_prob_before = leaf ? node.logProbEstimated() :
+                        logWeightedMix(node.logProbEstimated(),
+                                log_prob_rest + child_log_prob_before);
+        }
+        if (log_prob_after != NULL)
+            log_prob_after[d] = child_log_prob;
+    }
+
+    if (!CompactWeights)
+        return child_log_prob - nodes(0).m_log_prob_weighted;
+    return child_log_prob - child_log_prob_before;
+}
+
+// Statistics of a context model, kept up to date as the model changes so
+// that reading them costs nothing however large the model grows
+struct model_stats_t {
+    size_t nodes;                      // context nodes held
+    std::vector<size_t> depth_nodes;   // nodes at each depth, if tracked
+    size_t bytes;                      // memory held by nodes and history
+    unsigned long long created;        // nodes created so far
+    unsigned long long destroyed;      // nodes released so far
+    size_t max_history;                // longest the history has been
+};
 
-    // create a context tree of specified maximum depth
-    ContextTree(size_t depth);
+// A model predicting the next binary symbol from the agent's history, such
+// as a context tree. The history is kept here; the statistics are kept by
+// the backends deriving from this class.
+class ContextModel {
+public:
 
-    ~ContextTree(void);
+    // create a model with the specified maximum context depth, keeping
+    // enough history to revert the given number of symbols
+    ContextModel(size_t depth, size_t lookahead);
 
-    void print(void);
+    virtual ~ContextModel(void);
 
     // reset the history to the last ct-depth size of history
-    void resetHistory(void);
+    virtual void resetHistory(void);
 
-    // clear the entire context tree
-    void clear(void);
+    // clear the statistics and the history
+    virtual void clear(void) = 0;
 
-    // updates the context tree with a new binary symbol
-    void update(const symbol_t sym);
-    // update the context tree with a list of symbols.
+    // updates the model with a new binary symbol
+    virtual void update(const symbol_t sym) = 0;
+    // update the model with a list of symbols.
     void update(const symbol_list_t &symbol_list);
-    // add a symbol to the history without updating the context tree.
+    // add a symbol to the history without updating the model.
     void updateHistory(const symbol_list_t &symbol_list);
-    void updateHistory(const symbol_t sym);
-
-    //Recalculate the log weighted probability for this node.
-    void updateLogProbability(void);
+    virtual void updateHistory(const symbol_t sym);
 
-    // removes the most recently observed symbol from the context tree
-    void revert(void);
+    // removes the most recently observed symbol from the model
+    virtual void revert(void) = 0;
 
     // shrinks the history down to a former size
-    void revertHistory(size_t newsize);
+    virtual void revertHistory(size_t newsize);
 
-    // the estimated probability of observing a particular symbol or sequence
-    double predict(symbol_t sym);
-    double predict(symbol_list_t symbol_list);
+    // the estimated probability of observing a particular symbol next
+    double predict(symbol_t sym) const;
 
     // generate a specified number of random symbols
-    // distributed according to the context tree statistics
+    // distributed according to the model statistics
     void genRandomSymbols(symbol_list_t &symbols, size_t bits);
 
     // generate a specified number of random symbols distributed according to
-    // the context tree statistics and update the context tree with the newly
+    // the model statistics and update the model with the newly
     // generated bits
     void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits);
 
+    // generate a single random symbol distributed according to the model
+    // statistics and update the model with it
+    virtual symbol_t genRandomSymbolAndUpdate(void) = 0;
+
+    // update the model with a block of n symbols, bit i the i'th
+    virtual void updateBlock(uint64_t block, size_t n);
+
+    // generate a block of n symbols, bit i the i'th, distributed according
+    // to the model statistics, updating the model with each in turn
+    virtual uint64_t genRandomBlockAndUpdate(size_t n);
+
+    // remove the last n symbols from the model and the history
+    virtual void revertBlock(size_t n);
+
     // the logarithm of the block probability of the whole sequence
-    double logBlockProbability(void);
+    virtual double logBlockProbability(void) const = 0;
 
-    // Calculate the probability of the next symbol given the next history P(x[i]=sym|h)
-    double getLogProbNextSymbolGivenH(symbol_t sym);
+    // Calculate the probability of the next symbol given the next history
+    // P(x[i]=sym|h), without modifying the model
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const = 0;
 
     // Calculate the probability of the next symbol given the next history
     // P(x[i]=sym|h) and update
     double getLogProbNextSymbolGivenHWithUpdate(symbol_t sym);
 
-    // Create a path list from root node to one level above the leaf node
-    // along the context, used for updating and reverting the Context tree
-    // from bottom up
-    void walkAndGeneratePath(int bit_fix, std::vector<CTNode*> &context_path,
-            CTNode **current);
+    // log probability of the next n symbols, bit i the i'th, after the
+    // first that are only appended to the history; safe to call from several
+    // threads while nothing updates the model
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const = 0;
+
+    // the probability of each of the 2^bits blocks that can come next,
+    // bit i of the index being the i'th symbol
+    virtual void blockDistribution(size_t bits, std::vector<double> &probs);
+
+    // get the n'th history symbol, false if it is no longer stored
+    bool nthHistorySymbol(size_t n, symbol_t &sym) const;
+
+    // make room in the history to revert the given number of symbols
+    virtual void reserveLookahead(size_t lookahead);
+
+    // write backend specific statistics to a log
+    virtual void logStats(std::ostream &out) const;
+
+    // write the model to a binary snapshot, false if the backend cannot be
+    // saved
+    virtual bool save(std::ostream &out) const;
+
+    // restore the model from a snapshot held in memory, stepping past it;
+    // false if the snapshot is malformed or the backend cannot be loaded
+    virtual bool load(const char *&data, const char *end);
+
+    // number of context nodes dropped to stay within the memory bound
+    virtual unsigned long long evictions(void) const;
+
+    // bytes of node storage released by those evictions
+    virtual unsigned long long reclaimedBytes(void) const;
+
+    // record the nodes the following updates change so that they can be
+    // copied back; false if the backend keeps no journal
+    virtual bool setJournaling(bool on);
+
+    // number of updates recorded in the journal, to roll back to later
+    virtual size_t journalMark(void) const;
+
+    // undo the recorded updates made after the given mark; the history is
+    // left as it is
+    virtual void rollback(size_t mark);
+
+    // read depth d of the context from the history symbol of age ages[d];
+    // false if the backend cannot, or already holds statistics
+    virtual bool setContextMask(const std::vector<size_t> &ages);
+
+    // the ages of the history symbols making up the context, empty when
+    // depth d reads the d'th most recent symbol
+    const std::vector<size_t> &contextMask(void) const {
+        return m_context_ages;
+    }
+
+    // age of the history symbol giving the context at depth d
+    size_t contextAge(size_t d) const {
+        return m_context_ages.empty() ? d : m_context_ages[d];
+    }
+
+    // number of history symbols the context reaches back over
+    size_t contextSpan(void) const;
+
+    // the maximum context depth
+    size_t depth(void) const {
+        return m_depth;
+    }
+
+    // the size of the stored history
+    size_t historySize(void) const {
+        return m_history.size();
+    }
+
+    // number of context nodes held by the model
+    virtual size_t size(void) const = 0;
+
+    // the model's statistics, as far as the backend tracks them
+    virtual void stats(model_stats_t &stats) const;
+
+protected:
+    // fill in the probabilities of the blocks starting with the given
+    // prefix of the given length and log probability
+    void blockDistribution(size_t bits, size_t length, size_t prefix,
+            double log_prob, std::vector<double> &probs);
+
+    // the symbol of the given age in the context of the j'th symbol of a
+    // block: the block symbols before it, most recent first, then the
+    // history
+    symbol_t blockContextSymbol(uint64_t block, size_t j, size_t age) const {
+        if (age < j)
+            return (block >> (j - 1 - age)) & 1;
+        return m_history.recent(age - j);
+    }
+
+    history_t m_history; // the agents history
+    size_t m_depth;      // the maximum depth of the context tree
+    size_t m_lookahead;  // symbols the history keeps to revert
+    size_t m_max_history; // the longest the history has been
+    std::vector<size_t> m_context_ages; // context mask, empty for none
+
+};
+
+// The exact context tree, weighting every context up to the maximum depth.
+class ContextTree: public ContextModel {
+    friend class ContextTreeOverlay; // read the nodes and the history
+    friend class ContextTreeCursor;
+
+public:
+
+    // create a context tree of specified maximum depth, keeping enough
+    // history to revert the given number of symbols
+    ContextTree(size_t depth, size_t lookahead = 0);
+
+    virtual ~ContextTree(void);
+
+    void print(void);
+
+    // clear the entire context tree
+    virtual void clear(void);
+
+    // updates the context tree with a new binary symbol
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    // update the tree with a long sequence of symbols as one update per
+    // symbol would, building subtrees on the given threads (0, one per core)
+    void bulkUpdate(const symbol_list_t &symbols, size_t threads = 0);
+
+    // as bulkUpdate, but only the symbols flagged in learn update the
+    // tree; the rest are only appended to the history, as the agent's
+    // actions are
+    void bulkUpdate(const symbol_list_t &symbols,
+            const std::vector<bool> &learn, size_t threads = 0);
+
+    // removes the most recently observed symbol from the context tree
+    virtual void revert(void);
+
+    // generate a single random symbol distributed according to the context
+    // tree statistics and update the context tree with it, in one walk
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    // the logarithm of the block probability of the whole sequence
+    virtual double logBlockProbability(void) const;
+
+    // Calculate the probability of the next symbol given the next history
+    // P(x[i]=sym|h), without modifying the context tree
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    // the probability of a block, evaluated on a cursor of the calling
+    // thread without modifying the context tree
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
 
     // Debug tree, print history symbols and the context tree in Pre order
     void debugTree(void);
@@ -148,29 +436,413 @@ public:
     void printTreeStructure(std::vector<CTNode*> node_list, int cur_depth,
             int type);
 
-    // get the n'th history symbol, NULL if doesn't exist
-    const symbol_t *nthHistorySymbol(size_t n) const;
+    // number of nodes in the context tree
+    virtual size_t size(void) const {
+        return m_nodes.size() - m_free.size() - m_hot_free.size();
+    }
 
-    // the depth of the context tree
-    size_t depth(void) const {
-        return m_depth;
+    // page the nodes out to a file mapped from the given directory, the
+    // first levels kept together at its front; false if it cannot be mapped
+    bool setArenaFile(const std::string &dir);
+
+    // limit the number of nodes, pruning the least visited subtrees once it
+    // is exceeded; 0 for no limit
+    void setMaxNodes(size_t max_nodes);
+
+    // give leaves at and below the given depth children only once they
+    // have been visited the given number of times; 0 visits for eagerly
+    void setLazyExtension(size_t depth, count_t visits);
+
+    // the depth lazy extension starts at, and the visits to extend there
+    size_t lazyDepth(void) const {
+        return m_lazy_depth;
     }
 
-    // the size of the stored history
-    size_t historySize(void) const {
-        return m_history.size();
+    count_t lazyVisits(void) const {
+        return m_lazy_visits;
     }
 
-    // number of nodes in the context tree
-    size_t size(void) const {
-        return m_root ? m_root->size() : 0;
+    // node count and pruning totals
+    virtual void logStats(std::ostream &out) const;
+
+    // write the lazy extension settings, the nodes, the free list and the
+    // history to a binary snapshot
+    virtual bool save(std::ostream &out) const;
+
+    // restore the tree from a snapshot, taking up the lazy extension the
+    // nodes were grown with; the node array is copied out of the snapshot
+    // in one block
+    virtual bool load(const char *&data, const char *end);
+
+    // number of nodes released by pruning
+    virtual unsigned long long evictions(void) const;
+
+    // bytes of node storage released by pruning
+    virtual unsigned long long reclaimedBytes(void) const;
+
+    // journal the updates, which then neither prune nor are reverted by
+    // walking the context again
+    virtual bool setJournaling(bool on);
+
+    virtual size_t journalMark(void) const {
+        return m_journal_marks.size();
     }
 
+    virtual void rollback(size_t mark);
+
+    // nodes by depth, node churn and the memory held, all counted as the
+    // tree changes
+    virtual void stats(model_stats_t &stats) const;
+
+    // read the context through a mask; only while the tree is empty
+    virtual bool setContextMask(const std::vector<size_t> &ages);
+
+    // the block distribution, journaling the prefix updates so that they
+    // are undone exactly
+    virtual void blockDistribution(size_t bits, std::vector<double> &probs);
+
+    // the root node of the context tree
+    const CTNode *root(void) const {
+        return &m_nodes[0];
+    }
+
+    // child of a node corresponding to a particular symbol, NULL if missing
+    const CTNode *child(const CTNode *node, symbol_t sym) const {
+        return node->m_child[sym] == NoChild ?
+                NULL : &m_nodes[node->m_child[sym]];
+    }
+
+protected:
+    // P(x[i]=sym|h) for a maximum depth known at compile time, walking the
+    // context with a path array on the stack; 0 for the tree's own depth
+    template<size_t Depth>
+    double logProbNextSymbol(symbol_t sym) const;
+
+    // update, revert and sample as update, revert and
+    // genRandomSymbolAndUpdate do, with the same choice of depth; defined
+    // for the depths newContextTree() specialises
+    template<size_t Depth>
+    void updateSymbol(const symbol_t sym);
+
+    template<size_t Depth>
+    void revertSymbol(void);
+
+    template<size_t Depth>
+    symbol_t genSymbolAndUpdate(void);
+
+    // Create a path list from root node to one level above the leaf node
+    // along the context, used for updating and reverting the Context tree
+    // from bottom up; returns its length
+    template<size_t Depth>
+    size_t walkAndGeneratePath(int bit_fix, node_index_t *context_path,
+            node_index_t &current);
+
 private:
-    history_t m_history; // the agents history
-    CTNode *m_root;      // the root node of the context tree
-    size_t m_depth;      // the maximum depth of the context tree
+    // take a fresh node at the given depth from the arena, reusing released
+    // slots first
+    node_index_t newNode(size_t depth);
+
+    // return a node at the given depth to the arena's free list
+    void freeNode(node_index_t index, size_t depth);
+
+    // set the slots of the first levels aside at the front of the arena
+    void reserveHotSlots(void);
+
+    // sum of the log weighted probabilities of a node's children, with
+    // the estimate of the symbols they have not seen
+    weight_t logProbChildren(const CTNode &node) const;
+
+    // recount the nodes at each depth from the tree itself
+    void countDepthNodes(void);
+
+    // whether a walk stops at a pruned or not yet extended node of the
+    // given depth, given its visits before the symbol walked for
+    bool isLeafContext(const CTNode &node, size_t depth,
+            count_t visits) const {
+        if (!node.isLeaf())
+            return false;
+        if (m_lazy_visits > 0 && depth >= m_lazy_depth)
+            return visits < m_lazy_visits;
+        return visits > 0;
+    }
+
+    // release the least visited subtrees until the tree is a quarter
+    // below its node budget
+    void prune(void);
+
+#ifdef CT_COMPACT_NODES
+    // halve the counts of every node, before the root's overflow
+    void rescale(void);
+#endif
+
+    // record a node's state before it is changed, when journaling
+    void journal(node_index_t index) {
+        if (m_journaling) {
+            journal_entry_t entry = { index, NoChild, 0, false, m_nodes[index] };
+            m_journal.push_back(entry);
+        }
+    }
+
+    // undo the most recent journaled update
+    void rollbackUpdate(void);
+
+    // the nodes one thread of a bulk update creates, numbered from
+    // LocalNode until they are moved into the shared arena
+    struct bulk_arena_t;
+    static const node_index_t LocalNode = node_index_t(1) << 31;
+
+    // update the subtree at a node of the given depth with the symbols at
+    // the given positions of a bulk update's sequence
+    void bulkUpdateSubtree(node_index_t root, size_t depth,
+            const unsigned char *seq, const size_t *positions, size_t n,
+            bulk_arena_t &arena);
+
+    // node arena, children linked by index; released slots go on the free
+    // list, and the first 2^m_hot_depth of a file arena on m_hot_free
+    NodeArena<CTNode> m_nodes;
+    std::vector<node_index_t> m_free;
+    size_t m_hot_depth;
+    std::vector<node_index_t> m_hot_free;
+
+    // scratch buffers reused by every walk, so that updating does not
+    // allocate: the current context path and the weighted probabilities
+    // its nodes would take
+    std::vector<node_index_t> m_path;
+    std::vector<weight_t> m_path_update;
+
+    size_t m_max_nodes;                  // node budget, 0 for no limit
+    size_t m_lazy_depth;                 // depth lazy extension starts at
+    count_t m_lazy_visits;               // visits to extend there, 0 for eager
+    unsigned long long m_evicted_nodes;  // nodes released by pruning
+
+    std::vector<size_t> m_depth_nodes;   // nodes at each depth
+    unsigned long long m_created_nodes;  // nodes taken from the arena
+    unsigned long long m_released_nodes; // nodes returned to it
+
+    // a node as it was before an update changed it, or one it created
+    struct journal_entry_t {
+        node_index_t index;
+        node_index_t parent; // parent of a created node
+        uint32_t depth;      // depth of a created node
+        bool created;
+        CTNode node;         // prior state of a changed node
+    };
+
+    bool m_journaling;
+    std::vector<journal_entry_t> m_journal;
+    std::vector<size_t> m_journal_marks; // first entry of each update
+
+};
+
+// Calculate the probability of the next symbol given the next history
+// P(x[i]=sym|h) in one walk, on a stack path when Depth is fixed
+template<size_t Depth>
+double ContextTree::logProbNextSymbol(symbol_t sym) const {
+    assert(Depth == 0 || Depth == m_depth);
+    const size_t depth = Depth > 0 ? Depth : m_depth;
+
+    node_index_t fixed_path[Depth + 1];
+    std::vector<node_index_t> heap_path;
+    node_index_t *context_path = fixed_path;
+    if (Depth == 0) {
+        heap_path.resize(m_depth + 1);
+        context_path = &heap_path[0];
+    }
+
+    // Collect the existing nodes along the context, stopping at the first
+    // context that has not been seen yet or at one acting as a leaf
+    node_index_t current = 0;
+    uint64_t context = 0;
+    bool pruned = false;
+    size_t length = 0;
+    context_path[length++] = current;
+    for (size_t d = 0; d < depth; d++) {
+        if (isLeafContext(m_nodes[current], d, m_nodes[current].visits())) {
+            pruned = true;
+            break;
+        }
+        symbol_t context_sym;
+        if (!m_context_ages.empty()) {
+            context_sym = m_history.recent(m_context_ages[d]);
+        } else {
+            if ((d & 63) == 0)
+                context = m_history.context(d);
+            context_sym = context & 1;
+            context >>= 1;
+        }
+        current = m_nodes[current].m_child[context_sym];
+        if (current == NoChild)
+            break;
+        context_path[length++] = current;
+    }
+
+    return CTNode::logProbPath(
+            [this](node_index_t index) -> const CTNode & {
+                return m_nodes[index];
+            },
+            context_path, length, length == depth + 1 || pruned, sym,
+            [this](size_t d) { return m_history.recent(contextAge(d)); });
+}
+
+// An exact context tree whose maximum depth and percept widths are fixed
+// at compile time, for the configurations shipped. Every walk keeps its
+// path on the stack, and a percept's block runs a loop of fixed length.
+// Widths of 0 fix the depth alone.
+template<size_t Depth, size_t ObsBits = 0, size_t RewBits = 0>
+class ContextTreeT: public ContextTree {
+public:
+
+    ContextTreeT(size_t lookahead = 0) :
+            ContextTree(Depth, lookahead) {
+    }
+
+    using ContextModel::update;
+    virtual void update(const symbol_t sym) {
+        updateSymbol<Depth>(sym);
+    }
+
+    virtual void revert(void) {
+        revertSymbol<Depth>();
+    }
+
+    virtual symbol_t genRandomSymbolAndUpdate(void) {
+        return genSymbolAndUpdate<Depth>();
+    }
+
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const {
+        return logProbNextSymbol<Depth>(sym);
+    }
+
+    virtual void updateBlock(uint64_t block, size_t n) {
+        if (n == PerceptBits)
+            updateBits<PerceptBits>(block, n);
+        else
+            updateBits<0>(block, n);
+    }
+
+    virtual uint64_t genRandomBlockAndUpdate(size_t n) {
+        return n == PerceptBits ? genBits<PerceptBits>(n) : genBits<0>(n);
+    }
+
+    virtual void revertBlock(size_t n) {
+        if (n == PerceptBits)
+            revertBits<PerceptBits>(n);
+        else
+            revertBits<0>(n);
+    }
+
+private:
+    static const size_t PerceptBits = ObsBits + RewBits;
+
+    // the block operations over N symbols, or n when N is 0
+    template<size_t N>
+    void updateBits(uint64_t block, size_t n) {
+        for (size_t i = 0; i < (N > 0 ? N : n); i++)
+            updateSymbol<Depth>((block >> i) & 1);
+    }
+
+    template<size_t N>
+    uint64_t genBits(size_t n) {
+        uint64_t block = 0;
+        for (size_t i = 0; i < (N > 0 ? N : n); i++)
+            block |= uint64_t(genSymbolAndUpdate<Depth>()) << i;
+        return block;
+    }
+
+    template<size_t N>
+    void revertBits(size_t n) {
+        for (size_t i = 0; i < (N > 0 ? N : n); i++) {
+            revertSymbol<Depth>();
+            revertHistory(historySize() - 1);
+        }
+    }
+};
+
+// create an exact context tree of the given depth, specialised at compile
+// time for the depth and percept widths of the shipped configurations, or
+// for the depth alone when it is one of theirs
+ContextTree *newContextTree(size_t depth, size_t lookahead = 0,
+        size_t obs_bits = 0, size_t rew_bits = 0);
+
+// Runs two models side by side on the same history. The primary model
+// drives prediction and sampling; the shadow model is updated with the
+// same symbols, and the log-loss of both on every updated symbol is
+// accumulated so an approximate backend can be compared with the exact one.
+class ContextModelPair: public ContextModel {
+public:
+
+    // take ownership of both models, which must have the same depth
+    ContextModelPair(ContextModel *primary, ContextModel *shadow,
+            size_t lookahead = 0);
+
+    virtual ~ContextModelPair(void);
+
+    virtual void resetHistory(void);
+
+    virtual void clear(void);
+
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    using ContextModel::updateHistory;
+    virtual void updateHistory(const symbol_t sym);
+
+    virtual void revert(void);
+
+    virtual void revertHistory(size_t newsize);
+
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    virtual double logBlockProbability(void) const;
+
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
+
+    virtual void reserveLookahead(size_t lookahead);
+
+    // log-loss of both models and their mean absolute difference per symbol
+    virtual void logStats(std::ostream &out) const;
+
+    // evictions of the primary model
+    virtual unsigned long long evictions(void) const;
+    virtual unsigned long long reclaimedBytes(void) const;
+
+    virtual size_t size(void) const;
+
+    // statistics of the primary model
+    virtual void stats(model_stats_t &stats) const;
+
+    // accumulated log-loss, in bits, of the primary and shadow models
+    double primaryLogLoss(void) const {
+        return m_primary_loss;
+    }
+    double shadowLogLoss(void) const {
+        return m_shadow_loss;
+    }
+
+    // accumulated |log2 P_primary(x) - log2 P_shadow(x)| over compared symbols
+    double absLogDifference(void) const {
+        return m_abs_diff;
+    }
+
+    // number of symbols compared
+    unsigned long long compared(void) const {
+        return m_compared;
+    }
+
+private:
+    // accumulate the log probabilities both models gave the last symbol
+    void compare(double primary_log_prob, double shadow_log_prob);
+
+    ContextModel *m_primary;
+    ContextModel *m_shadow;
 
+    double m_primary_loss;
+    double m_shadow_loss;
+    double m_abs_diff;
+    unsigned long long m_compared;
 };
 
 #endif // __PREDICT_HPP__
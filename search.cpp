@@ -273,13 +273,14 @@ reward_t ChanceNode::sample(Agent &agent, unsigned int dfr) {
 }
 
 // simulate a path through a hypothetical future for the agent within its
-// internal model of the world, returning the accumulated reward.
+// internal model of the world, returning the accumulated reward. The
+// percepts come from the agent's rollout tree, when it keeps one.
 reward_t playout(Agent &agent, unsigned int playout_len) {
     reward_t reward = 0;
     for (int i = 1; i <= int(playout_len); i++) {
         action_t a = agent.genRandomAction();
         agent.modelUpdate(a);
-        percept_t* percept = agent.genPerceptAndUpdate();
+        percept_t* percept = agent.genRolloutPerceptAndUpdate();
         reward += percept[1];
         delete[] percept;
     }
@@ -294,6 +295,7 @@ extern action_t search(Agent &agent) {
     clock_t startTime = clock();
     clock_t endTime = clock();
     int iter = 0;
+    agent.beginSimulation();
     do {
         ModelUndo mu = ModelUndo(agent);
 
@@ -304,6 +306,8 @@ extern action_t search(Agent &agent) {
         endTime = clock();
         iter++;
     } while ((endTime - startTime) / (double) CLOCKS_PER_SEC < agent.timeout());
+    agent.endSimulation();
+    aixi::log << "simulations: " << iter << std::endl;
 
     action_t action = (agent.searchTree())->bestAction(agent);
 //action_t action = root.bestAction(agent);
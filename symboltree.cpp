@@ -0,0 +1,468 @@
+#include "symboltree.hpp"
+#include "logmath.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+// pseudo-count of every observed percept, and of the escape to unobserved
+// ones, in the global estimate
+static const double SymbolPrior = 0.5;
+
+// pseudo-count of the global estimate in each node's estimator
+static const double SymbolConcentration = 1.0;
+
+// number of history bits the given levels of context take, the action
+// being the most recent
+static size_t contextBits(size_t levels, size_t percept_bits,
+        size_t action_bits) {
+    return (levels + 1) / 2 * action_bits + levels / 2 * percept_bits;
+}
+
+// create a symbol context tree of the given number of levels; the history
+// holds the percept being added on top of the context
+SymbolContextTree::SymbolContextTree(size_t levels, size_t percept_bits,
+        size_t action_bits, size_t lookahead) :
+        ContextModel(
+                percept_bits
+                        + contextBits(levels, percept_bits, action_bits),
+                lookahead), m_levels(levels), m_percept_bits(percept_bits), m_action_bits(
+                action_bits), m_cycle_bits(percept_bits + action_bits), m_count_entries(
+                0), m_version(0) {
+    // symbols share a child map key with the parent's index
+    assert(percept_bits > 0 && percept_bits <= 32 && action_bits <= 32);
+    clear();
+}
+
+SymbolContextTree::~SymbolContextTree(void) {
+}
+
+// take a fresh node from the arena, reusing released slots first
+node_index_t SymbolContextTree::newNode(void) {
+    node_t fresh = { 0.0, 0.0, 0.0, 0, std::vector<symbol_count_t>() };
+    if (!m_free.empty()) {
+        node_index_t index = m_free.back();
+        m_free.pop_back();
+        m_nodes[index] = fresh;
+        return index;
+    }
+    m_nodes.push_back(fresh);
+    return node_index_t(m_nodes.size() - 1);
+}
+
+// return a node to the arena's free list, releasing its counts
+void SymbolContextTree::freeNode(node_index_t index) {
+    assert(index != NoChild);
+    std::vector<symbol_count_t>().swap(m_nodes[index].counts);
+    m_free.push_back(index);
+}
+
+// clear the entire context tree
+void SymbolContextTree::clear(void) {
+    m_history.clear();
+    m_nodes.clear();
+    m_free.clear();
+    m_children.clear();
+    m_prefixes.clear();
+    m_count_entries = 0;
+    newNode();
+    m_version++;
+    m_prediction.version = ~0ULL;
+}
+
+// Truncate the history to the context span. The agent starts cycles at
+// multiples of the cycle length, so the cut keeps that alignment.
+void SymbolContextTree::resetHistory(void) {
+    size_t n = contextSpan();
+    if (m_history.size() > n)
+        n += (m_history.size() - n) % m_cycle_bits;
+    m_history.truncate(n);
+    m_version++;
+}
+
+void SymbolContextTree::updateHistory(const symbol_t sym) {
+    ContextModel::updateHistory(sym);
+    m_version++;
+}
+
+void SymbolContextTree::revertHistory(size_t newsize) {
+    ContextModel::revertHistory(newsize);
+    m_version++;
+}
+
+// append a bit to the history, adding the percept it completes
+void SymbolContextTree::update(const symbol_t sym) {
+    updateHistory(sym);
+    if (phase() == m_percept_bits)
+        addPercept();
+}
+
+// remove the last percept from the tree if the last bit completed it; the
+// history is left as it is
+void SymbolContextTree::revert(void) {
+    if (phase() == m_percept_bits)
+        removePercept();
+    m_version++;
+}
+
+// the symbol at the given level of the context, read least significant
+// bit first as it was encoded, moving the age past it
+uint64_t SymbolContextTree::contextSymbol(size_t level, size_t &age) const {
+    size_t width = level % 2 == 0 ? m_action_bits : m_percept_bits;
+    uint64_t symbol = 0;
+    for (size_t i = 0; i < width; i++)
+        symbol |= uint64_t(m_history.recent(age + width - 1 - i)) << i;
+    age += width;
+    return symbol;
+}
+
+// collect the nodes along the context starting at the given age, down to
+// the first context not seen yet
+void SymbolContextTree::walk(size_t age, std::vector<node_index_t> &path,
+        std::vector<uint64_t> &keys) const {
+    node_index_t current = 0;
+    path.clear();
+    keys.clear();
+    path.push_back(current);
+    for (size_t l = 0; l < m_levels; l++) {
+        uint64_t key = (uint64_t(current) << 32) | contextSymbol(l, age);
+        std::unordered_map<uint64_t, node_index_t>::const_iterator it =
+                m_children.find(key);
+        if (it == m_children.end())
+            break;
+        current = it->second;
+        path.push_back(current);
+        keys.push_back(key);
+    }
+}
+
+// the observations of the percepts starting with the given bits
+SymbolContextTree::prefix_count_t SymbolContextTree::prefixCount(
+        uint64_t prefix, size_t bits) const {
+    std::unordered_map<uint64_t, prefix_count_t>::const_iterator it =
+            m_prefixes.find(prefixKey(prefix, bits));
+    if (it == m_prefixes.end()) {
+        prefix_count_t none = { 0, 0 };
+        return none;
+    }
+    return it->second;
+}
+
+// Count a percept in, or out of, the observations of each of its prefixes,
+// the percept itself included
+void SymbolContextTree::observe(uint64_t symbol, int step) {
+    bool distinct = step > 0 ?
+            prefixCount(symbol, m_percept_bits).count == 0 :
+            prefixCount(symbol, m_percept_bits).count == 1;
+    for (size_t bits = 0; bits <= m_percept_bits; bits++) {
+        uint64_t prefix = symbol & ((uint64_t(1) << bits) - 1);
+        prefix_count_t &c = m_prefixes[prefixKey(prefix, bits)];
+        c.count += step;
+        if (distinct)
+            c.distinct += step;
+        if (c.count == 0)
+            m_prefixes.erase(prefixKey(prefix, bits));
+    }
+}
+
+// The global estimate of the percepts starting with the given bits: each
+// observed percept has its count plus a prior, and the escape's prior is
+// shared evenly among the percepts never observed
+double SymbolContextTree::globalEstimate(uint64_t prefix, size_t bits) const {
+    prefix_count_t all = prefixCount(0, 0);
+    prefix_count_t matching = prefixCount(prefix, bits);
+    double percepts = ldexp(1.0, int(m_percept_bits));
+    bool escape = all.distinct < percepts;
+    double total = all.count + SymbolPrior * (all.distinct + escape);
+
+    double estimate = (matching.count + SymbolPrior * matching.distinct)
+            / total;
+    if (escape)
+        estimate += SymbolPrior / total
+                * (ldexp(1.0, int(m_percept_bits - bits)) - matching.distinct)
+                / (percepts - all.distinct);
+    return estimate;
+}
+
+// The estimate of a percept in a node: its count plus the global estimate
+// as a prior, over the node's visits plus the prior's weight
+double SymbolContextTree::estimate(const node_t &node, uint64_t symbol) const {
+    count_t count = 0;
+    for (size_t i = 0; i < node.counts.size(); i++) {
+        if (node.counts[i].symbol == symbol) {
+            count = node.counts[i].count;
+            break;
+        }
+    }
+    return (count
+            + SymbolConcentration * globalEstimate(symbol, m_percept_bits))
+            / (node.visits + SymbolConcentration);
+}
+
+// Add the percept held by the most recent bits to every node along its
+// context, creating the missing ones, and recompute the weighted
+// probabilities bottom up
+void SymbolContextTree::addPercept(void) {
+    uint64_t symbol = 0;
+    for (size_t i = 0; i < m_percept_bits; i++)
+        symbol |= uint64_t(m_history.recent(m_percept_bits - 1 - i)) << i;
+
+    // Extend the path to the full depth; the arena may grow here, so only
+    // indices are held across the allocation
+    walk(m_percept_bits, m_path, m_path_keys);
+    size_t age = m_percept_bits;
+    for (size_t l = 0; l < m_path.size() - 1; l++)
+        contextSymbol(l, age);
+    for (size_t l = m_path.size() - 1; l < m_levels; l++) {
+        uint64_t key = (uint64_t(m_path.back()) << 32)
+                | contextSymbol(l, age);
+        node_index_t child = newNode();
+        m_children.insert(std::make_pair(key, child));
+        m_path.push_back(child);
+        m_path_keys.push_back(key);
+    }
+
+    weight_t child_delta = 0.0;
+    for (size_t d = m_path.size(); d-- > 0;) {
+        node_t &node = m_nodes[m_path[d]];
+        node.log_prob_est += log2(estimate(node, symbol));
+
+        size_t i = 0;
+        while (i < node.counts.size() && node.counts[i].symbol != symbol)
+            i++;
+        if (i == node.counts.size()) {
+            symbol_count_t entry = { symbol, 0 };
+            node.counts.push_back(entry);
+            m_count_entries++;
+        }
+        node.counts[i].count++;
+        node.visits++;
+
+        node.log_prob_children += child_delta;
+        weight_t before = node.log_prob_weighted;
+        node.log_prob_weighted =
+                d == m_levels ?
+                        node.log_prob_est :
+                        logWeightedMix(node.log_prob_est,
+                                node.log_prob_children);
+        child_delta = node.log_prob_weighted - before;
+    }
+
+    observe(symbol, 1);
+    m_version++;
+}
+
+// Remove the percept held by the most recent bits from the nodes along its
+// context, releasing those left without visits
+void SymbolContextTree::removePercept(void) {
+    uint64_t symbol = 0;
+    for (size_t i = 0; i < m_percept_bits; i++)
+        symbol |= uint64_t(m_history.recent(m_percept_bits - 1 - i)) << i;
+
+    walk(m_percept_bits, m_path, m_path_keys);
+    assert(m_path.size() == m_levels + 1);
+
+    assert(prefixCount(symbol, m_percept_bits).count > 0);
+    observe(symbol, -1);
+
+    weight_t child_delta = 0.0;
+    for (size_t d = m_path.size(); d-- > 0;) {
+        node_t &node = m_nodes[m_path[d]];
+
+        size_t i = 0;
+        while (node.counts[i].symbol != symbol)
+            i++;
+        if (--node.counts[i].count == 0) {
+            node.counts[i] = node.counts.back();
+            node.counts.pop_back();
+            m_count_entries--;
+        }
+        node.visits--;
+        node.log_prob_est -= log2(estimate(node, symbol));
+        node.log_prob_children += child_delta;
+
+        weight_t before = node.log_prob_weighted;
+        if (d > 0 && node.visits == 0) {
+            // Release the context once nothing has been seen in it
+            node.log_prob_est = 0.0;
+            node.log_prob_weighted = 0.0;
+            node.log_prob_children = 0.0;
+            m_children.erase(m_path_keys[d - 1]);
+            freeNode(m_path[d]);
+        } else {
+            node.log_prob_weighted =
+                    d == m_levels ?
+                            node.log_prob_est :
+                            logWeightedMix(node.log_prob_est,
+                                    node.log_prob_children);
+        }
+        child_delta = m_nodes[m_path[d]].log_prob_weighted - before;
+    }
+    m_version++;
+}
+
+// The probability of the percepts after the current context. The CTW
+// mixture along the context is linear in the estimates of its nodes, each
+// node contributing with the posterior weight of stopping there, so the
+// probability of a percept is a weighted sum of the nodes' counts and of
+// the global estimate. The root has seen every percept, so its counts are
+// read from the observations; the counts of the nodes below are gathered
+// once per percept.
+void SymbolContextTree::predictPercept(prediction_t &p) const {
+    std::vector<node_index_t> path;
+    std::vector<uint64_t> keys;
+    walk(phase(), path, keys);
+
+    // Below the deepest node seen the contexts are new, and a chain of new
+    // contexts predicts with the global estimate alone
+    p.candidates.clear();
+    p.global = 0.0;
+    double remaining = 1.0;
+    for (size_t d = 0; d < path.size(); d++) {
+        const node_t &node = m_nodes[path[d]];
+        double stop = d == m_levels ?
+                1.0 :
+                exp2(node.log_prob_est - 1 - node.log_prob_weighted);
+        double weight = remaining * stop;
+        remaining -= weight;
+
+        double total = node.visits + SymbolConcentration;
+        p.global += weight * SymbolConcentration / total;
+        if (d == 0) {
+            p.root = weight / total;
+            continue;
+        }
+        for (size_t i = 0; i < node.counts.size(); i++)
+            p.candidates.push_back(
+                    std::make_pair(node.counts[i].symbol,
+                            weight * node.counts[i].count / total));
+    }
+    p.global += remaining;
+    p.bits = 0;
+}
+
+// the prediction for the percept under way, worked out at its first bit
+// and narrowed as its bits arrive
+SymbolContextTree::prediction_t &SymbolContextTree::prediction(
+        void) const {
+    unsigned long long start = m_version - phase();
+    if (m_prediction.version != start) {
+        predictPercept(m_prediction);
+        m_prediction.version = start;
+    }
+    return m_prediction;
+}
+
+// The probability of the next percept bit: the probability of the percepts
+// starting with the bits so far and this one, over that of those starting
+// with the bits so far
+double SymbolContextTree::logProbBit(const prediction_t &p, uint64_t prefix,
+        size_t bits, symbol_t sym) const {
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+    uint64_t next = prefix | (uint64_t(sym) << bits);
+    uint64_t next_mask = (uint64_t(1) << (bits + 1)) - 1;
+
+    double mass = p.root * prefixCount(prefix, bits).count
+            + p.global * globalEstimate(prefix, bits);
+    double next_mass = p.root * prefixCount(next, bits + 1).count
+            + p.global * globalEstimate(next, bits + 1);
+    for (size_t i = 0; i < p.candidates.size(); i++) {
+        if ((p.candidates[i].first & mask) != prefix)
+            continue;
+        mass += p.candidates[i].second;
+        if ((p.candidates[i].first & next_mask) == next)
+            next_mass += p.candidates[i].second;
+    }
+    return log2(next_mass) - log2(mass);
+}
+
+// Calculate the probability of the next percept bit from the prediction
+// for the percept, dropping the candidates the bits so far rule out
+double SymbolContextTree::getLogProbNextSymbolGivenH(symbol_t sym) const {
+    size_t bits = phase();
+    // action bits are not predicted
+    if (bits >= m_percept_bits)
+        return -1.0;
+
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < bits; i++)
+        prefix |= uint64_t(m_history.recent(bits - 1 - i)) << i;
+
+    // drop the candidates the bits since the last call rule out
+    prediction_t &p = prediction();
+    if (p.bits < bits) {
+        uint64_t mask = (uint64_t(1) << bits) - 1;
+        size_t kept = 0;
+        for (size_t i = 0; i < p.candidates.size(); i++)
+            if ((p.candidates[i].first & mask) == prefix)
+                p.candidates[kept++] = p.candidates[i];
+        p.candidates.resize(kept);
+        p.bits = bits;
+    }
+    return logProbBit(p, prefix, bits, sym);
+}
+
+// The probability of a block of bits from a prediction of its own, so the
+// one kept for the percept under way is left alone. Action bits are not
+// predicted, and within a percept the tree does not change.
+double SymbolContextTree::logProbBlock(uint64_t block, size_t n,
+        size_t first) const {
+    size_t bits = phase();
+    assert(n <= 64 && first <= n && bits + n <= m_cycle_bits);
+
+    uint64_t prefix = 0;
+    prediction_t p;
+    if (bits < m_percept_bits) {
+        for (size_t i = 0; i < bits; i++)
+            prefix |= uint64_t(m_history.recent(bits - 1 - i)) << i;
+        predictPercept(p);
+    }
+
+    double log_prob = 0.0;
+    for (size_t i = 0; i < n; i++, bits++) {
+        symbol_t sym = (block >> i) & 1;
+        if (bits >= m_percept_bits) {
+            if (i >= first)
+                log_prob -= 1.0;
+            continue;
+        }
+        if (i >= first)
+            log_prob += logProbBit(p, prefix, bits, sym);
+        prefix |= uint64_t(sym) << bits;
+    }
+    return log_prob;
+}
+
+// generate a single random bit distributed according to the tree and
+// update the tree with it
+symbol_t SymbolContextTree::genRandomSymbolAndUpdate(void) {
+    symbol_t sym = (rand01() > predict(false));
+    update(sym);
+    return sym;
+}
+
+// the logarithm of the block probability of the percepts seen
+double SymbolContextTree::logBlockProbability(void) const {
+    return m_nodes[0].log_prob_weighted;
+}
+
+// node and alphabet counts
+void SymbolContextTree::logStats(std::ostream &out) const {
+    out << "symbol context tree: " << size() << " nodes, "
+            << alphabetSize() << " distinct percepts" << std::endl;
+}
+
+// Node count and the memory held, counting the hash maps' entries at the
+// size of a key, a value and a link each
+void SymbolContextTree::stats(model_stats_t &stats) const {
+    ContextModel::stats(stats);
+    stats.bytes += m_nodes.capacity() * sizeof(node_t)
+            + m_free.capacity() * sizeof(node_index_t)
+            + m_count_entries * sizeof(symbol_count_t)
+            + m_children.size()
+                    * (sizeof(uint64_t) + sizeof(node_index_t) + sizeof(void*))
+            + m_prefixes.size()
+                    * (sizeof(uint64_t) + sizeof(prefix_count_t)
+                            + sizeof(void*));
+}
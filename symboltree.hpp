@@ -0,0 +1,205 @@
+#ifndef __SYMBOLTREE_HPP__
+#define __SYMBOLTREE_HPP__
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "main.hpp"
+#include "predict.hpp"
+
+// A k-ary context tree over whole symbols. Each level of the context is a
+// whole action or percept, the most recent action first, so a context of d
+// cycles takes 2d levels however wide the symbols are. Every node estimates
+// the next percept with a Dirichlet estimator centred on a global KT
+// estimate over the percepts observed so far, which keeps an escape for the
+// percepts never seen, and nodes are mixed along the context as in binary
+// CTW.
+//
+// The model is driven through the binary interface: the bits of a percept
+// are only held in the history until its last bit arrives, when the whole
+// percept is added to the tree. The probability of a single bit is that of
+// the percepts sharing the bits so far. Cycles are expected to start with
+// the percept at history sizes that are multiples of the cycle length, as
+// the agent feeds them; action bits are not predicted.
+class SymbolContextTree: public ContextModel {
+public:
+
+    // create a symbol context tree of the given number of levels for
+    // percepts and actions of the given widths, keeping enough history to
+    // revert the given number of bits
+    SymbolContextTree(size_t levels, size_t percept_bits, size_t action_bits,
+            size_t lookahead = 0);
+
+    virtual ~SymbolContextTree(void);
+
+    // clear the entire context tree
+    virtual void clear(void);
+
+    // truncate the history to the context span, on a cycle boundary
+    virtual void resetHistory(void);
+
+    // append a bit to the history, adding the percept it completes
+    using ContextModel::update;
+    virtual void update(const symbol_t sym);
+
+    // append a bit to the history without updating the tree
+    using ContextModel::updateHistory;
+    virtual void updateHistory(const symbol_t sym);
+
+    // remove the last percept from the tree if the last bit completed it
+    virtual void revert(void);
+
+    // shrinks the history down to a former size
+    virtual void revertHistory(size_t newsize);
+
+    // generate a single random bit distributed according to the tree and
+    // update the tree with it
+    virtual symbol_t genRandomSymbolAndUpdate(void);
+
+    // the logarithm of the block probability of the percepts seen
+    virtual double logBlockProbability(void) const;
+
+    // Calculate the probability of the next percept bit given the history
+    // and the bits of the percept so far, without modifying the tree
+    virtual double getLogProbNextSymbolGivenH(symbol_t sym) const;
+
+    // The probability of a block of bits, from one prediction of the
+    // percept under way and without modifying the tree. The tree only
+    // changes when a percept completes, so the block may run on to the end
+    // of the cycle but not into the next percept.
+    virtual double logProbBlock(uint64_t block, size_t n,
+            size_t first = 0) const;
+
+    // node and alphabet counts
+    virtual void logStats(std::ostream &out) const;
+
+    // node count and an estimate of the memory held
+    virtual void stats(model_stats_t &stats) const;
+
+    // number of nodes in the context tree, including the root
+    virtual size_t size(void) const {
+        return m_nodes.size() - m_free.size();
+    }
+
+    // number of distinct percepts observed
+    size_t alphabetSize(void) const {
+        return prefixCount(0, 0).distinct;
+    }
+
+private:
+    // a symbol seen in a context and how often
+    struct symbol_count_t {
+        uint64_t symbol;
+        count_t count;
+    };
+
+    // a context of whole symbols
+    struct node_t {
+        weight_t log_prob_est;      // log estimated probability
+        weight_t log_prob_weighted; // log weighted block probability
+        weight_t log_prob_children; // sum of the children's weighted ones
+        count_t visits;
+        std::vector<symbol_count_t> counts; // percepts seen, in no order
+    };
+
+    // how often the percepts with a given prefix have been observed, and
+    // how many distinct ones
+    struct prefix_count_t {
+        count_t count;
+        count_t distinct;
+    };
+
+    // The probability of the percepts after the current context, for the
+    // bits of a percept to be predicted from: the weighted counts of the
+    // nodes below the root, narrowed to the percepts that match the bits
+    // so far, plus a share of the global estimate.
+    struct prediction_t {
+        unsigned long long version; // model version at the percept's start
+        double root;   // weight of the root's counts
+        double global; // weight of the global estimate
+        size_t bits;   // bits the candidates have been narrowed to
+        std::vector<std::pair<uint64_t, double> > candidates;
+    };
+
+    // take a fresh node from the arena, reusing released slots first
+    node_index_t newNode(void);
+
+    // return a node to the arena's free list
+    void freeNode(node_index_t index);
+
+    // number of bits of history since the last cycle started
+    size_t phase(void) const {
+        return m_history.size() % m_cycle_bits;
+    }
+
+    // the symbol read from the history at the given level of the context
+    // starting at the given age
+    uint64_t contextSymbol(size_t level, size_t &age) const;
+
+    // collect the nodes along the context starting at the given age, down
+    // to the first context not seen yet, with the child map key of each
+    void walk(size_t age, std::vector<node_index_t> &path,
+            std::vector<uint64_t> &keys) const;
+
+    // the key of the percepts starting with the given bits
+    static uint64_t prefixKey(uint64_t prefix, size_t bits) {
+        return (uint64_t(bits) << 32) | prefix;
+    }
+
+    // the observations of the percepts starting with the given bits
+    prefix_count_t prefixCount(uint64_t prefix, size_t bits) const;
+
+    // count a percept in, or out of, the observations
+    void observe(uint64_t symbol, int step);
+
+    // the global estimate of the percepts starting with the given bits
+    double globalEstimate(uint64_t prefix, size_t bits) const;
+
+    // the estimate of a percept in a node
+    double estimate(const node_t &node, uint64_t symbol) const;
+
+    // add or remove the percept held by the most recent bits
+    void addPercept(void);
+    void removePercept(void);
+
+    // fill in the probabilities of the percepts after the current context
+    void predictPercept(prediction_t &p) const;
+
+    // the probabilities of the percepts after the current context, kept
+    // until the tree or the history changes
+    prediction_t &prediction(void) const;
+
+    // the log probability of the next bit of a percept starting with the
+    // given bits, counting the candidates of a prediction that match them
+    double logProbBit(const prediction_t &p, uint64_t prefix, size_t bits,
+            symbol_t sym) const;
+
+    size_t m_levels;       // levels of whole symbols
+    size_t m_percept_bits;
+    size_t m_action_bits;
+    size_t m_cycle_bits;   // bits of one percept and one action
+
+    // Node arena; the root lives at index 0. Children are found through a
+    // hash map keyed by the parent and the context symbol.
+    std::vector<node_t> m_nodes;
+    std::vector<node_index_t> m_free;
+    std::unordered_map<uint64_t, node_index_t> m_children;
+    size_t m_count_entries; // symbol counts held by all nodes
+
+    // how often the percepts of every prefix have been observed, the
+    // empty prefix holding the totals
+    std::unordered_map<uint64_t, prefix_count_t> m_prefixes;
+
+    // changes to the tree or the history so far, and the prediction for
+    // the percept being generated
+    unsigned long long m_version;
+    mutable prediction_t m_prediction;
+
+    // scratch buffers of the current walk: the nodes along the context and
+    // their keys in the child map
+    std::vector<node_index_t> m_path;
+    std::vector<uint64_t> m_path_keys;
+};
+
+#endif // __SYMBOLTREE_HPP__
@@ -0,0 +1,49 @@
+#ifndef __CHECK_HPP__
+#define __CHECK_HPP__
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "main.hpp"
+
+// Fail the test with the location of a check that does not hold, whether
+// or not assertions are compiled in
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+// The logs main.cpp defines for the agent; each test is a single source,
+// so they are defined here
+namespace aixi {
+std::ofstream log;
+}
+std::ofstream compactLog;
+
+// the agent options main.cpp starts from, before a configuration file
+inline void setDefaultOptions(options_t &options) {
+    options["ct-depth"] = "3";
+    options["ct-factored"] = "0";
+    options["ct-backend"] = "exact";
+    options["ct-shadow"] = "hashed";
+    options["ct-hash-memory"] = "256";
+    options["max-ct-nodes"] = "0";
+    options["ct-lazy-depth"] = "0";
+    options["ct-lazy-visits"] = "0";
+    options["ct-context"] = "";
+    options["ct-overlay"] = "0";
+    options["ct-journal"] = "1";
+    options["ct-arena-dir"] = "";
+    options["search-frozen"] = "0";
+    options["rollout-ct-depth"] = "0";
+    options["agent-horizon"] = "16";
+    options["timeout"] = "0.5";
+    options["UCB-weight"] = "1.41";
+}
+
+#endif // __CHECK_HPP__
@@ -0,0 +1,64 @@
+// The compressed tree gives the probabilities the exact tree gives, under
+// the same updates and reverts
+#include "predict.hpp"
+#include "compressedtree.hpp"
+#include "util.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// the next symbol of a periodic stream with some noise
+static symbol_t nextSymbol(size_t i) {
+    return rand() % 4 == 0 ? symbol_t(rand() & 1) : symbol_t(i % 5 < 2);
+}
+
+static void checkDepth(size_t depth) {
+    ContextTree exact(depth, 64);
+    CompressedContextTree compressed(depth, 64);
+    for (size_t i = 0; i < depth; i++) {
+        symbol_t sym = nextSymbol(i);
+        exact.updateHistory(sym);
+        compressed.updateHistory(sym);
+    }
+
+    double error = 0.0;
+    for (size_t i = 0; i < 5000; i++) {
+        double p = exact.getLogProbNextSymbolGivenH(0);
+        double q = compressed.getLogProbNextSymbolGivenH(0);
+        error = std::max(error, fabs(p - q));
+        CHECK(fabs(p - q) < 1e-8);
+
+        // a few symbols added and taken back, as a simulation does
+        if (i % 7 == 0) {
+            size_t n = 1 + rand() % 8;
+            for (size_t k = 0; k < n; k++) {
+                symbol_t sym = nextSymbol(i + k);
+                exact.update(sym);
+                compressed.update(sym);
+            }
+            for (size_t k = 0; k < n; k++) {
+                exact.revert();
+                compressed.revert();
+                exact.revertHistory(exact.historySize() - 1);
+                compressed.revertHistory(compressed.historySize() - 1);
+            }
+        }
+
+        symbol_t sym = nextSymbol(i);
+        exact.update(sym);
+        compressed.update(sym);
+    }
+    double total = exact.logBlockProbability();
+    CHECK(fabs(total - compressed.logBlockProbability()) < 1e-9 * -total);
+    printf("depth %zu: max error %g, %zu nodes for %zu\n", depth, error,
+            compressed.size(), exact.size());
+}
+
+int main(void) {
+    srand(7);
+    const size_t depths[] = { 1, 8, 63, 64, 65, 96, 200 };
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+        checkDepth(depths[i]);
+    return 0;
+}
@@ -0,0 +1,45 @@
+// The hashed tree predicts each symbol as updating it with the symbol
+// would change its block probability, also once its table is full
+#include "hashtree.hpp"
+#include "util.hpp"
+#include "check.hpp"
+
+#include <cmath>
+
+int main(void) {
+    srand(1);
+    const size_t depth = 16;
+    // room for a few hundred contexts
+    HashedContextTree tree(depth, 16 << 10);
+    for (size_t i = 0; i < depth; i++)
+        tree.updateHistory(symbol_t(i & 1));
+
+    symbol_t last[2] = { 1, 0 };
+    size_t checked = 0;
+    for (int i = 0; i < 20000; i++) {
+        double log_p0 = tree.getLogProbNextSymbolGivenH(0);
+        double log_p1 = tree.getLogProbNextSymbolGivenH(1);
+        // evicted contexts leave stale weights in their parents
+        if (tree.evictions() == 0)
+            CHECK(fabs(exp2(log_p0) + exp2(log_p1) - 1.0) < 1e-8);
+
+        // a symbol depending on the last two, with noise
+        symbol_t sym = symbol_t(last[0] ^ last[1] ^ (rand01() < 0.1));
+        last[1] = last[0];
+        last[0] = sym;
+        double before = tree.logBlockProbability();
+        unsigned long long evictions = tree.evictions();
+        tree.update(sym);
+        // an eviction may take a context the prediction read
+        if (tree.evictions() == evictions) {
+            double change = tree.logBlockProbability() - before;
+            CHECK(fabs(change - (sym ? log_p1 : log_p0)) < 1e-8);
+            checked++;
+        }
+    }
+    printf("%zu of %zu slots used, %llu evictions, %zu updates checked\n",
+            tree.size() - 1, tree.capacity(), tree.evictions(), checked);
+    CHECK(tree.size() - 1 == tree.capacity());
+    CHECK(checked > 1000);
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Bound the error of the table-driven log-domain arithmetic against the
+// exact formulas, worked out in long double
+#include "logmath.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// exact log2 of the KT estimate of a sequence with the given counts
+static long double exactLogKT(unsigned int count_0, unsigned int count_1) {
+    return (lgammal(count_0 + 0.5L) + lgammal(count_1 + 0.5L)
+            - lgammal(count_0 + count_1 + 1.0L) - 2 * lgammal(0.5L))
+            / logl(2.0L);
+}
+
+// exact log2(1 + 2^x)
+static long double exactLogAdd(long double x) {
+    return x > 0 ? x + log1pl(exp2l(-x)) / logl(2.0L) :
+            log1pl(exp2l(x)) / logl(2.0L);
+}
+
+int main(void) {
+    // the KT multiplier, from the tables and past them
+    double error = 0.0;
+    for (unsigned int n = 0; n < 2 * LogKTTableSize; n++) {
+        for (unsigned int a = 0; a <= n; a++) {
+            long double exact = log2l((a + 0.5L) / (n + 1.0L));
+            error = std::max(error,
+                    double(fabsl(logKTMultiplier(a, n) - exact)));
+        }
+    }
+    printf("KT multiplier: max error %g\n", error);
+    CHECK(error < 1e-14);
+
+    // The KT estimate: table sums below the bound, lgamma above it. Both
+    // lose precision with the number of symbols, so the error is relative
+    // to the size of the estimate.
+    double table = 0.0, fallback = 0.0;
+    for (unsigned int n = 1; n < 2 * LogKTTableSize; n++) {
+        for (unsigned int a = 0; a <= n; a++) {
+            long double exact = exactLogKT(a, n - a);
+            double e = fabsl(logKTEstimate(a, n - a) - exact) / n;
+            if (n < LogKTTableSize)
+                table = std::max(table, e);
+            else
+                fallback = std::max(fallback, e);
+        }
+    }
+    printf("KT estimate: max error per symbol %g from the tables, %g from "
+            "lgamma\n", table, fallback);
+    CHECK(table < 1e-14);
+    CHECK(fallback < 1e-14);
+
+    // across the boundary the two ways agree
+    for (unsigned int a = 0; a < LogKTTableSize; a++) {
+        unsigned int b = LogKTTableSize - 1 - a;
+        double summed = logKTEstimate(a, b) + logKTMultiplier(a, a + b);
+        double formula = logKTEstimate(a + 1, b);
+        CHECK(fabs(summed - formula) < 1e-12 * fabs(formula));
+    }
+
+    // log2(1 + 2^x) over the interpolated range and past both ends
+    error = 0.0;
+    double outside = 0.0;
+    const double range = LogAddTableRange;
+    for (double x = -4 * range; x <= 4 * range; x += 1.0 / 1024 + 1e-7) {
+        double e = fabsl(logOnePlusExp2(x) - exactLogAdd(x));
+        if (fabs(x) < range)
+            error = std::max(error, e);
+        else
+            outside = std::max(outside, e);
+    }
+    printf("log2(1 + 2^x): max error %g inside the table, %g outside\n",
+            error, outside);
+    CHECK(error < 2e-9);
+    CHECK(outside < 1e-14);
+
+    // the weighted mix
+    error = 0.0;
+    for (double a = -3000; a <= 0; a += 7.3) {
+        for (double b = -3000; b <= 0; b += 11.9) {
+            long double hi = std::max(a, b), lo = std::min(a, b);
+            long double exact = hi + exactLogAdd(lo - hi) - 1;
+            error = std::max(error,
+                    double(fabsl(logWeightedMix(a, b) - exact)));
+        }
+    }
+    printf("weighted mix: max error %g\n", error);
+    CHECK(error < 2e-9 + 1e-12);
+    return 0;
+}
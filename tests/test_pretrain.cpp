@@ -0,0 +1,79 @@
+// Pretraining on a recorded run leaves the model as updating it cycle by
+// cycle would, including factored trees masked to different spans
+#include "agent.hpp"
+#include "check.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// the agent tiger.conf sets up, with the given context tree options
+static void tigerOptions(options_t &options, const char *factored,
+        const char *context) {
+    setDefaultOptions(options);
+    options["agent-actions"] = "4";
+    options["observation-bits"] = "2";
+    options["reward-bits"] = "8";
+    options["ct-depth"] = "8";
+    options["ct-factored"] = factored;
+    options["ct-context"] = context;
+}
+
+// pretrain one agent on the log and feed its cycles to another, then
+// compare what they predict
+static void checkPretrain(const std::string &path,
+        const std::vector<std::vector<long long> > &cycles,
+        const char *factored, const char *context) {
+    options_t options;
+    tigerOptions(options, factored, context);
+    Agent pretrained(options), updated(options);
+    CHECK(pretrained.pretrain(path));
+    for (size_t i = 0; i < cycles.size(); i++) {
+        updated.modelUpdate(percept_t(cycles[i][0]), percept_t(cycles[i][1]));
+        updated.modelUpdate(action_t(cycles[i][2]));
+    }
+    CHECK(pretrained.historySize() == updated.historySize());
+    for (percept_t obs = 0; obs < 4; obs++) {
+        for (percept_t rew = 90; rew <= 110; rew += 10) {
+            double p = pretrained.perceptProbability(obs, rew);
+            double q = updated.perceptProbability(obs, rew);
+            CHECK(fabs(log2(p) - log2(q)) < 1e-9);
+        }
+    }
+}
+
+int main(void) {
+    // the first 2000 lines of a recorded tiger run
+    std::ifstream in("logs/tiger-ryk-6.complete.csv");
+    CHECK(in.is_open());
+    char path[] = "/tmp/test_pretrain_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    std::ofstream out(path);
+    std::vector<std::vector<long long> > cycles;
+    std::string line, field;
+    for (size_t lineno = 1; lineno <= 2000 && std::getline(in, line);
+            lineno++) {
+        out << line << "\n";
+        if (lineno == 1)
+            continue;
+        std::vector<long long> values;
+        std::istringstream fields(line);
+        while (std::getline(fields, field, ','))
+            values.push_back(strtoll(field.c_str(), NULL, 10));
+        std::vector<long long> cycle(values.begin() + 2, values.begin() + 5);
+        cycles.push_back(cycle);
+    }
+    out.close();
+
+    checkPretrain(path, cycles, "0", "");
+    checkPretrain(path, cycles, "1", "");
+    // tree i of a factored model spans one more symbol than tree i - 1
+    checkPretrain(path, cycles, "1", "observation:1,action:1");
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Snapshots that name more nodes or words than they hold are rejected
+// before their sizes are worked out, rather than wrapping round
+#include "predict.hpp"
+#include "util.hpp"
+#include "check.hpp"
+
+#include <cstring>
+#include <sstream>
+#include <string>
+
+// load a snapshot held in a string into a fresh tree of the given depth
+static bool loadSnapshot(const std::string &snapshot, size_t depth) {
+    ContextTree tree(depth);
+    const char *data = snapshot.data(), *end = data + snapshot.size();
+    return tree.load(data, end);
+}
+
+// overwrite the 64-bit word at the given index of a snapshot
+static std::string patchWord(std::string snapshot, size_t index,
+        uint64_t word) {
+    memcpy(&snapshot[index * sizeof(word)], &word, sizeof(word));
+    return snapshot;
+}
+
+int main(void) {
+    const size_t depth = 8;
+    ContextTree tree(depth);
+    for (int i = 0; i < 200; i++)
+        tree.update(symbol_t(i % 3 == 0));
+    std::ostringstream out;
+    CHECK(tree.save(out));
+    std::string snapshot = out.str();
+    CHECK(loadSnapshot(snapshot, depth));
+
+    // the node count follows the depth, the context ages, the lazy
+    // extension and the node size
+    size_t n_nodes_word = 2 + 0 + 3;
+    const void *block;
+    uint64_t n_nodes;
+    const char *data = snapshot.data() + n_nodes_word * sizeof(uint64_t);
+    CHECK(readWord(data, snapshot.data() + snapshot.size(), n_nodes));
+    CHECK(n_nodes == tree.size());
+
+    const uint64_t counts[] = {
+        n_nodes + 1,
+        uint64_t(1) << 32,
+        SIZE_MAX / sizeof(CTNode) + 2,
+        uint64_t(1) << 63,
+        UINT64_MAX,
+    };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        CHECK(!loadSnapshot(patchWord(snapshot, n_nodes_word, counts[i]),
+                depth));
+
+    // a block whose padding would wrap its size
+    data = snapshot.data();
+    CHECK(!readBlock(data, snapshot.data() + snapshot.size(), block,
+            SIZE_MAX - 3));
+    CHECK(data == snapshot.data());
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 
 // Return a random number uniformly distributed in [0, 1]
 double rand01() {
@@ -48,3 +49,39 @@ void encode(symbol_list_t &symlist, unsigned int value, unsigned int bits) {
     }
 }
 
+
+// Write a block of bytes, padded to a whole number of 8-byte words
+void writeBlock(std::ostream &out, const void *data, size_t bytes) {
+    static const char padding[8] = { 0 };
+    out.write(static_cast<const char *>(data), bytes);
+    out.write(padding, (8 - bytes % 8) % 8);
+}
+
+// Write a single 64-bit word
+void writeWord(std::ostream &out, uint64_t word) {
+    writeBlock(out, &word, sizeof(word));
+}
+
+// Point at the next block of a snapshot held in memory and step past it,
+// together with its padding
+bool readBlock(const char *&data, const char *end, const void *&block,
+        size_t bytes) {
+    // the padding would wrap the size round
+    if (bytes > SIZE_MAX - 7)
+        return false;
+    size_t padded = bytes + (8 - bytes % 8) % 8;
+    if (size_t(end - data) < padded)
+        return false;
+    block = data;
+    data += padded;
+    return true;
+}
+
+// Read a single 64-bit word
+bool readWord(const char *&data, const char *end, uint64_t &word) {
+    const void *block;
+    if (!readBlock(data, end, block, sizeof(word)))
+        return false;
+    memcpy(&word, block, sizeof(word));
+    return true;
+}
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <stdint.h>
 
 #include "main.hpp"
 
@@ -35,4 +36,19 @@ T strExtract(std::string &str) {
 unsigned int decode(const symbol_list_t &symlist, unsigned int bits);
 void encode(symbol_list_t &symlist, unsigned int value, unsigned int bits);
 
+// Write a block of bytes to a binary snapshot, padded with zeros to a
+// whole number of 8-byte words so that every block stays aligned
+void writeBlock(std::ostream &out, const void *data, size_t bytes);
+
+// Write a single 64-bit word to a binary snapshot
+void writeWord(std::ostream &out, uint64_t word);
+
+// Point at the next block of a snapshot held in memory and step past it,
+// false if fewer than the given number of bytes remain
+bool readBlock(const char *&data, const char *end, const void *&block,
+        size_t bytes);
+
+// Read a single 64-bit word from a snapshot held in memory
+bool readWord(const char *&data, const char *end, uint64_t &word);
+
 #endif // __UTIL_HPP__